@@ -64,6 +64,9 @@
 #include "util/xxhash.h"
 #include "hdfs/env_hdfs.h"
 #include "utilities/merge_operators.h"
+#ifdef ROCKSDB_SCREEDB
+#include "utilities/screedb/screedb.h"
+#endif  // ROCKSDB_SCREEDB
 
 #ifdef OS_WIN
 #include <io.h>  // open/close
@@ -512,6 +515,28 @@ DEFINE_uint64(transaction_lock_timeout, 100,
               " milliseconds before failing a transaction waiting on a lock");
 #endif  // ROCKSDB_LITE
 
+#ifdef ROCKSDB_SCREEDB
+DEFINE_bool(use_screedb, false,
+            "Open a ScreeDB persistent tree instead of the LSM tree. Options "
+            "that tune memtables, files and compaction don't apply.");
+
+DEFINE_string(screedb_pool_path, "/dev/shm/screedb",
+              "Pool file for ScreeDB, removed before fresh benchmarks unless "
+              "--use_existing_db is set (used with --use_screedb only)");
+
+DEFINE_uint64(screedb_pool_size, 0,
+              "Bytes when creating the ScreeDB pool file, 0 for the ScreeDB "
+              "default (used with --use_screedb only)");
+
+DEFINE_uint64(screedb_cache_size, 0,
+              "Bytes of DRAM to cache hot ScreeDB values, 0 to disable "
+              "(used with --use_screedb only)");
+
+DEFINE_bool(screedb_hash_index, false,
+            "Index ScreeDB keys by hash for point lookups "
+            "(used with --use_screedb only)");
+#endif  // ROCKSDB_SCREEDB
+
 DEFINE_bool(compaction_measure_io_stats, false,
             "Measure times spents on I/Os while in compactions. ");
 
@@ -1811,6 +1836,7 @@ class Benchmark {
         options.wal_dir = FLAGS_wal_dir;
       }
       DestroyDB(FLAGS_db, options);
+      DestroyScreeDB();
     }
   }
 
@@ -1886,6 +1912,15 @@ class Benchmark {
     return base_name + ToString(id);
   }
 
+  // Removes the ScreeDB pool file, if benchmarking ScreeDB.
+  void DestroyScreeDB() {
+#ifdef ROCKSDB_SCREEDB
+    if (FLAGS_use_screedb) {
+      FLAGS_env->DeleteFile(FLAGS_screedb_pool_path);
+    }
+#endif  // ROCKSDB_SCREEDB
+  }
+
   void Run() {
     if (!SanityCheck()) {
       exit(1);
@@ -2055,6 +2090,7 @@ class Benchmark {
           if (db_.db != nullptr) {
             db_.DeleteDBs();
             DestroyDB(FLAGS_db, open_options_);
+            DestroyScreeDB();
           }
           for (size_t i = 0; i < multi_dbs_.size(); i++) {
             delete multi_dbs_[i].db;
@@ -2066,7 +2102,16 @@ class Benchmark {
       }
 
       if (method != nullptr) {
+#ifdef ROCKSDB_SCREEDB
+        if (FLAGS_use_screedb) {
+          fprintf(stdout, "ScreeDB pool: [%s]\n",
+                  FLAGS_screedb_pool_path.c_str());
+        } else {
+          fprintf(stdout, "DB path: [%s]\n", FLAGS_db.c_str());
+        }
+#else
         fprintf(stdout, "DB path: [%s]\n", FLAGS_db.c_str());
+#endif  // ROCKSDB_SCREEDB
         RunBenchmark(num_threads, name, method);
       }
       if (post_process_method != nullptr) {
@@ -2633,6 +2678,17 @@ class Benchmark {
     }
 #endif  // ROCKSDB_LITE
 
+#ifdef ROCKSDB_SCREEDB
+    if (FLAGS_use_screedb &&
+        (FLAGS_readonly || FLAGS_transaction_db ||
+         FLAGS_optimistic_transaction_db || FLAGS_num_multi_db > 1)) {
+      fprintf(stderr,
+              "Cannot use readonly, transaction_db, optimistic_transaction_db "
+              "or num_multi_db flags with use_screedb\n");
+      exit(1);
+    }
+#endif  // ROCKSDB_SCREEDB
+
     if (FLAGS_num_multi_db <= 1) {
       OpenDb(options, FLAGS_db, &db_);
     } else {
@@ -2649,6 +2705,12 @@ class Benchmark {
 
   void OpenDb(const Options& options, const std::string& db_name,
       DBWithColumnFamilies* db) {
+#ifdef ROCKSDB_SCREEDB
+    if (FLAGS_use_screedb) {
+      OpenScreeDB(options, db);
+      return;
+    }
+#endif  // ROCKSDB_SCREEDB
     Status s;
     // Open with column families if necessary.
     if (FLAGS_num_column_families > 1) {
@@ -2716,6 +2778,49 @@ class Benchmark {
     }
   }
 
+#ifdef ROCKSDB_SCREEDB
+  // Opens the pool named by --screedb_pool_path, with column families as
+  // separate trees in the pool. Benchmarks then use it through the DB API.
+  void OpenScreeDB(const Options& options, DBWithColumnFamilies* db) {
+    screedb::ScreeDBOptions screedb_options;
+    if (FLAGS_screedb_pool_size > 0) {
+      screedb_options.pool_size = FLAGS_screedb_pool_size;
+    }
+    screedb_options.cache_size = FLAGS_screedb_cache_size;
+    screedb_options.hash_index = FLAGS_screedb_hash_index;
+    screedb::ScreeDB* screedb = nullptr;
+    Status s;
+    if (FLAGS_num_column_families > 1) {
+      size_t num_hot = FLAGS_num_column_families;
+      if (FLAGS_num_hot_column_families > 0 &&
+          FLAGS_num_hot_column_families < FLAGS_num_column_families) {
+        num_hot = FLAGS_num_hot_column_families;
+      } else {
+        FLAGS_num_hot_column_families = FLAGS_num_column_families;
+      }
+      std::vector<ColumnFamilyDescriptor> column_families;
+      for (size_t i = 0; i < num_hot; i++) {
+        column_families.push_back(ColumnFamilyDescriptor(
+              ColumnFamilyName(i), ColumnFamilyOptions(options)));
+      }
+      s = screedb::ScreeDB::Open(DBOptions(options), screedb_options,
+                                 FLAGS_screedb_pool_path, column_families,
+                                 &db->cfh, &screedb);
+      db->cfh.resize(FLAGS_num_column_families);
+      db->num_created = num_hot;
+      db->num_hot = num_hot;
+    } else {
+      s = screedb::ScreeDB::Open(options, screedb_options,
+                                 FLAGS_screedb_pool_path, &screedb);
+    }
+    if (!s.ok()) {
+      fprintf(stderr, "open error: %s\n", s.ToString().c_str());
+      exit(1);
+    }
+    db->db = screedb;
+  }
+#endif  // ROCKSDB_SCREEDB
+
   enum WriteMode {
     RANDOM, SEQUENTIAL, UNIQUE_RANDOM
   };
@@ -2950,6 +3055,7 @@ class Benchmark {
         int64_t key_rand = thread->rand.Next() & (pot - 1);
         GenerateKeyFromInt(key_rand, FLAGS_num, &key);
         ++read;
+        value.clear();
         auto status = db->Get(options, key, &value);
         if (status.ok()) {
           ++found;
@@ -3017,6 +3123,7 @@ class Benchmark {
       GenerateKeyFromInt(key_rand, FLAGS_num, &key);
       read++;
       Status s;
+      value.clear();  // ScreeDB appends to values rather than replacing them
       if (FLAGS_num_column_families > 1) {
         s = db_with_cfh->db->Get(options, db_with_cfh->GetCfh(key_rand), key,
                                  &value);
@@ -3485,6 +3592,7 @@ class Benchmark {
       }
       if (get_weight > 0) {
         // do all the gets first
+        value.clear();
         Status s = db->Get(options, key, &value);
         if (!s.ok() && !s.IsNotFound()) {
           fprintf(stderr, "get error: %s\n", s.ToString().c_str());
@@ -3533,6 +3641,7 @@ class Benchmark {
       DB* db = SelectDB(thread);
       GenerateKeyFromInt(thread->rand.Next() % FLAGS_num, FLAGS_num, &key);
 
+      value.clear();
       auto status = db->Get(options, key, &value);
       if (status.ok()) {
         ++found;
@@ -3576,6 +3685,7 @@ class Benchmark {
       DB* db = SelectDB(thread);
       GenerateKeyFromInt(thread->rand.Next() % FLAGS_num, FLAGS_num, &key);
 
+      value.clear();
       auto status = db->Get(options, key, &value);
       if (status.ok()) {
         ++found;
@@ -3687,6 +3797,7 @@ class Benchmark {
         num_merges++;
         thread->stats.FinishedOps(nullptr, db, 1, kMerge);
       } else {
+        value.clear();
         Status s = db->Get(options, key, &value);
         if (value.length() > max_length)
           max_length = value.length();
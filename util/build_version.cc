@@ -0,0 +1,4 @@
+#include "build_version.h"
+const char* rocksdb_build_git_sha = "rocksdb_build_git_sha:9fa54de6aa9f809a3133878d800d4c9630346e79";
+const char* rocksdb_build_git_date = "rocksdb_build_git_date:2026-10-16";
+const char* rocksdb_build_compile_date = __DATE__;
@@ -37,9 +37,26 @@
 #endif
 
 #include <iostream>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
-#include <list>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include "db/dbformat.h"
+#include "rocksdb/sst_file_writer.h"
+#include "table/internal_iterator.h"
+#include "table/table_builder.h"
+#include "table/table_reader.h"
+#include "util/coding.h"
+#include "util/file_reader_writer.h"
 #include "screedb.h"
 
 #define DO_LOG 0
@@ -48,38 +65,535 @@
 namespace rocksdb {
 namespace screedb {
 
+// Iterates over user keys of a table written by SstFileWriter, for loading with AddFile.
+// Kept out of the header since table iterators are internal to RocksDB.
+class ScreeDBTableIterator : public Iterator {
+public:
+  explicit ScreeDBTableIterator(InternalIterator* iter) : iter_(iter) {}
+  bool Valid() const override { return status_.ok() && iter_->Valid(); }
+  void SeekToFirst() override { iter_->SeekToFirst(); Parse(); }
+  void SeekToLast() override { iter_->SeekToLast(); Parse(); }
+  void Seek(const Slice& target) override {
+    iter_->Seek(InternalKey(target, kMaxSequenceNumber, kValueTypeForSeek).Encode());
+    Parse();
+  }
+  void Next() override { iter_->Next(); Parse(); }
+  void Prev() override { iter_->Prev(); Parse(); }
+  Slice key() const override { return key_.user_key; }
+  Slice value() const override { return iter_->value(); }
+  Status status() const override { return status_.ok() ? iter_->status() : status_; }
+private:
+  void Parse() {                                                         // user key of entry
+    if (!iter_->Valid()) return;
+    if (!ParseInternalKey(iter_->key(), &key_) || key_.type != kTypeValue) {
+      status_ = Status::Corruption("Table file holds a key that is not a plain value");
+    } else if (key_.sequence != 0) {
+      status_ = Status::Corruption("Table file holds a key with a sequence number");
+    }
+  }
+  std::unique_ptr<InternalIterator> iter_;                               // over internal keys
+  ParsedInternalKey key_;                                                // parsed current key
+  Status status_;                                                        // first error parsing
+};
+
 // Static factory for RocksDB-compatible persistent trees
 Status ScreeDB::Open(const Options& options, const std::string& dbname, ScreeDB** dbptr) {
-  *dbptr = new ScreeDB(options, dbname);
+  return Open(options, ScreeDBOptions(), dbname, dbptr);
+}
+
+// Static factory for RocksDB-compatible persistent trees, using specified pool options
+Status ScreeDB::Open(const Options& options, const ScreeDBOptions& screedb_options,
+                     const std::string& dbname, ScreeDB** dbptr) {
+  auto db = new ScreeDB(options, screedb_options, dbname);
+  const Status s = db->dbtree->GetOpenStatus();
+  if (!s.ok()) {
+    delete db;
+    *dbptr = nullptr;
+    return s;
+  }
+  *dbptr = db;
+  return Status::OK();
+}
+
+// Static factory for RocksDB-compatible persistent trees with column families
+Status ScreeDB::Open(const DBOptions& db_options, const ScreeDBOptions& screedb_options,
+                     const std::string& dbname,
+                     const std::vector<ColumnFamilyDescriptor>& column_families,
+                     std::vector<ColumnFamilyHandle*>* handles, ScreeDB** dbptr) {
+  handles->clear();
+  *dbptr = nullptr;
+  ColumnFamilyOptions default_options;
+  std::set<std::string> names;
+  for (auto& family : column_families) {
+    if (!names.insert(family.name).second) {
+      return Status::InvalidArgument("Duplicate column family name", family.name);
+    }
+    if (family.name == kDefaultColumnFamilyName) default_options = family.options;
+  }
+  ScreeDB* db;
+  Status s = Open(Options(db_options, default_options), screedb_options, dbname, &db);
+  if (!s.ok()) return s;
+
+  // find or create persistent families, then recover their trees in parallel
+  const size_t count = column_families.size();
+  std::vector<persistent_ptr<ScreeDBFamily>> found(count);
+  for (size_t i = 0; i < count && s.ok(); i++) {
+    auto& family = column_families[i];
+    if (family.name == kDefaultColumnFamilyName) continue;
+    found[i] = db->dbtree->FindFamily(family.name);
+    if (found[i] != nullptr) continue;
+    if (db_options.create_missing_column_families) {
+      s = db->dbtree->CreateFamily(family.name, family.options.comparator, &found[i]);
+    } else {
+      s = Status::InvalidArgument("Column family not found", family.name);
+    }
+  }
+  std::vector<ScreeDBTree*> trees(count, nullptr);
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < count && s.ok(); i++) {
+    if (found[i] == nullptr) continue;
+    workers.emplace_back([&, i] {
+      auto& options = column_families[i].options;
+      trees[i] = new ScreeDBTree(db->dbtree, found[i], options.comparator,
+                                 db->dbtree_options, options.merge_operator.get());
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  for (auto tree : trees) if (tree && s.ok()) s = tree->GetOpenStatus();
+  if (!s.ok()) {
+    for (auto tree : trees) delete tree;
+    delete db;
+    return s;
+  }
+
+  // return handles in the order families were listed
+  std::lock_guard<std::mutex> guard(db->dbfamilies_mutex);
+  for (size_t i = 0; i < count; i++) {
+    if (trees[i]) db->UpdateTrees(trees[i], nullptr);
+    handles->push_back(new ScreeDBColumnFamilyHandle(db, trees[i] ? trees[i] : db->dbtree,
+                                                     column_families[i].name,
+                                                     column_families[i].options));
+  }
+  *dbptr = db;
   return Status::OK();
 }
 
 // Construct a RocksDB-compatible persistent tree
-ScreeDB::ScreeDB(const Options& options, const std::string& name)
-        : dbname(name), dboptions(options) { dbtree = new ScreeDBTree(dbname); }
+ScreeDB::ScreeDB(const Options& options, const ScreeDBOptions& screedb_options,
+                 const std::string& name)
+        : dbname(name), dboptions(options), dbstats(options.statistics.get()),
+          dbtree_options(screedb_options),
+          dbmerge_operator(options.merge_operator) {
+  dbtree = new ScreeDBTree(dbname, options.comparator, screedb_options, dbmerge_operator.get());
+  dbdefault = new ScreeDBColumnFamilyHandle(this, dbtree, kDefaultColumnFamilyName, options);
+  dbtrees = std::make_shared<const std::map<uint32_t, ScreeDBTree*>>(
+          std::map<uint32_t, ScreeDBTree*>{{0, dbtree}});
+}
+
+// Safely free a RocksDB-compatible persistent tree, after trees of other column families
+ScreeDB::~ScreeDB() {
+  for (auto& entry : *dbtrees) if (entry.second != dbtree) delete entry.second;
+  delete dbdefault;
+  delete dbtree;
+}
+
+// Load a table file written by SstFileWriter, after checking its entry count and key range
+Status ScreeDB::AddFile(ColumnFamilyHandle* column_family, const ExternalSstFileInfo* file_info,
+                        bool move_file) {
+  return LoadFile(column_family, file_info->file_path, file_info, move_file);
+}
+
+// Load a table file written by SstFileWriter, whose size and key range are found by reading it
+Status ScreeDB::AddFile(ColumnFamilyHandle* column_family, const std::string& file_path,
+                        bool move_file) {
+  return LoadFile(column_family, file_path, nullptr, move_file);
+}
+
+// Load a table file reading user keys through a table reader, which must match "file_info"
+// (unless null) so a blind add of the wrong file fails before anything is loaded
+Status ScreeDB::LoadFile(ColumnFamilyHandle* column_family, const std::string& file_path,
+                         const ExternalSstFileInfo* file_info, bool move_file) {
+  auto handle = column_family ? (ScreeDBColumnFamilyHandle*) column_family : dbdefault;
+  const Options options(dboptions, handle->options_);
+  const ImmutableCFOptions ioptions(options);
+  const EnvOptions env_options(dboptions);
+  const InternalKeyComparator internal_comparator(options.comparator);
+  uint64_t file_size;
+  Status s = dboptions.env->GetFileSize(file_path, &file_size);
+  if (!s.ok()) return s;
+  std::unique_ptr<RandomAccessFile> file;
+  s = dboptions.env->NewRandomAccessFile(file_path, &file, env_options);
+  if (!s.ok()) return s;
+  std::unique_ptr<RandomAccessFileReader> file_reader(new RandomAccessFileReader(std::move(file)));
+  std::unique_ptr<TableReader> table_reader;
+  s = options.table_factory->NewTableReader(
+          TableReaderOptions(ioptions, env_options, internal_comparator),
+          std::move(file_reader), file_size, &table_reader);
+  if (!s.ok()) return s;
+  auto properties = table_reader->GetTableProperties();
+  auto version = properties->user_collected_properties.find(
+          ExternalSstFilePropertyNames::kVersion);
+  if (version == properties->user_collected_properties.end()) {
+    return Status::InvalidArgument("Table file has no SstFileWriter version");
+  }
+  if (DecodeFixed32(version->second.c_str()) != 1) {                     // sequence numbers are 0
+    return Status::InvalidArgument("Table file has an unsupported SstFileWriter version");
+  }
+  if (properties->num_entries == 0) return Status::InvalidArgument("Table file holds no entries");
+  if (file_info && file_info->num_entries != properties->num_entries) {
+    return Status::InvalidArgument("Table file entries differ from file info");
+  }
+  ScreeDBTableIterator source(table_reader->NewIterator(ReadOptions()));
+  if (file_info) {                                                       // source seeks again
+    source.SeekToFirst();
+    const bool first = source.Valid() && source.key() == Slice(file_info->smallest_key);
+    source.SeekToLast();
+    const bool last = source.Valid() && source.key() == Slice(file_info->largest_key);
+    if (!source.status().ok()) return source.status();
+    if (!first || !last) return Status::InvalidArgument("Table file keys differ from file info");
+  }
+  s = BulkLoad(column_family, &source);
+  if (s.ok() && move_file) dboptions.env->DeleteFile(file_path);         // copied into pool
+  return s;
+}
+
+// Load sorted keys and values into the tree of a column family, recording the write
+Status ScreeDB::BulkLoad(ColumnFamilyHandle* column_family, Iterator* source) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_WRITE);
+  return TreeFor(column_family)->BulkLoad(source);
+}
+
+// Create a separate tree in the same pool, which stays open until the database is closed
+Status ScreeDB::CreateColumnFamily(const ColumnFamilyOptions& options,
+                                   const std::string& column_family_name,
+                                   ColumnFamilyHandle** handle) {
+  *handle = nullptr;
+  std::lock_guard<std::mutex> guard(dbfamilies_mutex);
+  persistent_ptr<ScreeDBFamily> family;
+  Status s = dbtree->CreateFamily(column_family_name, options.comparator, &family);
+  if (!s.ok()) return s;
+  auto tree = new ScreeDBTree(dbtree, family, options.comparator, dbtree_options,
+                              options.merge_operator.get());
+  s = tree->GetOpenStatus();
+  if (!s.ok()) {
+    delete tree;
+    return s;
+  }
+  UpdateTrees(tree, nullptr);
+  *handle = new ScreeDBColumnFamilyHandle(this, tree, column_family_name, options);
+  return Status::OK();
+}
+
+// Remove the database entry (if any) for "key", recording the write in statistics
+Status ScreeDB::Delete(const WriteOptions& options, ColumnFamilyHandle* column_family,
+                       const Slice& key) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_WRITE);
+  RecordTick(NUMBER_KEYS_WRITTEN);
+  RecordTick(BYTES_WRITTEN, key.size());
+  return TreeFor(column_family)->Delete(key);
+}
+
+// Drop a column family in constant time, leaving its tree to the handle until deleted
+Status ScreeDB::DropColumnFamily(ColumnFamilyHandle* column_family) {
+  auto handle = (ScreeDBColumnFamilyHandle*) column_family;
+  if (handle == nullptr || handle->GetID() == 0) {
+    return Status::InvalidArgument("Can't drop default column family");
+  }
+  std::lock_guard<std::mutex> guard(dbfamilies_mutex);
+  if (handle->dropped_) return Status::InvalidArgument("Column family already dropped");
+  dbtree->DropFamily(handle->GetTree()->GetFamily());
+  UpdateTrees(nullptr, handle->GetTree());
+  handle->dropped_ = true;
+  return Status::OK();
+}
+
+// Get the value for a key, recording bytes appended to *value in statistics
+Status ScreeDB::Get(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                    const Slice& key, std::string* value) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_GET);
+  const size_t existing = value->size();                                 // Get appends to value
+  const Status s = TreeFor(column_family)->Get(key, value, options.snapshot);
+  RecordTick(NUMBER_KEYS_READ);
+  if (s.ok()) RecordTick(BYTES_READ, value->size() - existing);
+  return s;
+}
+
+// Pass the value for a key to a visitor in place, recording bytes visited in statistics
+Status ScreeDB::GetInPlace(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                           const Slice& key, const std::function<void(const Slice&)>& visitor) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_GET);
+  size_t bytes = 0;
+  const Status s = TreeFor(column_family)->GetInPlace(key, options.snapshot,
+                                                      [&](const Slice& value) {
+    bytes = value.size();
+    visitor(value);
+  });
+  RecordTick(NUMBER_KEYS_READ);
+  if (s.ok()) RecordTick(BYTES_READ, bytes);
+  return s;
+}
+
+// Pin the value for a key in place, recording bytes pinned or copied in statistics
+Status ScreeDB::GetPinned(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                          const Slice& key, ScreeDBPinnedValue* pinned) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_GET);
+  const Status s = TreeFor(column_family)->GetPinned(key, options.snapshot, pinned);
+  RecordTick(NUMBER_KEYS_READ);
+  if (s.ok()) RecordTick(BYTES_READ, pinned->value().size());
+  return s;
+}
+
+// Check whether a key may exist without reading the pool, counting definite answers as useful
+bool ScreeDB::KeyMayExist(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                          const Slice& key, std::string* value, bool* value_found) {
+  const bool may_exist = TreeFor(column_family)->KeyMayExist(key, options.snapshot, value,
+                                                             value_found);
+  if (!may_exist) RecordTick(BLOOM_FILTER_USEFUL);
+  return may_exist;
+}
+
+// Merge the database entry for "key" with "value", recording the write in statistics
+Status ScreeDB::Merge(const WriteOptions& options, ColumnFamilyHandle* column_family,
+                      const Slice& key, const Slice& value) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_WRITE);
+  RecordTick(NUMBER_KEYS_WRITTEN);
+  RecordTick(BYTES_WRITTEN, key.size() + value.size());
+  return TreeFor(column_family)->Merge(key, value);
+}
+
+// Get values for keys, sharing leaf lookups when all keys are in the same column family
+std::vector<Status> ScreeDB::MultiGet(const ReadOptions& options,
+                                      const std::vector<ColumnFamilyHandle*>& column_family,
+                                      const std::vector<Slice>& keys,
+                                      std::vector<std::string>* values) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_MULTIGET);
+  auto tree = column_family.empty() ? dbtree : TreeFor(column_family[0]);
+  bool same = true;
+  for (auto handle : column_family) same = same && TreeFor(handle) == tree;
+  std::vector<Status> status;
+  if (same) {
+    status = tree->MultiGet(keys, values, options.snapshot);
+  } else {
+    values->resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      (*values)[i].clear();
+      status.push_back(TreeFor(column_family[i])->Get(keys[i], &(*values)[i],
+                                                       options.snapshot));
+    }
+  }
+  if (dbstats) {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < keys.size(); i++) if (status[i].ok()) bytes += (*values)[i].size();
+    RecordTick(NUMBER_MULTIGET_CALLS);
+    RecordTick(NUMBER_MULTIGET_KEYS_READ, keys.size());
+    RecordTick(NUMBER_MULTIGET_BYTES_READ, bytes);
+  }
+  return status;
+}
+
+// Set the database entry for "key" to "value", recording the write in statistics
+Status ScreeDB::Put(const WriteOptions& options, ColumnFamilyHandle* column_family,
+                    const Slice& key, const Slice& value) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_WRITE);
+  RecordTick(NUMBER_KEYS_WRITTEN);
+  RecordTick(BYTES_WRITTEN, key.size() + value.size());
+  return TreeFor(column_family)->Put(key, value);
+}
+
+// Release a snapshot, then discard versions that no remaining snapshot can read
+void ScreeDB::ReleaseSnapshot(const Snapshot* snapshot) {
+  dbtree->ReleaseSnapshot(snapshot);
+  for (auto& entry : *std::atomic_load(&dbtrees)) {
+    if (entry.second != dbtree) entry.second->TrimVersions();
+  }
+}
+
+// Apply a write batch across column families, recording the write in statistics
+Status ScreeDB::Write(const WriteOptions& options, WriteBatch* updates) {
+  ScreeDBStopWatch watch(dboptions.env, dbstats, DB_WRITE);
+  RecordTick(WRITE_DONE_BY_SELF);
+  RecordTick(NUMBER_KEYS_WRITTEN, updates->Count());
+  RecordTick(BYTES_WRITTEN, updates->GetDataSize());
+  return ScreeDBTree::Write(updates, *std::atomic_load(&dbtrees));
+}
+
+// Free a dropped family's tree and then its persistent leaves, when its handle is deleted
+void ScreeDB::CloseFamily(ScreeDBColumnFamilyHandle* handle) {
+  std::lock_guard<std::mutex> guard(dbfamilies_mutex);
+  auto family = handle->GetTree()->GetFamily();
+  delete handle->GetTree();
+  dbtree->ReclaimFamily(family);
+}
+
+// Return integer properties kept by tickers or the value cache, without visiting leaves. Free
+// pool bytes are shared by all families, less leaves of families that aren't open.
+bool ScreeDB::GetTreeIntProperty(ScreeDBTree* tree, const Slice& property, uint64_t* value) {
+  if (property == "rocksdb.screedb.num-leaves") {
+    *value = tree->GetLeafCounts().leaves;
+  } else if (property == "rocksdb.screedb.num-keys") {
+    *value = tree->GetLeafCounts().keys;
+  } else if (property == "rocksdb.screedb.orphaned-string-bytes") {
+    *value = tree->GetLeafCounts().orphaned_bytes;
+  } else if (property == "rocksdb.screedb.cache-hits") {
+    *value = tree->GetCacheStats().hits;
+  } else if (property == "rocksdb.screedb.cache-misses") {
+    *value = tree->GetCacheStats().misses;
+  } else if (property == "rocksdb.screedb.cache-usage") {
+    *value = tree->GetCacheStats().usage;
+  } else if (property == "rocksdb.screedb.num-snapshots") {
+    *value = tree->GetSnapshotCount();
+  } else if (property == "rocksdb.screedb.snapshot-bytes") {
+    *value = tree->GetVersionBytes();
+  } else if (property == "rocksdb.screedb.tree-depth") {
+    *value = tree->GetTreeDepth();
+  } else if (property == "rocksdb.screedb.pmem-bytes-used") {
+    *value = tree->GetLeafCounts().pmem_bytes;
+  } else if (property == "rocksdb.screedb.pmem-bytes-free") {
+    uint64_t used = 0;
+    for (auto& entry : *std::atomic_load(&dbtrees)) {
+      used += entry.second->GetLeafCounts().pmem_bytes;
+    }
+    *value = tree->GetPoolBytes() > used ? tree->GetPoolBytes() - used : 0;
+  } else if (property == "rocksdb.screedb.transactions") {
+    *value = tree->GetTickerCount(SCREEDB_TRANSACTIONS);
+  } else if (property == "rocksdb.screedb.leaf-splits") {
+    *value = tree->GetTickerCount(SCREEDB_LEAF_SPLITS);
+  } else if (property == "rocksdb.screedb.hash-matches") {
+    *value = tree->GetTickerCount(SCREEDB_HASH_MATCHES);
+  } else if (property == "rocksdb.screedb.hash-false-positives") {
+    *value = tree->GetTickerCount(SCREEDB_HASH_FALSE_POSITIVES);
+  } else if (property == "rocksdb.screedb.key-may-exist-calls") {
+    *value = tree->GetTickerCount(SCREEDB_KEY_MAY_EXIST_CALLS);
+  } else if (property == "rocksdb.screedb.key-may-exist-negatives") {
+    *value = tree->GetTickerCount(SCREEDB_KEY_MAY_EXIST_NEGATIVES);
+  } else {
+    return false;
+  }
+  return true;
+}
 
-// Safely free a RocksDB-compatible persistent tree
-ScreeDB::~ScreeDB() { delete dbtree; }
+// Replace trees used by write batches, so writers read them without locking
+void ScreeDB::UpdateTrees(ScreeDBTree* added, ScreeDBTree* removed) {
+  auto trees = std::make_shared<std::map<uint32_t, ScreeDBTree*>>(*dbtrees);
+  if (added) (*trees)[added->GetFamilyId()] = added;
+  if (removed) trees->erase(removed->GetFamilyId());
+  std::atomic_store(&dbtrees, std::shared_ptr<const std::map<uint32_t, ScreeDBTree*>>(trees));
+}
+
+// Construct a handle naming the tree of a column family
+ScreeDBColumnFamilyHandle::ScreeDBColumnFamilyHandle(ScreeDB* db, ScreeDBTree* tree,
+                                                     const std::string& name,
+                                                     const ColumnFamilyOptions& options)
+        : db_(db), tree_(tree), name_(name), id_(tree->GetFamilyId()), options_(options) {}
+
+// Delete the handle, also freeing the family if it was dropped
+ScreeDBColumnFamilyHandle::~ScreeDBColumnFamilyHandle() { if (dropped_) db_->CloseFamily(this); }
+
+// Return name and options used to create or open the family
+Status ScreeDBColumnFamilyHandle::GetDescriptor(ColumnFamilyDescriptor* desc) {
+  *desc = ColumnFamilyDescriptor(name_, options_);
+  return Status::OK();
+}
+
+// Return integer properties summed over open column families, except for the tree depth
+// (deepest tree) and properties of the whole pool (reported once)
+bool ScreeDB::GetAggregatedIntProperty(const Slice& property, uint64_t* value) {
+  if (property == "rocksdb.screedb.num-snapshots"
+      || property == "rocksdb.screedb.pmem-bytes-free") {
+    return GetTreeIntProperty(dbtree, property, value);
+  }
+  const bool deepest = property == "rocksdb.screedb.tree-depth";
+  uint64_t total = 0;
+  for (auto& entry : *std::atomic_load(&dbtrees)) {
+    uint64_t result;
+    if (!GetTreeIntProperty(entry.second, property, &result)) return false;
+    total = deepest ? std::max(total, result) : total + result;
+  }
+  *value = total;
+  return true;
+}
+
+// Return integer properties for the tree of a column family
+bool ScreeDB::GetIntProperty(ColumnFamilyHandle* column_family, const Slice& property,
+                             uint64_t* value) {
+  return GetTreeIntProperty(TreeFor(column_family), property, value);
+}
+
+// Return string properties, including any integer properties
+bool ScreeDB::GetProperty(ColumnFamilyHandle* column_family, const Slice& property,
+                          std::string* value) {
+  uint64_t result;
+  if (property == "rocksdb.screedb.leaf-fill-factor") {
+    const ScreeDBLeafCounts counts = TreeFor(column_family)->GetLeafCounts();
+    *value = std::to_string(counts.leaves ? (double) counts.keys / (counts.leaves * NODE_KEYS)
+                                          : 0.0);
+  } else if (property == "rocksdb.screedb.hash-false-positive-rate") {
+    auto tree = TreeFor(column_family);
+    const uint64_t matches = tree->GetTickerCount(SCREEDB_HASH_MATCHES);
+    const uint64_t false_positives = tree->GetTickerCount(SCREEDB_HASH_FALSE_POSITIVES);
+    *value = std::to_string(matches ? (double) false_positives / matches : 0.0);
+  } else if (property == "rocksdb.screedb.key-may-exist-false-positive-rate") {
+    auto tree = TreeFor(column_family);
+    const uint64_t lookups = tree->GetTickerCount(SCREEDB_ABSENT_LOOKUPS);
+    const uint64_t matched = tree->GetTickerCount(SCREEDB_ABSENT_HASH_MATCHES);
+    *value = std::to_string(lookups ? (double) matched / lookups : 0.0);
+  } else if (GetIntProperty(column_family, property, &result)) {
+    *value = std::to_string(result);
+  } else {
+    return false;
+  }
+  return true;
+}
 
 // Construct a persistent tree
-ScreeDBTree::ScreeDBTree(const std::string& name) : name(name) {
+ScreeDBTree::ScreeDBTree(const std::string& name, const Comparator* comparator,
+                         const ScreeDBOptions& options, const MergeOperator* merge_operator)
+        : name(name), comparator_(comparator),
+          bytewise_(strcmp(comparator->Name(), BytewiseComparator()->Name()) == 0),
+          merge_operator_(merge_operator),
+          uint64add_(merge_operator && strcmp(merge_operator->Name(), "UInt64AddOperator") == 0),
+          owner_(this) {
   LOG("Opening persistent tree");
-  if (access(GetNamePtr(), F_OK) != 0) {
-    LOG("Creating pool");
-    pop_ = pool<ScreeDBRoot>::create(GetNamePtr(), "ScreeDB",            // todo name is hardcoded
-                                     PMEMOBJ_MIN_POOL * 450, S_IRWXU);   // todo size is hardcoded
-  } else {
-    pop_ = pool<ScreeDBRoot>::open(GetNamePtr(), "ScreeDB");             // todo name is hardcoded
+  for (auto& versions : versions_) versions = ScreeDBVersions(ScreeDBVersionOrder{comparator});
+  if (options.cache_size > 0) cache_ = NewLRUCache(options.cache_size);
+  if (options.hash_index) index_.reset(new ScreeDBKeyIndex());
+  try {
+    OpenPool(options);
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    LOG("Could not open pool: " << e.what());
+    open_status_ = Status::IOError(name, e.what());
+    return;
   }
   Recover();
+  BackgroundStart(options);
   LOG("Opened tree ok");
 }
 
-// Safely free a persistent tree
+// Construct a persistent tree for a column family, sharing the pool opened by its owner
+ScreeDBTree::ScreeDBTree(ScreeDBTree* owner, persistent_ptr<ScreeDBFamily> family,
+                         const Comparator* comparator, const ScreeDBOptions& options,
+                         const MergeOperator* merge_operator)
+        : name(owner->name + ":" + family->name.get_ro().slice().ToString()),
+          comparator_(comparator),
+          bytewise_(strcmp(comparator->Name(), BytewiseComparator()->Name()) == 0),
+          merge_operator_(merge_operator),
+          uint64add_(merge_operator && strcmp(merge_operator->Name(), "UInt64AddOperator") == 0),
+          open_status_(owner->open_status_), pop_(owner->pop_), family_(family), owner_(owner) {
+  LOG("Opening column family tree");
+  for (auto& versions : versions_) versions = ScreeDBVersions(ScreeDBVersionOrder{comparator});
+  if (options.cache_size > 0) cache_ = NewLRUCache(options.cache_size);
+  if (options.hash_index) index_.reset(new ScreeDBKeyIndex());
+  if (open_status_.ok()) Recover();
+  BackgroundStart(options);
+  LOG("Opened column family tree ok");
+}
+
+// Safely free a persistent tree, closing the pool unless owned by another tree
 ScreeDBTree::~ScreeDBTree() {
   LOG("Closing tree");
-  Shutdown();
-  pop_.close();
+  BackgroundStop();
+  if (open_status_.ok() && !family_) Shutdown();
+  if (pop_.get_handle() && !family_) pop_.close();
   LOG("Closed tree ok");
 }
 
@@ -87,57 +601,340 @@ ScreeDBTree::~ScreeDBTree() {
 // KEY/VALUE METHODS
 // ===============================================================================================
 
+// Return hit and miss counts for the value cache, along with its current usage
+ScreeDBCacheStats ScreeDBTree::GetCacheStats() const {
+  ScreeDBCacheStats stats;
+  stats.hits = tickers_.Get(SCREEDB_CACHE_HITS);
+  stats.misses = tickers_.Get(SCREEDB_CACHE_MISSES);
+  if (cache_) stats.usage = cache_->GetUsage();
+  return stats;
+}
+
+// Return leaves, keys, persistent bytes and orphaned string storage in the tree, counted on
+// recovery and then as leaves change (so counts are approximate while other threads write).
+ScreeDBLeafCounts ScreeDBTree::GetLeafCounts() const {
+  auto gauge = [this](const ScreeDBTicker ticker) {
+    const int64_t count = (int64_t) tickers_.Get(ticker);                // stripes can go negative
+    return count > 0 ? (uint64_t) count : 0;
+  };
+  ScreeDBLeafCounts counts;
+  counts.leaves = gauge(SCREEDB_LEAVES);
+  counts.keys = gauge(SCREEDB_KEYS);
+  counts.orphaned_bytes = gauge(SCREEDB_ORPHANED_BYTES);
+  counts.pmem_bytes = gauge(SCREEDB_PMEM_BYTES);
+  return counts;
+}
+
+// Count levels from the top node down to leaves, holding the split mutex so inner nodes
+// don't change while descending. Returns 0 for an empty tree and 1 for a single leaf.
+int ScreeDBTree::GetTreeDepth() {
+  std::lock_guard<std::mutex> guard(split_mutex_);
+  int depth = 0;
+  for (ScreeDBNode* node = top_.load(std::memory_order_acquire); node; depth++) {
+    node = node->is_leaf ? nullptr : ((ScreeDBInnerNode*) node)->children[0];
+  }
+  return depth;
+}
+
+// Load sorted entries whose range holds no existing keys, packing them into full leaves that
+// are linked from the pool root until published, so recovery frees leaves of a load that a
+// crash interrupted. Leaves are allocated in batches per transaction, then all are published
+// in one more. Returns an error without adding any entries if keys are out of order, overlap
+// existing keys, or snapshots are held (since loaded entries have no sequence numbers).
+Status ScreeDBTree::BulkLoad(Iterator* source) {
+  if (owner_->snapshot_count_.load() > 0) {
+    return Status::NotSupported("Cannot add a file while holding snapshots");
+  }
+  std::lock_guard<std::mutex> guard(owner_->load_mutex_);                // one chain per pool
+  auto root = pop_.get_root();
+  std::vector<ScreeDBRecoveredLeaf> loaded;
+  persistent_ptr<ScreeDBLeaf> tail;
+  Slice last_key;
+  Status s;
+  try {
+    for (source->SeekToFirst(); s.ok() && source->Valid();) {
+      TransactionRun([&] {
+        for (int n = 0; n < BULK_LOAD_LEAVES && s.ok() && source->Valid(); n++) {
+          auto leafnode = new ScreeDBLeafNode();
+          leafnode->is_leaf = true;
+          loaded.push_back({leafnode, Slice(), Slice()});
+          const auto leaf = make_persistent<ScreeDBLeaf>();
+          leafnode->leaf = leaf;
+          if (tail) tail->next = leaf;
+          else root->loading = leaf;
+          tail = leaf;
+          for (int slot = 0; slot < NODE_KEYS && source->Valid(); slot++, source->Next()) {
+            const Slice key = source->key();
+            if (!(loaded.size() == 1 && slot == 0) && KeyCompare(last_key, key) >= 0) {
+              s = Status::InvalidArgument("Keys must be added in strictly ascending order");
+              break;
+            }
+            leaf->kv_keys[slot].get_rw().set(key);
+            leaf->kv_values[slot].get_rw().set(source->value());
+            leafnode->hashes[slot] = PearsonHash(key.data(), key.size());
+            leaf->hashes[slot] = (uint8_t) leafnode->hashes[slot];       // low byte, never zero
+            last_key = leaf->kv_keys[slot].get_ro().slice();
+            if (slot == 0) loaded.back().min_key = last_key;
+            loaded.back().max_key = last_key;
+          }
+        }
+      });
+    }
+    if (s.ok()) s = source->status();
+    if (s.ok() && !loaded.empty()) s = BulkPublish(loaded);
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    s = Status::IOError(name, e.what());
+  }
+  if (!s.ok()) {
+    LOG("Discarding bulk load: " << s.ToString());
+    BulkDiscard();
+    for (auto& rleaf : loaded) delete rleaf.leafnode;
+  }
+  return s;
+}
+
+// Merge sparse neighbouring leaves holding keys from "begin" to "end" (nullptr for the first
+// or last key), locking only two leaves at a time so readers and writers can continue.
+// Also frees long strings left in unused slots once unpinned, and retired nodes that readers
+// have left. Stops after visiting "max_leaves" if positive, storing a key of the leaf to resume
+// from in "resume", which is left empty once the range is done.
+Status ScreeDBTree::Compact(const Slice* begin, const Slice* end, const int max_leaves,
+                            std::string* resume) {
+  LOG("Compact");
+  if (resume) resume->clear();
+  auto past_end = [&](ScreeDBLeafNode* leafnode) {
+    if (!end) return false;
+    for (uint64_t used = ~LeafMatchSlots(leafnode, 0); used; used &= used - 1) {
+      const int slot = __builtin_ctzll(used);
+      if (slot >= NODE_KEYS) break;
+      if (KeyCompare(leafnode->leaf->kv_keys[slot].get_ro().slice(), *end) >= 0) return true;
+    }
+    return false;
+  };
+  int merged = 0;
+  int visited = 1;
+  uint64_t freed = 0;
+  auto leafnode = begin ? LeafLockForKey(*begin) : LeafLockEdge(false);
+  if (leafnode) freed += LeafFreeOrphans(leafnode);
+  while (leafnode) {
+    auto next = leafnode->next.load(std::memory_order_acquire);          // stable while locked
+    if (!next || past_end(leafnode)) break;
+    if (max_leaves > 0 && visited++ >= max_leaves) {                     // resume from this leaf
+      const int slot = __builtin_ctzll(~LeafMatchSlots(leafnode, 0));
+      if (resume && slot < NODE_KEYS) {
+        *resume = leafnode->leaf->kv_keys[slot].get_ro().slice().ToString();
+      }
+      break;
+    }
+    LeafLock(next);                                                      // in key order
+    freed += LeafFreeOrphans(next);
+    if (LeafMergeNext(leafnode, next)) {                                 // next was unlocked
+      merged++;
+      continue;
+    }
+    LeafUnlock(leafnode);
+    leafnode = next;
+  }
+  if (leafnode) LeafUnlock(leafnode);
+  epochs_.Reclaim();
+  LOG("Compact done, merged " << merged << " leaves, freed " << freed << " orphaned bytes");
+  return Status::OK();
+}
+
 // Remove the database entry (if any) for "key".  Returns OK on success, and a non-OK status
 // on error.  It is not an error if "key" did not exist in the database.
 Status ScreeDBTree::Delete(const Slice& key) {
   LOG("Delete key=" << key.data_);
-  auto leafnode = LeafSearch(key);
+  int slot;
+  auto leafnode = index_ ? LeafLockIndexed(key, &slot) : LeafLockForKey(key);
   if (!leafnode) {
-    LOG("   head not present");
+    LOG("   key not present");
     return Status::OK();
   }
-  const uint8_t hash = PearsonHash(key.data_, key.size_);
-  for (int slot = NODE_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == hash) {
-      auto leaf = leafnode->leaf;
-      if (strcmp(leaf->kv_keys[slot].get_ro().data(), key.data_) == 0) {
-        LOG("   freeing slot=" << slot);
-        leafnode->hashes[slot] = 0;
-        transaction::exec_tx(pop_, [&] {
-          leaf->hashes[slot] = 0;
-        });
-        break;  // no duplicate keys allowed
-      }
-    }
+  CacheErase(key);                                                       // while leaf is locked
+  const ScreeDBHash hash = PearsonHash(key.data_, key.size_);
+  VersionSave(leafnode, hash, key, SequenceNext(1));
+  bool cleared;
+  try {
+    cleared = LeafClearSlotForKey(leafnode, hash, key);
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    LeafRestoreHashes(leafnode);                                         // slot was rolled back
+    LeafUnlock(leafnode);
+    return Status::IOError(name, e.what());
+  }
+  if (cleared && LeafCountKeys(leafnode) < LEAF_UNDERFLOW) {
+    leafnode = LeafUnderflow(leafnode);                                  // may merge neighbours
   }
+  LeafUnlock(leafnode);
   return Status::OK();
 }
 
 // If the database contains an entry for "key" store the corresponding value in *value
 // and return OK. If there is no entry for "key" leave *value unchanged and return a status
 // for which Status::IsNotFound() returns true. May return some other Status on an error.
-Status ScreeDBTree::Get(const Slice& key, std::string* value) {
+// Reading a snapshot locks the leaf first, so every write numbered up to the snapshot has
+// finished, and then prefers any version saved since the snapshot over the leaf.
+Status ScreeDBTree::Get(const Slice& key, std::string* value, const Snapshot* snapshot) {
   LOG("Get key=" << key.data_);
-  auto leafnode = LeafSearch(key);
+  if (snapshot) {
+    auto leafnode = LeafLockForKey(key, nullptr, true);
+    bool present = false;
+    if (!VersionFind(key, snapshot->GetSequenceNumber(), value, &present) && leafnode) {
+      const int slot = LeafFindSlot(leafnode, PearsonHash(key.data_, key.size_), key);
+      present = slot >= 0;
+      if (present) {
+        const ScreeDBString& slot_value = leafnode->leaf->kv_values[slot].get_ro();
+        value->append(slot_value.data(), slot_value.size());
+      }
+    }
+    if (leafnode) LeafUnlock(leafnode, true);
+    return present ? Status::OK() : Status::NotFound();
+  }
+  if (CacheLookup(key, value)) return Status::OK();
+  int slot = -1;
+  auto leafnode = index_ ? LeafLockIndexed(key, &slot, true) : LeafLockForKey(key, nullptr, true);
   if (!leafnode) {
-    LOG("   head not present");
+    LOG("   key not present");
     return Status::NotFound();
   }
-  const uint8_t hash = PearsonHash(key.data_, key.size_);
-  for (int slot = NODE_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == hash) {
-      auto leaf = leafnode->leaf;
-      if (strcmp(leaf->kv_keys[slot].get_ro().data(), key.data_) == 0) {
-        value->append(leaf->kv_values[slot].get_ro().data());
-        LOG("   found value=" << *value << ", slot=" << slot);
-        return Status::OK();
-      }
-    }
+  if (!index_) slot = LeafFindSlot(leafnode, PearsonHash(key.data_, key.size_), key);
+  if (slot >= 0) {
+    const ScreeDBString& slot_value = leafnode->leaf->kv_values[slot].get_ro();
+    value->append(slot_value.data(), slot_value.size());                 // one sized copy
+    CacheInsert(key, slot_value.slice());                                // before writers erase
+    LeafUnlock(leafnode, true);
+    LOG("   found value=" << *value << ", slot=" << slot);
+    return Status::OK();
   }
+  LeafUnlock(leafnode, true);
   LOG("   could not find key");
   return Status::NotFound();
 }
 
+// Passes the value to the visitor in place, while its leaf is locked so it can't change.
+// Values read at a snapshot may come from saved versions, so are copied first.
+Status ScreeDBTree::GetInPlace(const Slice& key, const Snapshot* snapshot,
+                               const std::function<void(const Slice&)>& visitor) {
+  LOG("GetInPlace key=" << key.data_);
+  if (snapshot) {
+    std::string value;
+    const Status s = Get(key, &value, snapshot);
+    if (s.ok()) visitor(value);
+    return s;
+  }
+  int slot = -1;
+  auto leafnode = index_ ? LeafLockIndexed(key, &slot, true) : LeafLockForKey(key, nullptr, true);
+  if (!leafnode) return Status::NotFound();
+  if (!index_) slot = LeafFindSlot(leafnode, PearsonHash(key.data_, key.size_), key);
+  if (slot >= 0) visitor(leafnode->leaf->kv_values[slot].get_ro().slice());
+  LeafUnlock(leafnode, true);
+  return slot >= 0 ? Status::OK() : Status::NotFound();
+}
+
+// Pins a long value where it lies in the pool, registering its address while the leaf is
+// locked, so writers that would free or overwrite it wait until it is released. Short values
+// lie in the leaf itself and are rewritten in place, so they're copied, as are snapshot reads.
+Status ScreeDBTree::GetPinned(const Slice& key, const Snapshot* snapshot,
+                              ScreeDBPinnedValue* pinned) {
+  LOG("GetPinned key=" << key.data_);
+  pinned->Reset();
+  if (snapshot) {
+    const Status s = Get(key, &pinned->copy_, snapshot);
+    pinned->value_ = Slice(pinned->copy_);
+    return s;
+  }
+  int slot = -1;
+  auto leafnode = index_ ? LeafLockIndexed(key, &slot, true) : LeafLockForKey(key, nullptr, true);
+  if (!leafnode) return Status::NotFound();
+  if (!index_) slot = LeafFindSlot(leafnode, PearsonHash(key.data_, key.size_), key);
+  if (slot >= 0) {
+    const ScreeDBString& slot_value = leafnode->leaf->kv_values[slot].get_ro();
+    if (slot_value.is_short()) {
+      pinned->copy_.assign(slot_value.data(), slot_value.size());
+      pinned->value_ = Slice(pinned->copy_);
+    } else {
+      PinAdd(slot_value.data());
+      pinned->tree_ = this;
+      pinned->value_ = slot_value.slice();
+    }
+  }
+  LeafUnlock(leafnode, true);
+  return slot >= 0 ? Status::OK() : Status::NotFound();
+}
+
+// Returns false if the key is definitely absent, reading only volatile structures: values in
+// the cache, else full-width hashes in the key index, else slot hashes in the leaf found by
+// descending inner nodes. Sets *value only for a cached value, without reading the pool.
+bool ScreeDBTree::KeyMayExist(const Slice& key, const Snapshot* snapshot, std::string* value,
+                              bool* value_found) {
+  LOG("KeyMayExist key=" << key.data_);
+  tickers_.Add(SCREEDB_KEY_MAY_EXIST_CALLS);
+  if (value_found) *value_found = false;
+  if (snapshot) return true;                                             // may be in versions
+  if (value && value_found && CacheLookup(key, value)) {
+    *value_found = true;
+    return true;
+  }
+  bool may_exist;
+  if (index_) {
+    int slot;
+    may_exist = index_->Find(ScreeDBKeyIndex::Hash(key), 0, &slot) != nullptr;
+  } else {
+    auto leafnode = LeafLockForKey(key, nullptr, true);                  // volatile nodes only
+    may_exist = leafnode && LeafMatchSlots(leafnode, PearsonHash(key.data_, key.size_)) != 0;
+    if (leafnode) LeafUnlock(leafnode, true);
+  }
+  if (!may_exist) tickers_.Add(SCREEDB_KEY_MAY_EXIST_NEGATIVES);
+  return may_exist;
+}
+
+// Merge the database entry for "key" with "value" using the merge operator, reading the slot
+// and writing the merged value while the leaf stays locked. Merged values of unchanged size
+// are written in place, and others are written like Put. Without a merge operator this is
+// the same as Put.
+Status ScreeDBTree::Merge(const Slice& key, const Slice& value) {
+  LOG("Merge key=" << key.data_ << ", value=" << value.data_);
+  if (!merge_operator_) return Put(key, value);
+  const ScreeDBHash hash = PearsonHash(key.data_, key.size_);
+
+  // add head leaf if none present
+  ScreeDBLeafNode* leafnode;
+  try {
+    while ((leafnode = LeafLockForKey(key)) == nullptr) LeafCreateHead();
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    return Status::IOError(name, e.what());
+  }
+
+  // merge with existing value (if any) before writing anything
+  const int slot = LeafFindSlot(leafnode, hash, key);
+  Slice existing;
+  if (slot >= 0) existing = leafnode->leaf->kv_values[slot].get_ro().slice();
+  std::string merged;
+  Status s = MergeValue(key, slot >= 0 ? &existing : nullptr, value, &merged);
+  if (!s.ok()) {
+    LeafUnlock(leafnode);
+    return s;
+  }
+
+  // update leaf, splitting if necessary (new leaf is returned locked)
+  CacheErase(key);                                                       // while leaf is locked
+  VersionSave(leafnode, hash, key, SequenceNext(1));
+  try {
+    if (slot >= 0 && existing.size_ == merged.size()
+        && !PinHeld(leafnode->leaf->kv_values[slot].get_ro())) {
+      TransactionRun([&] { leafnode->leaf->kv_values[slot].get_rw().overwrite(merged); });
+    } else if (!LeafFillSlotForKey(leafnode, hash, key, merged)) {
+      LeafUnlock(LeafSplit(leafnode, hash, key, merged));
+    }
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    LeafRestoreHashes(leafnode);                                         // slots were rolled back
+    LeafUnlock(leafnode);
+    return Status::IOError(name, e.what());
+  }
+  LeafUnlock(leafnode);
+  return Status::OK();
+}
+
 // If keys[i] does not exist in the database, then the i'th returned status will be one for
 // which Status::IsNotFound() is true, and (*values)[i] will be set to some arbitrary value
 // (often ""). Otherwise, the i'th returned status will have Status::ok() true, and
@@ -145,340 +942,1792 @@ Status ScreeDBTree::Get(const Slice& key, std::string* value) {
 // (*values) will always be resized to be the same size as (keys).
 // Similarly, the number of returned statuses will be the number of keys.
 // Note: keys will not be "de-duplicated". Duplicate keys will return duplicate values in order.
+// Keys are visited in sorted order, so each leaf is found and locked once for all of its keys,
+// and slot keys for the next key (or the next leaf's hashes) are prefetched while probing.
+// Snapshot reads look up each key separately.
 std::vector<Status> ScreeDBTree::MultiGet(const std::vector<Slice>& keys,
-                                          std::vector<std::string>* values) {
+                                          std::vector<std::string>* values,
+                                          const Snapshot* snapshot) {
   LOG("MultiGet for " << keys.size() << " keys");
-  std::vector<Status> status = std::vector<Status>();
-  for (auto& key: keys) {
-    std::string value;
-    Status s = Get(key.data_, &value);
-    status.push_back(s);
-    values->push_back(s.ok() ? value : "");
+  const size_t count = keys.size();
+  if (snapshot) {                                                        // versions are by key
+    std::vector<Status> status;
+    values->resize(count);
+    for (size_t i = 0; i < count; i++) {
+      (*values)[i].clear();
+      status.push_back(Get(keys[i], &(*values)[i], snapshot));
+    }
+    return status;
+  }
+  std::vector<Status> status(count, Status::NotFound());
+  values->resize(count);
+  std::vector<size_t> order(count);
+  std::vector<ScreeDBHash> hashes(count);
+  for (size_t i = 0; i < count; i++) {
+    order[i] = i;
+    hashes[i] = PearsonHash(keys[i].data_, keys[i].size_);
+    (*values)[i].clear();
+  }
+  std::stable_sort(order.begin(), order.end(), [&](const size_t lhs, const size_t rhs) {
+    return KeyCompare(keys[lhs], keys[rhs]) < 0;
+  });
+
+  ScreeDBLeafNode* leafnode = nullptr;                                   // locked leaf
+  const ScreeDBInnerKey* upper = nullptr;                                // highest key in leaf
+  int leaves = 0;
+  for (size_t i = 0; i < count; i++) {
+    const size_t idx = order[i];
+    const Slice& key = keys[idx];
+    if (!leafnode || (upper && KeyCompare(key, upper->slice()) > 0)) {   // beyond locked leaf?
+      if (leafnode) LeafUnlock(leafnode, true);
+      leafnode = LeafLockForKey(key, &upper, true);
+      if (!leafnode) break;                                              // head not present
+      leaves++;
+    }
+    auto leaf = leafnode->leaf;
+
+    // prefetch for next key, while this key's slots are compared
+    if (i + 1 < count) {
+      const size_t next_idx = order[i + 1];
+      if (!upper || KeyCompare(keys[next_idx], upper->slice()) <= 0) {  // next key in this leaf
+        for (uint64_t matches = LeafMatchSlots(leafnode, hashes[next_idx]); matches;
+             matches &= matches - 1) {
+          __builtin_prefetch(&leaf->kv_keys[__builtin_ctzll(matches)]);
+        }
+      } else {
+        auto next_leafnode = leafnode->next.load(std::memory_order_relaxed);
+        if (next_leafnode) __builtin_prefetch(next_leafnode->hashes);
+      }
+    }
+
+    const int slot = LeafFindSlot(leafnode, hashes[idx], key);
+    if (slot >= 0) {
+      const ScreeDBString& slot_value = leaf->kv_values[slot].get_ro();
+      (*values)[idx].assign(slot_value.data(), slot_value.size());
+      status[idx] = Status::OK();
+    }
   }
-  LOG("MultiGet done for " << keys.size() << " keys");
+  if (leafnode) LeafUnlock(leafnode, true);
+  LOG("MultiGet done for " << count << " keys in " << leaves << " leaves");
   return status;
 }
 
+// Return a heap-allocated iterator over the contents of the tree. The result is initially
+// invalid (caller must call one of the Seek methods on the iterator before using it).
+// Keys and shorter values are copied from each leaf while it is locked, since writers may
+// rewrite slot strings (or merge the leaf away) as soon as it is unlocked. Values of at least
+// ITERATOR_PIN_BYTES are pinned in place instead, until the iterator moves to another leaf.
+ScreeDBIterator* ScreeDBTree::NewIterator() {
+  return new ScreeDBIterator(this);
+}
+
+// Return a heap-allocated iterator as described above, or for a snapshot (when not nullptr)
+// an iterator over live leaves merged with versions saved since the snapshot. Versions
+// are sought again after every leaf loaded, so they include those saved while iterating.
+Iterator* ScreeDBTree::NewIterator(const Snapshot* snapshot) {
+  if (!snapshot) return NewIterator();
+  return new ScreeDBSnapshotIterator(this, snapshot->GetSequenceNumber());
+}
+
 // Set the database entry for "key" to "value". If "key" already exists, it will be overwritten.
 // Returns OK on success, and a non-OK status on error.
 Status ScreeDBTree::Put(const Slice& key, const Slice& value) {
   LOG("Put key=" << key.data_ << ", value=" << value.data_);
-  const uint8_t hash = PearsonHash(key.data_, key.size_);
+  const ScreeDBHash hash = PearsonHash(key.data_, key.size_);
 
   // add head leaf if none present
-  auto leafnode = LeafSearch(key);
-  if (!leafnode) {
-    LOG("   adding head leaf");
-    leafnode = new ScreeDBLeafNode();
-    leafnode->is_leaf = true;
-    persistent_ptr<ScreeDBLeaf> new_leaf;
-    auto root = pop_.get_root();
-    auto old_head = root->head;
-    transaction::exec_tx(pop_, [&] {
-      new_leaf = make_persistent<ScreeDBLeaf>();
-      new_leaf->next = old_head;
-      leafnode->leaf = new_leaf;
-      LeafFillSpecificSlot(leafnode, hash, key, value, 0);
-      root->head = new_leaf;
-    });
-    top_ = leafnode;
-    return Status::OK();
+  ScreeDBLeafNode* leafnode;
+  try {
+    while ((leafnode = LeafLockForKey(key)) == nullptr) LeafCreateHead();
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    return Status::IOError(name, e.what());
   }
 
-  // update leaf, splitting if necessary
-  if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-    return Status::OK();
-  } else {
-    LeafSplit(leafnode, hash, key, value);
-    return Status::OK();
+  // update leaf, splitting if necessary (new leaf is returned locked)
+  CacheErase(key);                                                       // while leaf is locked
+  VersionSave(leafnode, hash, key, SequenceNext(1));
+  try {
+    if (!LeafFillSlotForKey(leafnode, hash, key, value)) {
+      LeafUnlock(LeafSplit(leafnode, hash, key, value));
+    }
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    LeafRestoreHashes(leafnode);                                         // slots were rolled back
+    LeafUnlock(leafnode);
+    return Status::IOError(name, e.what());
   }
+  LeafUnlock(leafnode);
+  return Status::OK();
 }
 
-// ===============================================================================================
-// PROTECTED LEAF METHODS
-// ===============================================================================================
+// Apply the updates for this tree's column family atomically, as described below.
+Status ScreeDBTree::Write(WriteBatch* updates) {
+  return Write(updates, {{GetFamilyId(), this}});
+}
 
-void ScreeDBTree::LeafDebugDump(ScreeDBNode* node) {
-  if (DO_LOG) {
-    if (node->is_leaf) {
-      auto leaf = ((ScreeDBLeafNode*) node)->leaf;
-      for (int slot = 0; slot < NODE_KEYS; slot++) {
-        LOG("      " << std::to_string(slot) << "="
-                     << (leaf->hashes[slot] == 0 ? "n/a" : leaf->kv_keys[slot].get_ro().data()));
+// Apply the specified updates to the trees of their column families atomically, in a single
+// persistent transaction. Updates are applied in key order within each tree (keeping batch
+// order for the same key), and leaves are locked in order of family id and then key (which
+// can't deadlock). Each leaf stays locked until the transaction commits, so other threads
+// never see part of a batch. If the transaction aborts (when the pool is full) nothing is
+// written, and an error is returned once every leaf is restored and unlocked.
+Status ScreeDBTree::Write(WriteBatch* updates, const std::map<uint32_t, ScreeDBTree*>& trees) {
+  class Collector : public WriteBatch::Handler {                         // updates by family
+  public:
+    Collector(const std::map<uint32_t, ScreeDBTree*>& trees, const size_t count)
+            : trees(trees), count(count) {}
+    const std::map<uint32_t, ScreeDBTree*>& trees;
+    const size_t count;
+    std::map<uint32_t, ScreeDBBatch> batches;
+    Status Add(uint32_t id, const Slice& key, const Slice& value, ScreeDBUpdateType type) {
+      auto tree = trees.find(id);
+      if (tree == trees.end()) {
+        return Status::InvalidArgument("Invalid column family specified in write batch");
       }
-    } else {
-      ScreeDBInnerNode* inner_node = (ScreeDBInnerNode*) node;
-      LOG("      keycount: " << std::to_string(inner_node->keycount));
-      for (int idx = 0; idx < inner_node->keycount; idx++) {
-        LOG("      " << std::to_string(idx) << ":" << inner_node->keys[idx]);
+      if (type == SCREEDB_MERGE && !tree->second->merge_operator_) type = SCREEDB_PUT;
+      auto& batch = batches[id];
+      if (batch.updates.empty()) batch.updates.reserve(count);
+      batch.updates.push_back({key, value, type});
+      return Status::OK();
+    }
+    virtual Status PutCF(uint32_t id, const Slice& key, const Slice& value) override {
+      return Add(id, key, value, SCREEDB_PUT);
+    }
+    virtual Status DeleteCF(uint32_t id, const Slice& key) override {
+      return Add(id, key, Slice(), SCREEDB_DELETE);
+    }
+    virtual Status SingleDeleteCF(uint32_t id, const Slice& key) override {
+      return Add(id, key, Slice(), SCREEDB_DELETE);
+    }
+    virtual Status MergeCF(uint32_t id, const Slice& key, const Slice& value) override {
+      return Add(id, key, value, SCREEDB_MERGE);                         // same as ScreeDB::Merge
+    }
+  } collector(trees, updates->Count());
+  Status s = updates->Iterate(&collector);
+  if (!s.ok() || collector.batches.empty()) return s;
+
+  // lock leaves and resolve merges for every family before writing anything
+  std::vector<std::pair<ScreeDBTree*, ScreeDBBatch*>> prepared;
+  for (auto& entry : collector.batches) {
+    auto tree = trees.at(entry.first);
+    s = tree->WritePrepare(&entry.second);
+    if (!s.ok()) {
+      for (auto& done : prepared) {
+        for (auto leafnode : done.second->locked) done.first->LeafUnlock(leafnode);
       }
+      return s;
     }
+    prepared.emplace_back(tree, &entry.second);
   }
-}
-
-void ScreeDBTree::LeafDebugDumpWithChildren(ScreeDBInnerNode* inner) {
-  LeafDebugDump(inner);
-  for (int i = 0; i < inner->keycount + 1; i++) {
-    LOG ("      dumping child node " << std::to_string(i) << "------------------------");
-    LeafDebugDump(inner->children[i]);
+  const SequenceNumber sequence = prepared[0].first->SequenceNext(updates->Count());
+  try {
+    prepared[0].first->TransactionRun([&] {                              // nested calls join
+      for (auto& entry : prepared) entry.first->WriteApply(entry.second, sequence);
+    });
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    for (auto& entry : prepared) entry.first->WriteAbort(entry.second);
+    return Status::IOError(prepared[0].first->name, e.what());
+  }
+  for (auto& entry : prepared) {
+    for (auto leafnode : entry.second->locked) entry.first->LeafUnlock(leafnode);
   }
+  return Status::OK();
 }
 
-void ScreeDBTree::LeafFillFirstEmptySlot(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                                         const Slice& key, const Slice& value) {
-  for (int slot = NODE_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == 0) {
-      LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-      return;
+// ===============================================================================================
+// COLUMN FAMILY METHODS
+// ===============================================================================================
+
+// Adds an empty column family to the pool, ordered by the named comparator. Names must be
+// unique, and ids are never reused while a dropped family could still be open.
+Status ScreeDBTree::CreateFamily(const std::string& family_name, const Comparator* comparator,
+                                 persistent_ptr<ScreeDBFamily>* family) {
+  std::lock_guard<std::mutex> guard(families_mutex_);
+  auto root = pop_.get_root();
+  uint32_t last_id = 0;
+  for (auto existing = root->families; existing != nullptr; existing = existing->next) {
+    if (existing->name.get_ro().equals(family_name)) {
+      return Status::InvalidArgument("Column family already exists", family_name);
     }
+    last_id = std::max(last_id, existing->id.get_ro());
+  }
+  if (family_name == kDefaultColumnFamilyName) {
+    return Status::InvalidArgument("Column family already exists", family_name);
+  }
+  for (auto dropped = root->dropped; dropped != nullptr; dropped = dropped->next) {
+    last_id = std::max(last_id, dropped->id.get_ro());
   }
+  LOG("Creating column family " << family_name << " with id " << last_id + 1);
+  TransactionRun([&] {
+    auto created = make_persistent<ScreeDBFamily>();
+    created->id = last_id + 1;
+    created->name.get_rw().set(family_name);
+    created->comparator.get_rw().set(comparator->Name());
+    created->next = root->families;
+    root->families = created;
+    *family = created;
+  });
+  return Status::OK();
 }
 
-bool ScreeDBTree::LeafFillSlotForKey(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                                     const Slice& key, const Slice& value) {
-  // scan for empty/matching slots
-  int last_empty_slot = -1;
-  int key_match_slot = -1;
-  for (int slot = NODE_KEYS; slot--;) {
-    auto slot_hash = leafnode->hashes[slot];
-    if (slot_hash == 0) {
-      last_empty_slot = slot;
-    } else if (slot_hash == hash) {
-      if (strcmp(leafnode->leaf->kv_keys[slot].get_ro().data(), key.data_) == 0) {
-        key_match_slot = slot;
-        break;  // no duplicate keys allowed
-      }
-    }
+// Moves a column family to the dropped list in one small transaction, however many leaves it
+// holds. Its tree may stay open until closed, and then ReclaimFamily frees the leaves.
+void ScreeDBTree::DropFamily(persistent_ptr<ScreeDBFamily> family) {
+  std::lock_guard<std::mutex> guard(families_mutex_);
+  auto root = pop_.get_root();
+  persistent_ptr<ScreeDBFamily>* link = &root->families;
+  while (*link != nullptr && *link != family) link = &(*link)->next;
+  if (*link == nullptr) return;                                          // already dropped
+  LOG("Dropping column family " << family->name.get_ro().slice().ToString());
+  TransactionRun([&] {
+    *link = family->next;
+    family->next = root->dropped;
+    root->dropped = family;
+  });
+}
+
+// Returns the column family with the given name, else nullptr.
+persistent_ptr<ScreeDBFamily> ScreeDBTree::FindFamily(const std::string& family_name) {
+  std::lock_guard<std::mutex> guard(families_mutex_);
+  for (auto family = pop_.get_root()->families; family != nullptr; family = family->next) {
+    if (family->name.get_ro().equals(family_name)) return family;
   }
+  return nullptr;
+}
 
-  // update suitable slot if found
-  int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
-  if (slot >= 0) {
-    LOG("   filling slot=" << slot);
-    transaction::exec_tx(pop_, [&] {
-      LeafFillSpecificSlot(leafnode, hash, key, value, slot);
+// Frees the leaves of a dropped column family whose tree is closed, one leaf per transaction
+// so a crash loses only the current step, then removes the family from the dropped list.
+void ScreeDBTree::ReclaimFamily(persistent_ptr<ScreeDBFamily> family) {
+  LOG("Reclaiming column family " << family->name.get_ro().slice().ToString());
+  while (family->head != nullptr) {
+    auto leaf = family->head;
+    TransactionRun([&] {
+      family->head = leaf->next;
+      LeafFreePersistent(leaf);
     });
   }
-  return slot >= 0;
+  std::lock_guard<std::mutex> guard(families_mutex_);
+  auto root = pop_.get_root();
+  persistent_ptr<ScreeDBFamily>* link = &root->dropped;
+  while (*link != nullptr && *link != family) link = &(*link)->next;
+  if (*link == nullptr) return;                                          // never dropped
+  TransactionRun([&] {
+    *link = family->next;
+    family->name.get_rw().clear();
+    family->comparator.get_rw().clear();
+    delete_persistent<ScreeDBFamily>(family);
+  });
 }
 
-void ScreeDBTree::LeafFillSpecificSlot(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                                       const Slice& key, const Slice& value, const int slot) {
-  auto leaf = leafnode->leaf;
-  if (leafnode->hashes[slot] == 0) leaf->kv_keys[slot].get_rw().set(key.data_);
-  leafnode->hashes[slot] = hash;
-  leaf->hashes[slot] = hash;
-  leaf->kv_values[slot].get_rw().set(value.data_);
+// ===============================================================================================
+// SNAPSHOT METHODS
+// ===============================================================================================
+
+// Returns a snapshot of every tree in the pool. Counting it before reading the sequence number
+// means any write numbered after the snapshot sees it, and saves the versions it needs.
+// Holds every version shard, so writers holding any one shard see the same live snapshots.
+const Snapshot* ScreeDBTree::GetSnapshot() {
+  VersionLockAll();
+  owner_->snapshot_count_++;
+  const SequenceNumber sequence = owner_->sequence_.load();
+  owner_->snapshots_.insert(sequence);
+  VersionUnlockAll();
+  LOG("Created snapshot at sequence " << sequence);
+  return new ScreeDBSnapshot(sequence);
 }
 
-ScreeDBLeafNode* ScreeDBTree::LeafSearch(const Slice& key) {
-  ScreeDBNode* node = top_;
-  if (node == nullptr) return nullptr;
-  bool matched;
-  while (!node->is_leaf) {
-    matched = false;
-    ScreeDBInnerNode* inner = (ScreeDBInnerNode*) node;
-    const uint8_t keycount = inner->keycount;
-    for (uint8_t idx = 0; idx < keycount; idx++) {
-      node = inner->children[idx];
-      if (strcmp(key.data_, inner->keys[idx].c_str()) <= 0) {
-        matched = true;
-        break;
-      }
+// Releases a snapshot from GetSnapshot, then trims versions of this tree. Callers trim other
+// trees in the pool, else their writers discard versions once no snapshots remain.
+void ScreeDBTree::ReleaseSnapshot(const Snapshot* snapshot) {
+  VersionLockAll();
+  owner_->snapshots_.erase(owner_->snapshots_.find(snapshot->GetSequenceNumber()));
+  owner_->snapshot_count_--;
+  VersionUnlockAll();
+  delete (const ScreeDBSnapshot*) snapshot;
+  TrimVersions();
+}
+
+// Discards saved versions that no live snapshot can read. A version replaced at sequence n is
+// read by snapshots from the sequence of the key's previous version (or zero) up to n - 1.
+// Locks one shard at a time, so writers to other shards continue.
+void ScreeDBTree::TrimVersions() {
+  auto& live = owner_->snapshots_;
+  uint64_t bytes = 0;                                                    // freed by discarding
+  for (int shard = 0; shard < VERSION_SHARDS; shard++) {
+    std::lock_guard<std::mutex> guard(owner_->version_mutexes_[shard]);
+    for (auto it = versions_[shard].begin(); it != versions_[shard].end();) {
+      auto& versions = it->second;
+      SequenceNumber previous = 0;
+      size_t kept = 0;
+      for (size_t i = 0; i < versions.size(); i++) {
+        auto reader = live.lower_bound(previous);
+        previous = versions[i].replaced;
+        if (reader == live.end() || *reader >= versions[i].replaced) {
+          bytes += versions[i].value.size() + it->first.size() + sizeof(ScreeDBVersion);
+          continue;
+        }
+        if (kept != i) versions[kept] = std::move(versions[i]);
+        kept++;
+      }
+      versions.resize(kept);
+      if (versions.empty()) it = versions_[shard].erase(it);
+      else ++it;
+    }
+  }
+  version_bytes_.fetch_sub(bytes);
+}
+
+// ===============================================================================================
+// PROTECTED BULK LOAD METHODS
+// ===============================================================================================
+
+// Frees leaves of a bulk load that was not published, one leaf per transaction like dropped
+// families, since the chain stays linked from the pool root until none are left.
+void ScreeDBTree::BulkDiscard() {
+  auto root = pop_.get_root();
+  while (root->loading != nullptr) {
+    auto leaf = root->loading;
+    TransactionRun([&] {
+      root->loading = leaf->next;
+      LeafFreePersistent(leaf);
+    });
+  }
+}
+
+// Splices loaded leaves into the tree in one transaction, then inserts them into the parents
+// of the leaf they follow like splits do, so only inner nodes above that leaf change. Locks
+// leaves from the one that may hold the lowest loaded key (the target) to the one that may
+// hold the highest, in key order like writers, and also the leaf before the target (without
+// waiting, since it sorts first) when loaded leaves go first. Splits the target without
+// copying when the loaded range falls between its keys, and afterwards merges away the locked
+// leaves left empty after the loaded ones. Returns an error without changes if any existing key
+// is within the loaded range.
+Status ScreeDBTree::BulkPublish(std::vector<ScreeDBRecoveredLeaf>& loaded) {
+  const Slice min_key = loaded.front().min_key;
+  const Slice max_key = loaded.back().max_key;
+  std::vector<ScreeDBLeafNode*> range;                                   // locked, in key order
+  ScreeDBLeafNode* prev = nullptr;                                       // locked if loaded first
+  auto unlock = [&] {
+    for (auto leafnode : range) if (leafnode) LeafUnlock(leafnode);
+    if (prev) LeafUnlock(prev);
+    range.clear();
+    prev = nullptr;
+  };
+
+  // lock leaves whose range meets the loaded range, sorting target keys to either side of it
+  std::vector<int> below;                                                // target slots below
+  std::vector<int> above;                                                // target slots above
+  Slice below_max;
+  while (true) {
+    ScreeDBEpochGuard guard(&epochs_);                                   // searched nodes not freed
+    ScreeDBLeafNode* target;
+    while ((target = LeafLockForKey(min_key)) == nullptr) LeafCreateHead();
+    range.push_back(target);
+    while (true) {                                                       // locked ranges are fixed
+      uint64_t version;
+      auto found = std::find(range.begin(), range.end(), LeafSearch(&max_key, false, &version));
+      if (found != range.end()) {
+        while (range.end() - found > 1) {                                // passed it while racing
+          LeafUnlock(range.back());
+          range.pop_back();
+        }
+        break;
+      }
+      auto next = range.back()->next.load(std::memory_order_acquire);    // stable while locked
+      if (next) {
+        LeafLock(next);                                                  // in key order
+        range.push_back(next);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    below.clear();
+    above.clear();
+    for (auto leafnode : range) {
+      for (uint64_t used = ~LeafMatchSlots(leafnode, 0); used; used &= used - 1) {
+        const int slot = __builtin_ctzll(used);
+        if (slot >= NODE_KEYS) break;
+        const Slice key = leafnode->leaf->kv_keys[slot].get_ro().slice();
+        if (KeyCompare(key, min_key) < 0) {                              // only in target
+          below.push_back(slot);
+          if (below.size() == 1 || KeyCompare(below_max, key) < 0) below_max = key;
+        } else if (KeyCompare(key, max_key) <= 0) {
+          unlock();
+          return Status::NotSupported("Cannot add overlapping range");
+        } else if (leafnode == target) {
+          above.push_back(slot);
+        }
+      }
+    }
+    if (!below.empty()) break;                                           // loaded after target
+    auto before = target->prev.load(std::memory_order_acquire);
+    if (!before) break;                                                  // loaded first in tree
+    uint32_t unlocked = 0;                                               // never wait for prev
+    if (before->lock.compare_exchange_strong(unlocked, LEAF_LOCK_WRITER,
+                                             std::memory_order_acquire)) {
+      if (before->next.load(std::memory_order_acquire) == target) {
+        prev = before;
+        break;
+      }
+      LeafUnlock(before);
+    }
+    unlock();
+    std::this_thread::yield();                                           // let prev be released
+  }
+  std::unique_lock<std::mutex> guard(split_mutex_);
+  const auto target = range.front();
+  const bool after = !below.empty();                                     // else before target
+  const bool split = after && !above.empty();                            // only if range is one
+  LOG("Publishing " << loaded.size() << " loaded leaves" << (split ? ", splitting leaf" : ""));
+  NodeLock(target);                                                      // readers must retry
+
+  // link loaded leaves into persistent chain, moving target keys above them to a new leaf
+  ScreeDBLeafNode* split_leafnode = nullptr;
+  if (split) {
+    split_leafnode = new ScreeDBLeafNode();
+    split_leafnode->is_leaf = true;
+  }
+  if (after) prev = target;
+  auto next = after ? target->next.load(std::memory_order_acquire) : target;
+  loaded.back().leafnode->lock.store(LEAF_LOCK_WRITER, std::memory_order_relaxed); // for merges
+  ScreeDBLeafCounts counts;                                              // moving slots counts none
+  for (auto& rleaf : loaded) LeafCountAll(rleaf.leafnode, &counts);
+  if (split) {
+    counts.leaves++;
+    counts.pmem_bytes += sizeof(ScreeDBLeaf);
+  }
+  try {
+    TransactionRun([&] {
+      auto& link = prev ? prev->leaf->next : LeafHead();
+      auto last = loaded.back().leafnode->leaf;
+      if (split) {
+        const auto leaf = target->leaf;
+        const auto split_leaf = make_persistent<ScreeDBLeaf>();
+        split_leafnode->leaf = split_leaf;
+        for (int slot : above) {
+          const ScreeDBString slot_key = leaf->kv_keys[slot].get_ro();
+          IndexMove(slot_key.slice(), target, split_leafnode, slot);
+          if (slot_key.is_short()) {
+            split_leaf->kv_keys[slot].get_rw().set(slot_key.slice());
+          } else split_leaf->kv_keys[slot].swap(leaf->kv_keys[slot]);
+          const ScreeDBString slot_value = leaf->kv_values[slot].get_ro();
+          if (slot_value.is_short()) {
+            split_leaf->kv_values[slot].get_rw().set(slot_value.slice());
+          } else split_leaf->kv_values[slot].swap(leaf->kv_values[slot]);
+          split_leafnode->hashes[slot] = target->hashes[slot];
+          split_leaf->hashes[slot] = leaf->hashes[slot];
+          target->hashes[slot] = 0;
+          leaf->hashes[slot] = 0;
+        }
+        split_leaf->next = link;
+        last->next = split_leaf;
+      } else {
+        last->next = link;
+      }
+      link = loaded.front().leafnode->leaf;
+      pop_.get_root()->loading = nullptr;                                // published
+      LeafCountChange(ScreeDBLeafCounts(), counts);
+    });
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    if (split) LeafRestoreHashes(target);                                // slots were rolled back
+    delete split_leafnode;                                               // never reachable
+    NodeUnlock(target);
+    if (after) prev = nullptr;                                           // only target is locked
+    unlock();
+    return Status::IOError(name, e.what());                              // caller discards load
+  }
+
+  // link volatile leaves between their neighbours, then index loaded keys
+  std::vector<ScreeDBNode*> added;
+  for (auto& rleaf : loaded) added.push_back(rleaf.leafnode);
+  if (split) added.push_back(split_leafnode);
+  for (size_t i = 0; i < added.size(); i++) {
+    auto leafnode = (ScreeDBLeafNode*) added[i];
+    leafnode->prev.store(i > 0 ? (ScreeDBLeafNode*) added[i - 1] : prev, std::memory_order_relaxed);
+    leafnode->next.store(i + 1 < added.size() ? (ScreeDBLeafNode*) added[i + 1] : next,
+                         std::memory_order_relaxed);
+  }
+  if (next) next->prev.store((ScreeDBLeafNode*) added.back(), std::memory_order_release);
+  if (prev) prev->next.store((ScreeDBLeafNode*) added.front(), std::memory_order_release);
+  if (after) prev = nullptr;                                             // only target is locked
+  for (auto& rleaf : loaded) {
+    for (int slot = 0; slot < NODE_KEYS; slot++) {
+      if (rleaf.leafnode->hashes[slot] == 0) break;                      // packed from first slot
+      IndexAdd(rleaf.leafnode->leaf->kv_keys[slot].get_ro().slice(), rleaf.leafnode, slot);
+    }
+  }
+
+  // move separators between locked leaves (which all sort within the loaded range) up to the
+  // highest loaded key, so the target's range holds the loaded range and later locked leaves
+  // (which are empty, except the last) hold nothing below it
+  if (range.size() > 1) {
+    const ScreeDBInnerKey* max_inner = split_keys_.Add(max_key);
+    std::vector<ScreeDBNode*> changing;                                  // nodes readers passed
+    std::vector<std::pair<ScreeDBInnerNode*, int>> separators;
+    for (size_t i = 1; i < range.size(); i++) {
+      ScreeDBNode* node = range[i];
+      changing.push_back(node);
+      auto inner = (ScreeDBInnerNode*) node->parent;
+      while (inner->children[0] == node) {                               // separator is higher
+        node = inner;
+        inner = (ScreeDBInnerNode*) inner->parent;
+        changing.push_back(node);
+      }
+      int idx = 1;
+      while (inner->children[idx] != node) idx++;
+      separators.emplace_back(inner, idx - 1);
+      changing.push_back(inner);
+    }
+    std::sort(changing.begin(), changing.end());
+    changing.erase(std::unique(changing.begin(), changing.end()), changing.end());
+    for (auto node : changing) NodeLock(node);                           // readers must retry
+    for (auto& separator : separators) separator.first->SetKey(separator.second, max_inner);
+    for (auto node : changing) NodeUnlock(node);
+  }
+
+  // insert loaded leaves into parents in key order like splits, putting the first in place
+  // of the target when they come before it
+  std::vector<ScreeDBNode*> sequence;
+  std::vector<Slice> bounds;                                             // highest key of each
+  if (after) {
+    sequence.push_back(target);
+    bounds.push_back(below_max);
+  } else {
+    auto first = loaded.front().leafnode;
+    auto parent = (ScreeDBInnerNode*) target->parent;
+    first->parent = parent;
+    if (parent) {
+      NodeLock(parent);
+      int idx = 0;
+      while (parent->children[idx] != target) idx++;
+      parent->children[idx] = first;
+      NodeUnlock(parent);
+    } else {
+      top_.store(first, std::memory_order_release);
+    }
+  }
+  for (auto& rleaf : loaded) {
+    sequence.push_back(rleaf.leafnode);
+    bounds.push_back(rleaf.max_key);
+  }
+  if (split) sequence.push_back(split_leafnode);
+  if (!after) sequence.push_back(target);
+  for (size_t i = 1; i < sequence.size(); i++) {
+    sequence[i]->parent = sequence[i - 1]->parent;
+    LeafUpdateParentsAfterSplit(sequence[i - 1], sequence[i], split_keys_.Add(bounds[i - 1]));
+  }
+  NodeUnlock(target);
+  guard.unlock();
+
+  // merge locked leaves after the loaded ones (which hold nothing, except the last) into the
+  // last loaded leaf or each other, so only leaves holding keys remain
+  auto kept = loaded.back().leafnode;
+  for (size_t i = after ? 1 : 0; i < range.size(); i++) {
+    if (LeafMergeNext(kept, range[i])) {
+      range[i] = nullptr;                                                // unlocked and retired
+      continue;
+    }
+    if (kept == loaded.back().leafnode) LeafUnlock(kept);
+    kept = range[i];
+  }
+  if (kept == loaded.back().leafnode) LeafUnlock(kept);
+  unlock();
+  return Status::OK();
+}
+
+// ===============================================================================================
+// PROTECTED LEAF METHODS
+// ===============================================================================================
+
+bool ScreeDBTree::LeafClearSlotForKey(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                      const Slice& key) {
+  const int slot = LeafFindSlot(leafnode, hash, key);
+  if (slot < 0) return false;
+  LOG("   freeing slot=" << slot);
+  ScreeDBLeafCounts before, after;
+  LeafCountSlot(leafnode, slot, &before);
+  leafnode->hashes[slot] = 0;
+  auto leaf = leafnode->leaf;
+  TransactionRun([&] {
+    leaf->hashes[slot] = 0;
+    IndexRemove(leaf->kv_keys[slot].get_ro().slice(), leafnode);         // before freeing key
+    LeafFreeStrings(leaf, slot);                                         // don't wait for reuse
+    LeafCountSlot(leafnode, slot, &after);                               // pinned value orphaned
+    LeafCountChange(before, after);
+  });
+  return true;
+}
+
+// Adds a leaf, its keys and the persistent bytes it holds to the counts.
+void ScreeDBTree::LeafCountAll(const ScreeDBLeafNode* leafnode, ScreeDBLeafCounts* counts) {
+  counts->leaves++;
+  counts->pmem_bytes += sizeof(ScreeDBLeaf);
+  for (int slot = 0; slot < NODE_KEYS; slot++) LeafCountSlot(leafnode, slot, counts);
+}
+
+// Updates the tickers counting leaves, keys and persistent bytes by the change from "before"
+// to "after", once the caller's transaction commits since an abort undoes the change.
+void ScreeDBTree::LeafCountChange(const ScreeDBLeafCounts& before,
+                                  const ScreeDBLeafCounts& after) {
+  ScreeDBLeafCounts change;                                              // wraps when negative
+  change.leaves = after.leaves - before.leaves;
+  change.keys = after.keys - before.keys;
+  change.orphaned_bytes = after.orphaned_bytes - before.orphaned_bytes;
+  change.pmem_bytes = after.pmem_bytes - before.pmem_bytes;
+  if (!change.leaves && !change.keys && !change.orphaned_bytes && !change.pmem_bytes) return;
+  TransactionDefer([this, change] {
+    if (change.leaves) tickers_.Add(SCREEDB_LEAVES, change.leaves);
+    if (change.keys) tickers_.Add(SCREEDB_KEYS, change.keys);
+    if (change.orphaned_bytes) tickers_.Add(SCREEDB_ORPHANED_BYTES, change.orphaned_bytes);
+    if (change.pmem_bytes) tickers_.Add(SCREEDB_PMEM_BYTES, change.pmem_bytes);
+  });
+}
+
+int ScreeDBTree::LeafCountKeys(const ScreeDBLeafNode* leafnode) {
+  return NODE_KEYS - __builtin_popcountll(LeafMatchSlots(leafnode, 0));
+}
+
+// Adds the slot's key if used, and the bytes of its long strings (orphaned if unused).
+void ScreeDBTree::LeafCountSlot(const ScreeDBLeafNode* leafnode, const int slot,
+                                ScreeDBLeafCounts* counts) {
+  const ScreeDBString& key = leafnode->leaf->kv_keys[slot].get_ro();
+  const ScreeDBString& value = leafnode->leaf->kv_values[slot].get_ro();
+  const uint64_t bytes = (key.is_short() ? 0 : key.capacity())
+                         + (value.is_short() ? 0 : value.capacity());
+  counts->pmem_bytes += bytes;
+  if (leafnode->hashes[slot] != 0) counts->keys++;
+  else counts->orphaned_bytes += bytes;
+}
+
+void ScreeDBTree::LeafCreateHead() {
+  std::lock_guard<std::mutex> guard(split_mutex_);
+  if (top_.load(std::memory_order_acquire) != nullptr) return;          // lost race to add head
+  LOG("   adding head leaf");
+  auto leafnode = new ScreeDBLeafNode();
+  leafnode->is_leaf = true;
+  auto& head = LeafHead();
+  auto old_head = head;
+  try {
+    TransactionRun([&] {
+      auto new_leaf = make_persistent<ScreeDBLeaf>();
+      new_leaf->next = old_head;
+      leafnode->leaf = new_leaf;
+      head = new_leaf;
+      ScreeDBLeafCounts added;
+      LeafCountAll(leafnode, &added);
+      LeafCountChange(ScreeDBLeafCounts(), added);
+    });
+  } catch (const std::exception&) {                                      // pool errors from nvml
+    delete leafnode;
+    throw;
+  }
+  top_.store(leafnode, std::memory_order_release);
+}
+
+void ScreeDBTree::LeafDebugDump(ScreeDBNode* node) {
+  if (DO_LOG) {
+    if (node->is_leaf) {
+      auto leaf = ((ScreeDBLeafNode*) node)->leaf;
+      for (int slot = 0; slot < NODE_KEYS; slot++) {
+        const Slice key = leaf->kv_keys[slot].get_ro().slice();
+        LOG("      " << std::to_string(slot) << "="
+                     << (leaf->hashes[slot] == 0 ? "n/a" : key.ToString()));
+      }
+    } else {
+      ScreeDBInnerNode* inner_node = (ScreeDBInnerNode*) node;
+      LOG("      keycount: " << std::to_string(inner_node->keycount));
+      for (int idx = 0; idx < inner_node->keycount; idx++) {
+        LOG("      " << std::to_string(idx) << ":" << inner_node->keys[idx]->data());
+      }
+    }
+  }
+}
+
+void ScreeDBTree::LeafDebugDumpWithChildren(ScreeDBInnerNode* inner) {
+  LeafDebugDump(inner);
+  for (int i = 0; i < inner->keycount + 1; i++) {
+    LOG ("      dumping child node " << std::to_string(i) << "------------------------");
+    LeafDebugDump(inner->children[i]);
+  }
+}
+
+// Fills the first empty slot without a pinned orphan, returning it (else -1 if none).
+int ScreeDBTree::LeafFillFirstEmptySlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                        const Slice& key, const Slice& value) {
+  for (uint64_t empty = LeafMatchSlots(leafnode, 0); empty; empty &= empty - 1) {
+    const int slot = __builtin_ctzll(empty);
+    if (PinHeld(leafnode->leaf->kv_values[slot].get_ro())) continue;     // keep pinned orphans
+    LeafFillSpecificSlot(leafnode, hash, key, value, slot);
+    return slot;
+  }
+  return -1;
+}
+
+bool ScreeDBTree::LeafFillSlotForKey(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                     const Slice& key, const Slice& value) {
+  // scan for matching slot, then publish without transaction if possible (never within a
+  // caller's transaction, which must stay atomic and can't mix in atomic allocations)
+  int slot = LeafFindSlot(leafnode, hash, key);
+  const bool adding = slot < 0;
+  if (pmemobj_tx_stage() == TX_STAGE_NONE) {
+    const int published = LeafPublishSlot(leafnode, hash, key, value, slot);
+    if (published >= 0) {
+      if (adding) IndexAdd(key, leafnode, published);
+      else IndexMove(key, leafnode, leafnode, published);                // slot changed
+      return true;
+    }
+  }
+
+  // else take first empty slot, also when a reader has pinned the value being replaced
+  int old_slot = -1;
+  if (slot >= 0 && PinHeld(leafnode->leaf->kv_values[slot].get_ro())) std::swap(slot, old_slot);
+  if (slot < 0) {
+    for (uint64_t empty = LeafMatchSlots(leafnode, 0); empty && slot < 0; empty &= empty - 1) {
+      const int candidate = __builtin_ctzll(empty);
+      if (!PinHeld(leafnode->leaf->kv_values[candidate].get_ro())) slot = candidate;
+    }
+  }
+
+  // update suitable slot if found, hiding the pinned slot in the same transaction
+  if (slot >= 0) {
+    LOG("   filling slot=" << slot);
+    TransactionRun([&] {
+      if (old_slot >= 0) LeafHidePinnedSlot(leafnode, old_slot);
+      LeafFillSpecificSlot(leafnode, hash, key, value, slot);
+    });
+    if (adding) IndexAdd(key, leafnode, slot);
+    else if (old_slot >= 0) IndexMove(key, leafnode, leafnode, slot);
+  }
+  return slot >= 0;
+}
+
+void ScreeDBTree::LeafFillSpecificSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                       const Slice& key, const Slice& value, const int slot) {
+  auto leaf = leafnode->leaf;
+  ScreeDBLeafCounts before, after;
+  LeafCountSlot(leafnode, slot, &before);
+  if (leafnode->hashes[slot] == 0) leaf->kv_keys[slot].get_rw().set(key);
+  leafnode->hashes[slot] = hash;
+  leaf->hashes[slot] = (uint8_t) hash;                                   // low byte, never zero
+  leaf->kv_values[slot].get_rw().set(value);
+  LeafCountSlot(leafnode, slot, &after);
+  LeafCountChange(before, after);
+}
+
+// Frees long strings in empty slots of a locked leaf, returning the bytes freed. Only values
+// that were pinned when replaced or deleted (and are now released) are left there, besides
+// strings left by a crash.
+uint64_t ScreeDBTree::LeafFreeOrphans(ScreeDBLeafNode* leafnode) {
+  const auto leaf = leafnode->leaf;
+  uint64_t orphans = 0;
+  uint64_t bytes = 0;
+  for (uint64_t empty = LeafMatchSlots(leafnode, 0); empty; empty &= empty - 1) {
+    const int slot = __builtin_ctzll(empty);
+    const ScreeDBString& key = leaf->kv_keys[slot].get_ro();
+    const ScreeDBString& value = leaf->kv_values[slot].get_ro();
+    if ((key.is_short() && value.is_short()) || PinHeld(value)) continue;
+    if (!key.is_short()) bytes += key.capacity();
+    if (!value.is_short()) bytes += value.capacity();
+    orphans |= 1ULL << slot;
+  }
+  if (orphans) {
+    ScreeDBLeafCounts freed;
+    freed.orphaned_bytes = bytes;
+    freed.pmem_bytes = bytes;
+    try {
+      TransactionRun([&] {
+        for (; orphans; orphans &= orphans - 1) LeafFreeStrings(leaf, __builtin_ctzll(orphans));
+        LeafCountChange(freed, ScreeDBLeafCounts());
+      });
+    } catch (const std::exception& e) {                                  // pool errors from nvml
+      LOG("   could not free orphans: " << e.what());
+      return 0;                                                          // left for next time
+    }
+  }
+  return bytes;
+}
+
+// Frees a persistent leaf and any long strings it holds, within the caller's transaction.
+void ScreeDBTree::LeafFreePersistent(persistent_ptr<ScreeDBLeaf> leaf) {
+  for (int slot = 0; slot < NODE_KEYS; slot++) {
+    PinWait(leaf->kv_values[slot].get_ro());                             // merges avoid this
+    LeafFreeStrings(leaf, slot);
+  }
+  delete_persistent<ScreeDBLeaf>(leaf);
+}
+
+// Frees long key and value strings in a slot, within the caller's transaction. Pinned values
+// are left in the slot, to be freed by Compact once released.
+void ScreeDBTree::LeafFreeStrings(persistent_ptr<ScreeDBLeaf> leaf, const int slot) {
+  if (!leaf->kv_keys[slot].get_ro().is_short()) leaf->kv_keys[slot].get_rw().clear();
+  const ScreeDBString& value = leaf->kv_values[slot].get_ro();
+  if (!value.is_short() && !PinHeld(value)) leaf->kv_values[slot].get_rw().clear();
+}
+
+// Returns the slot holding the key, else -1, counting slots whose hash matched but whose
+// persistent key had to be compared, and searches for missing keys that KeyMayExist would
+// not have ruled out.
+int ScreeDBTree::LeafFindSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                              const Slice& key) {
+  uint64_t checked = 0;
+  int found = -1;
+  for (uint64_t matches = LeafMatchSlots(leafnode, hash); matches; matches &= matches - 1) {
+    const int slot = __builtin_ctzll(matches);
+    checked++;
+    if (leafnode->leaf->kv_keys[slot].get_ro().equals(key)) {            // no duplicate keys
+      found = slot;
+      break;
+    }
+  }
+  if (found < 0) {                                                       // filter for KeyMayExist
+    tickers_.Add(SCREEDB_ABSENT_LOOKUPS);
+    if (checked) tickers_.Add(SCREEDB_ABSENT_HASH_MATCHES);
+  }
+  if (checked) {
+    const uint64_t false_positives = checked - (found >= 0 ? 1 : 0);
+    tickers_.Add(SCREEDB_HASH_MATCHES, checked);
+    if (false_positives) tickers_.Add(SCREEDB_HASH_FALSE_POSITIVES, false_positives);
+    if (GetPerfLevel() >= kEnableCount) {
+      screedb_perf_context.hash_match_count += checked;
+      screedb_perf_context.hash_false_positive_count += false_positives;
+    }
+  }
+  return found;
+}
+
+// Empties a slot whose value is pinned by readers, within the caller's transaction, so the
+// key can be written to another slot. The value stays in the slot for Compact to free.
+void ScreeDBTree::LeafHidePinnedSlot(ScreeDBLeafNode* leafnode, const int slot) {
+  ScreeDBLeafCounts before, after;
+  LeafCountSlot(leafnode, slot, &before);
+  leafnode->hashes[slot] = 0;
+  leafnode->leaf->hashes[slot] = 0;
+  LeafFreeStrings(leafnode->leaf, slot);                                 // frees only long key
+  LeafCountSlot(leafnode, slot, &after);                                 // value now orphaned
+  LeafCountChange(before, after);
+}
+
+// Returns true if empty slots hold values still pinned by readers, which merging could free.
+bool ScreeDBTree::LeafHoldsPinnedOrphans(ScreeDBLeafNode* leafnode) {
+  if (pin_count_.load(std::memory_order_acquire) == 0) return false;
+  for (uint64_t empty = LeafMatchSlots(leafnode, 0); empty; empty &= empty - 1) {
+    const int slot = __builtin_ctzll(empty);
+    if (PinHeld(leafnode->leaf->kv_values[slot].get_ro())) return true;
+  }
+  return false;
+}
+
+// Returns the persistent head of leaves, kept in the family record unless the default tree.
+persistent_ptr<ScreeDBLeaf>& ScreeDBTree::LeafHead() {
+  return family_ ? family_->head : pop_.get_root()->head;
+}
+
+ScreeDBLeafNode* ScreeDBTree::LeafLockEdge(const bool last, const bool shared) {
+  ScreeDBEpochGuard guard(&epochs_);                                     // found leaf not freed
+  while (true) {
+    uint64_t version;
+    auto leafnode = LeafSearch(nullptr, last, &version);
+    if (!leafnode) return nullptr;
+    LeafLock(leafnode, shared);
+    if (leafnode->version.load(std::memory_order_acquire) == version) return leafnode;
+    LeafUnlock(leafnode, shared);                                        // split since search
+  }
+}
+
+ScreeDBLeafNode* ScreeDBTree::LeafLockForKey(const Slice& key, const ScreeDBInnerKey** upper,
+                                             const bool shared) {
+  ScreeDBEpochGuard guard(&epochs_);                                     // found leaf not freed
+  while (true) {
+    uint64_t version;
+    auto leafnode = LeafSearch(&key, false, &version, upper);
+    if (!leafnode) return nullptr;
+    LeafLock(leafnode, shared);
+    if (leafnode->version.load(std::memory_order_acquire) == version) return leafnode;
+    LeafUnlock(leafnode, shared);                                        // split since search
+  }
+}
+
+// Returns bitmask of slots whose hash equals the given hash, so zero finds empty slots.
+// Compares sixteen slots per instruction with SSE2 (or 32 with AVX2), else one at a time.
+uint64_t ScreeDBTree::LeafMatchSlots(const ScreeDBLeafNode* leafnode, const ScreeDBHash hash) {
+  const ScreeDBHash* hashes = leafnode->hashes;
+  uint64_t mask = 0;
+  int slot = 0;
+#if defined(__AVX2__) && SCREEDB_HASH_BITS == 8
+  const __m256i wide_needle = _mm256_set1_epi8((char) hash);
+  for (; slot + 32 <= NODE_KEYS; slot += 32) {
+    const __m256i block = _mm256_loadu_si256((const __m256i*) (hashes + slot));
+    mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, wide_needle))
+            << slot;
+  }
+#endif
+#if defined(__SSE2__) && SCREEDB_HASH_BITS == 8
+  const __m128i needle = _mm_set1_epi8((char) hash);
+  for (; slot + 16 <= NODE_KEYS; slot += 16) {
+    const __m128i block = _mm_loadu_si128((const __m128i*) (hashes + slot));
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) << slot;
+  }
+#elif defined(__SSE2__) && SCREEDB_HASH_BITS == 16
+  for (; slot + 16 <= NODE_KEYS; slot += 16) {                          // pack 16-bit results
+#if defined(__AVX2__)
+    const __m256i block = _mm256_loadu_si256((const __m256i*) (hashes + slot));
+    const __m256i eq = _mm256_cmpeq_epi16(block, _mm256_set1_epi16((short) hash));
+    const __m128i lo = _mm256_castsi256_si128(eq);
+    const __m128i hi = _mm256_extracti128_si256(eq, 1);
+#else
+    const __m128i needle = _mm_set1_epi16((short) hash);
+    const __m128i lo = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*) (hashes + slot)), needle);
+    const __m128i hi = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*) (hashes + slot + 8)),
+                                       needle);
+#endif
+    mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << slot;
+  }
+#endif
+  for (; slot < NODE_KEYS; slot++) {                                     // portable fallback
+    if (hashes[slot] == hash) mask |= 1ULL << slot;
+  }
+  return mask;
+}
+
+// Finds and locks the leaf holding the key using the hash index instead of inner nodes, also
+// returning the key's slot. Returns nullptr (with nothing locked) if the key is not present.
+// The slot stored with the entry is used once the leaf is locked if it still holds the key,
+// else the leaf's hashes are searched. Splits and merges move index entries while holding the
+// leaf locks, so when the locked leaf lacks the key, its entry is checked again and the search
+// restarts if the entry has moved.
+ScreeDBLeafNode* ScreeDBTree::LeafLockIndexed(const Slice& key, int* slot, const bool shared) {
+  const uint64_t index_hash = ScreeDBKeyIndex::Hash(key);
+  const ScreeDBHash hash = PearsonHash(key.data_, key.size_);
+  size_t nth = 0;                                                        // keys can share hash
+  int indexed = -1;                                                      // slot of found entry
+  ScreeDBLeafNode* leafnode;
+  ScreeDBEpochGuard guard(&epochs_);                                     // indexed leaf not freed
+  while ((leafnode = index_->Find(index_hash, nth, &indexed)) != nullptr) {
+    LeafLock(leafnode, shared);
+    if (indexed < NODE_KEYS && leafnode->hashes[indexed] == hash
+        && leafnode->leaf->kv_keys[indexed].get_ro().equals(key)) {
+      *slot = indexed;                                                   // slot still holds key
+      return leafnode;
+    }
+    *slot = LeafFindSlot(leafnode, hash, key);
+    if (*slot >= 0) return leafnode;                                     // found is always right
+    const bool moved = !index_->Contains(index_hash, leafnode);          // before leaf was locked
+    LeafUnlock(leafnode, shared);
+    nth = moved ? 0 : nth + 1;                                           // else other key's hash
+  }
+  return nullptr;
+}
+
+// Locks a leaf for one writer, else shared by readers, which never write to the leaf or free
+// its strings. A waiting writer holds off new readers, then waits for current ones to leave.
+// Leaf reads aren't validated by version like inner node reads, since a reader checking only
+// afterwards could already have followed a freed pointer: writers free replaced strings, and
+// merges free the next persistent leaf, within their transactions. Only volatile nodes are
+// retired through epochs, as deferring pool frees past a transaction would leak on a crash.
+// The cost is two atomic updates of the lock word per read, shared by all readers of a leaf.
+void ScreeDBTree::LeafLock(ScreeDBLeafNode* leafnode, const bool shared) {
+  uint32_t state = leafnode->lock.load(std::memory_order_relaxed);
+  while (true) {
+    if (state & LEAF_LOCK_WRITER) {                                      // writer holds or waits
+      std::this_thread::yield();
+      state = leafnode->lock.load(std::memory_order_relaxed);
+    } else if (leafnode->lock.compare_exchange_weak(state, shared ? state + 1
+                                                           : state | LEAF_LOCK_WRITER,
+                                                    std::memory_order_acquire)) {
+      break;
+    }
+  }
+  if (shared) return;
+  while (leafnode->lock.load(std::memory_order_acquire) != LEAF_LOCK_WRITER) {
+    std::this_thread::yield();                                           // readers leaving
+  }
+}
+
+// Moves all keys from the next leaf into this one and unlinks the next leaf, when both leaves
+// are locked, have the same parent and together are sparse enough. The next leaf is unlocked
+// and retired after merging, so returns true when the caller must no longer use it.
+bool ScreeDBTree::LeafMergeNext(ScreeDBLeafNode* leafnode, ScreeDBLeafNode* next) {
+  const int count = LeafCountKeys(leafnode);
+  const int next_count = LeafCountKeys(next);
+  if (count > 0 && next_count > 0 && count + next_count > LEAF_MERGE_MAX) return false;
+  std::lock_guard<std::mutex> guard(split_mutex_);                       // after leaf locks
+  if (!next->parent || next->parent != leafnode->parent) return false;   // only merge siblings
+  if (leafnode->leaf->next != next->leaf) return false;                  // chain out of order
+  if (LeafHoldsPinnedOrphans(leafnode) || LeafHoldsPinnedOrphans(next)) return false;
+  LOG("   merging " << next_count << " keys into leaf with " << count << " keys");
+  NodeLock(leafnode);                                                    // readers must retry
+  NodeLock(next);
+
+  // move keys into empty slots, then unlink and free the next persistent leaf
+  const auto leaf = leafnode->leaf;
+  const auto next_leaf = next->leaf;
+  try {
+    TransactionRun([&] {
+      uint64_t empty = LeafMatchSlots(leafnode, 0);
+      for (uint64_t used = ~LeafMatchSlots(next, 0); used; used &= used - 1) {
+        const int slot = __builtin_ctzll(used);
+        if (slot >= NODE_KEYS) break;
+        const int target = __builtin_ctzll(empty);
+        empty &= empty - 1;
+        leaf->kv_keys[target].swap(next_leaf->kv_keys[slot]);
+        leaf->kv_values[target].swap(next_leaf->kv_values[slot]);
+        leafnode->hashes[target] = next->hashes[slot];
+        leaf->hashes[target] = next_leaf->hashes[slot];
+        next->hashes[slot] = 0;                                          // indexed readers retry
+        IndexMove(leaf->kv_keys[target].get_ro().slice(), next, leafnode, target);
+      }
+      leaf->next = next_leaf->next;
+      ScreeDBLeafCounts freed;
+      LeafCountAll(next, &freed);                                        // only orphans are left
+      LeafFreePersistent(next_leaf);
+      LeafCountChange(freed, ScreeDBLeafCounts());
+    });
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    LOG("   could not merge leaves: " << e.what());
+    LeafRestoreHashes(leafnode);                                         // slots were rolled back
+    LeafRestoreHashes(next);
+    NodeUnlock(next);
+    NodeUnlock(leafnode);
+    return false;                                                        // both still locked
+  }
+
+  // unlink next leaf from volatile leaves and parent, keeping it for optimistic readers
+  auto after = next->next.load(std::memory_order_acquire);
+  if (after) after->prev.store(leafnode, std::memory_order_release);
+  leafnode->next.store(after, std::memory_order_release);
+  next->prev.store(nullptr, std::memory_order_relaxed);                  // iterators must search
+  next->next.store(nullptr, std::memory_order_relaxed);
+  ScreeDBEpochGuard epoch(&epochs_);                                     // next not freed yet
+  NodeRemoveChild((ScreeDBInnerNode*) next->parent, next);
+  NodeUnlock(next);
+  NodeUnlock(leafnode);
+  LeafUnlock(next);
+  return true;
+}
+
+// Fills an unused slot and publishes it without an undo log. Key and value are persisted first,
+// then one atomic store into the leaf hashes makes the slot visible, and for an update hides
+// the key's old slot in the same store. That needs an empty slot sharing an aligned word of
+// hashes with the old slot, else returns -1 so the caller can use a transaction. Strings left
+// in the old slot are freed last, and Compact reclaims them if interrupted by a crash. Returns
+// the slot published.
+int ScreeDBTree::LeafPublishSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                 const Slice& key, const Slice& value, const int old_slot) {
+  const auto leaf = leafnode->leaf;
+  uint64_t empty = LeafMatchSlots(leafnode, 0);
+  if (old_slot >= 0) empty &= 0xFFULL << (old_slot & ~7);                // same word as update
+  int slot = -1;
+  for (; empty && slot < 0; empty &= empty - 1) {                        // skip orphaned strings
+    const int candidate = __builtin_ctzll(empty);
+    if (leaf->kv_keys[candidate].get_ro().is_short()
+        && leaf->kv_values[candidate].get_ro().is_short()) slot = candidate;
+  }
+  if (slot < 0) return -1;
+  LOG("   publishing slot=" << slot << (old_slot >= 0 ? ", replacing slot=" : ""));
+  ScreeDBLeafCounts before, after;                                       // new slot counts none
+  if (old_slot >= 0) LeafCountSlot(leafnode, old_slot, &before);
+  leaf->kv_keys[slot].get_rw().set_atomic(pop_, key);                    // persisted, not visible
+  leaf->kv_values[slot].get_rw().set_atomic(pop_, value);
+
+  // publish new slot and hide old slot with single 8-byte store, which is aligned because
+  // hashes start the leaf and pool allocations are aligned to at least 8 bytes
+  static_assert(offsetof(ScreeDBLeaf, hashes) % sizeof(uint64_t) == 0
+                && sizeof(ScreeDBLeaf::hashes) == NODE_KEYS && NODE_KEYS % 8 == 0,
+                "leaf hashes must be whole aligned words of one-byte hashes");
+  uint64_t* word = reinterpret_cast<uint64_t*>(&leaf->hashes[slot & ~7]);
+  uint64_t hashes = *word;
+  reinterpret_cast<uint8_t*>(&hashes)[slot & 7] = (uint8_t) hash;        // low byte, never zero
+  if (old_slot >= 0) reinterpret_cast<uint8_t*>(&hashes)[old_slot & 7] = 0;
+  __atomic_store_n(word, hashes, __ATOMIC_RELEASE);
+  pop_.persist(word, sizeof(uint64_t));
+  leafnode->hashes[slot] = hash;
+  LeafCountSlot(leafnode, slot, &after);
+  if (old_slot < 0) {
+    LeafCountChange(before, after);
+    return slot;
+  }
+
+  // free long strings from old slot, while short strings need no freeing once hidden
+  leafnode->hashes[old_slot] = 0;
+  ScreeDBString& old_key = leaf->kv_keys[old_slot].get_rw();
+  ScreeDBString& old_value = leaf->kv_values[old_slot].get_rw();
+  if (!old_key.is_short()) old_key.clear_atomic(pop_);
+  if (!old_value.is_short() && !PinHeld(old_value)) old_value.clear_atomic(pop_);
+  LeafCountSlot(leafnode, old_slot, &after);                             // pinned value orphaned
+  LeafCountChange(before, after);
+  return slot;
+}
+
+// Reads the hashes of a locked leaf again from its persistent leaf, after a transaction that
+// changed them was aborted and its persistent changes were rolled back.
+void ScreeDBTree::LeafRestoreHashes(ScreeDBLeafNode* leafnode) {
+  const auto leaf = leafnode->leaf;
+  for (int slot = 0; slot < NODE_KEYS; slot++) {
+    if (leaf->hashes[slot] == 0) {
+      leafnode->hashes[slot] = 0;                                        // persisted when empty
+    } else {
+      const Slice key = leaf->kv_keys[slot].get_ro().slice();
+      leafnode->hashes[slot] = PearsonHash(key.data(), key.size());
     }
-    if (!matched) node = inner->children[keycount];
   }
+}
+
+// Returns leaf that may hold the key (else the first or last leaf) and its version, and
+// optionally the highest key that leaf may hold (nullptr if unbounded), which stays valid
+// while that version is unchanged.
+ScreeDBLeafNode* ScreeDBTree::LeafSearch(const Slice* key, const bool last, uint64_t* version,
+                                         const ScreeDBInnerKey** upper) {
+  ScreeDBPerfTimer timer(&screedb_perf_context.leaf_search_nanos);
+  const uint64_t prefix = key ? ScreeDBKeyPrefix(key->data_, key->size_) : 0;
+  restart:
+  const ScreeDBInnerKey* bound = nullptr;
+  ScreeDBNode* node = top_.load(std::memory_order_acquire);
+  if (node == nullptr) return nullptr;
+  uint64_t node_version = NodeReadBegin(node);
+  if (top_.load(std::memory_order_acquire) != node) goto restart;       // top was split
+  while (!node->is_leaf) {
+    ScreeDBInnerNode* inner = (ScreeDBInnerNode*) node;
+    int idx;
+    if (key && bytewise_) idx = inner->FindChild(*key, prefix);          // no virtual calls
+    else if (key) idx = inner->FindChild(*key, comparator_);             // child holding key
+    else if (last) idx = std::min<int>(inner->keycount, INNER_KEYS + 1); // last child
+    else idx = 0;                                                        // first child
+    ScreeDBNode* child = inner->children[idx];
+    if (child == nullptr) goto restart;                                  // torn while changing
+    if (idx < inner->keycount) bound = inner->keys[idx];                 // tighter than parent
+    const uint64_t child_version = NodeReadBegin(child);
+    if (!NodeReadValidate(node, node_version)) goto restart;             // changed while reading
+    node = child;
+    node_version = child_version;
+  }
+  *version = node_version;
+  if (upper) *upper = bound;
   return (ScreeDBLeafNode*) node;
 }
 
-void ScreeDBTree::LeafSplit(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                            const Slice& key, const Slice& value) {
+void ScreeDBTree::LeafSortSlots(ScreeDBLeafNode* leafnode, std::vector<int>* slots) {
+  const auto leaf = leafnode->leaf;
+  slots->clear();
+  const uint64_t occupied = ~LeafMatchSlots(leafnode, 0) & ((1ULL << NODE_KEYS) - 1);
+  for (uint64_t bits = occupied; bits; bits &= bits - 1) slots->push_back(__builtin_ctzll(bits));
+  std::sort(slots->begin(), slots->end(), [this, &leaf](const int lhs, const int rhs) {
+    return KeyCompare(leaf->kv_keys[lhs].get_ro().slice(), leaf->kv_keys[rhs].get_ro().slice()) < 0;
+  });
+}
+
+// Splits a locked leaf at the middle of its used keys and the new key, adding the key to either
+// half and returning the new leaf locked. Within a caller's transaction, the new leaf is linked
+// to its neighbours and parents only once that transaction commits, so an abort leaves only the
+// new leaf to delete, and until then "split_key" tells the caller which keys belong in it.
+ScreeDBLeafNode* ScreeDBTree::LeafSplit(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                                        const Slice& key, const Slice& value,
+                                        const ScreeDBInnerKey** split_key) {
+  const bool nested = pmemobj_tx_stage() != TX_STAGE_NONE;              // caller commits later
   const auto leaf = leafnode->leaf;
-  const char* keys[NODE_KEYS + 1];                                       // temp array for sort
+  Slice keys[NODE_KEYS + 1];                                             // temp array for sort
+  int count = 0;                                                         // used slots plus new key
   for (int slot = NODE_KEYS; slot--;) {                                  // iterate leaf slots
-    keys[slot] = leaf->kv_keys[slot].get_ro().data();                    // shallow pointer copy
+    if (leafnode->hashes[slot] == 0) continue;                           // skip unused and orphans
+    keys[count++] = leaf->kv_keys[slot].get_ro().slice();                // shallow pointer copy
   }                                                                      // done iterating
-  keys[NODE_KEYS] = key.data_;                                           // copy new key pointer
-  std::sort(std::begin(keys), std::end(keys),                            // sort the key array
-            [](const char*& lhs, const char*& rhs) {                     // using closure method
-              return (strcmp(lhs, rhs) < 0);                             // comparing as c-strings
+  keys[count++] = key;                                                   // copy new key pointer
+  std::sort(keys, keys + count,                                          // sort the used keys
+            [this](const Slice& lhs, const Slice& rhs) {                 // using closure method
+              return KeyCompare(lhs, rhs) < 0;                           // in comparator order
             });                                                          // done with closure
-  std::string split_key = keys[NODE_KEYS_MIDPOINT];                      // read from the middle
-  LOG("   splitting leaf at key=" << split_key);
+  std::lock_guard<std::mutex> guard(split_mutex_);                       // one split at a time
+  tickers_.Add(SCREEDB_LEAF_SPLITS);                                     // counted per tree
+  if (GetPerfLevel() >= kEnableCount) screedb_perf_context.leaf_split_count++;
+  auto middle_key = split_keys_.Add(keys[(count - 1) / 2]);              // read from the middle
+  LOG("   splitting leaf at key=" << middle_key->data());
+  NodeLock(leafnode);                                                    // readers must retry
 
-  // split leaf into two leaves, moving slots that sort above split key to new leaf
+  // split leaf into two leaves, moving used slots that sort above split key to new leaf, while
+  // orphaned strings stay behind until freed (unless every slot holds a pinned orphan, when
+  // they all move to the new leaf to leave room for the key)
   auto new_leafnode = new ScreeDBLeafNode();
-  new_leafnode->parent = leafnode->parent;
   new_leafnode->is_leaf = true;
+  new_leafnode->lock.store(LEAF_LOCK_WRITER, std::memory_order_relaxed); // locked for caller
   persistent_ptr<ScreeDBLeaf> new_leaf;
-  auto root = pop_.get_root();
-  auto old_head = root->head;
-  transaction::exec_tx(pop_, [&] {
-    new_leaf = make_persistent<ScreeDBLeaf>();
-    new_leaf->next = old_head;
-    new_leafnode->leaf = new_leaf;
-    for (int slot = NODE_KEYS; slot--;) {
-      const ScreeDBString slot_key = leaf->kv_keys[slot].get_ro();
-      if (strcmp(slot_key.data(), split_key.data()) > 0) {
+  try {
+    TransactionRun([&] {
+      new_leaf = make_persistent<ScreeDBLeaf>();
+      new_leaf->next = leaf->next;                                       // keep chain in order
+      new_leafnode->leaf = new_leaf;
+      ScreeDBLeafCounts added;                                           // moving slots counts none
+      added.leaves = 1;
+      added.pmem_bytes = sizeof(ScreeDBLeaf);
+      LeafCountChange(ScreeDBLeafCounts(), added);
+      auto move_strings = [&](const int slot) {
+        const ScreeDBString slot_key = leaf->kv_keys[slot].get_ro();
         if (slot_key.is_short()) {
-          new_leaf->kv_keys[slot].get_rw().set(slot_key.data());
+          new_leaf->kv_keys[slot].get_rw().set(slot_key.slice());
         } else new_leaf->kv_keys[slot].swap(leaf->kv_keys[slot]);
         const ScreeDBString slot_value = leaf->kv_values[slot].get_ro();
         if (slot_value.is_short()) {
-          new_leaf->kv_values[slot].get_rw().set(slot_value.data());
+          new_leaf->kv_values[slot].get_rw().set(slot_value.slice());
         } else new_leaf->kv_values[slot].swap(leaf->kv_values[slot]);
-        new_leafnode->hashes[slot] = leafnode->hashes[slot];
-        new_leaf->hashes[slot] = leafnode->hashes[slot];
-        leafnode->hashes[slot] = 0;
-        leaf->hashes[slot] = 0;
+      };
+      for (int slot = NODE_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == 0) {                               // not a live key
+          if (count == 1) move_strings(slot);                            // only pinned orphans
+          continue;
+        }
+        const Slice slot_key = leaf->kv_keys[slot].get_ro().slice();
+        if (KeyCompare(slot_key, middle_key->slice()) > 0) {
+          IndexMove(slot_key, leafnode, new_leafnode, slot);
+          move_strings(slot);
+          new_leafnode->hashes[slot] = leafnode->hashes[slot];
+          new_leaf->hashes[slot] = leaf->hashes[slot];
+          leafnode->hashes[slot] = 0;
+          leaf->hashes[slot] = 0;
+        }
       }
+      auto target = KeyCompare(key, middle_key->slice()) > 0 ? new_leafnode : leafnode;
+      const int old_slot = LeafFindSlot(target, hash, key);              // when value is pinned
+      if (old_slot >= 0) LeafHidePinnedSlot(target, old_slot);
+      const int slot = LeafFillFirstEmptySlot(target, hash, key, value);
+      if (old_slot < 0) IndexAdd(key, target, slot);
+      else IndexMove(key, target, target, slot);
+      leaf->next = new_leaf;
+    });
+  } catch (const std::exception&) {                                      // caller restores hashes
+    NodeUnlock(leafnode);
+    delete new_leafnode;                                                 // never reachable
+    throw;
+  }
+  if (split_key) *split_key = middle_key;
+
+  // link new leaf after the split leaf, then recursively update volatile parents
+  auto publish = [this, leafnode, new_leafnode, middle_key] {
+    auto next_leafnode = leafnode->next.load(std::memory_order_acquire);
+    new_leafnode->prev.store(leafnode, std::memory_order_relaxed);
+    new_leafnode->next.store(next_leafnode, std::memory_order_relaxed);
+    if (next_leafnode) next_leafnode->prev.store(new_leafnode, std::memory_order_release);
+    leafnode->next.store(new_leafnode, std::memory_order_release);
+    new_leafnode->parent = leafnode->parent;
+    LeafUpdateParentsAfterSplit(leafnode, new_leafnode, middle_key);
+  };
+  if (nested) {
+    TransactionDefer([this, leafnode, publish] {                         // leaves still locked
+      std::lock_guard<std::mutex> guard(split_mutex_);
+      NodeLock(leafnode);                                                // readers must retry
+      publish();
+      NodeUnlock(leafnode);
+    });
+  } else {
+    publish();
+  }
+  NodeUnlock(leafnode);
+  return new_leafnode;
+}
+
+// Merges a locked leaf with its next leaf, else into its previous leaf if that can be locked
+// without waiting (since it sorts first). Returns the locked leaf now holding its keys.
+ScreeDBLeafNode* ScreeDBTree::LeafUnderflow(ScreeDBLeafNode* leafnode) {
+  auto next = leafnode->next.load(std::memory_order_acquire);            // stable while locked
+  if (next) {
+    LeafLock(next);                                                      // in key order
+    if (LeafMergeNext(leafnode, next)) return leafnode;
+    LeafUnlock(next);
+  }
+  ScreeDBEpochGuard guard(&epochs_);                                     // prev not freed unlocked
+  auto prev = leafnode->prev.load(std::memory_order_acquire);
+  uint32_t unlocked = 0;                                                 // never wait for prev
+  if (prev && prev->lock.compare_exchange_strong(unlocked, LEAF_LOCK_WRITER,
+                                                 std::memory_order_acquire)) {
+    if (prev->next.load(std::memory_order_acquire) == leafnode && LeafMergeNext(prev, leafnode)) {
+      return prev;
     }
-    auto target = strcmp(key.data_, split_key.data()) > 0 ? new_leafnode : leafnode;
-    LeafFillFirstEmptySlot(target, hash, key, value);
-    root->head = new_leaf;
-  });
+    LeafUnlock(prev);
+  }
+  return leafnode;
+}
 
-  // recursively update volatile parents outside persistent transaction
-  LeafUpdateParentsAfterSplit(leafnode, new_leafnode, &split_key);
+void ScreeDBTree::LeafUnlock(ScreeDBLeafNode* leafnode, const bool shared) {
+  if (shared) leafnode->lock.fetch_sub(1, std::memory_order_release);
+  else leafnode->lock.store(0, std::memory_order_release);               // no readers entered
 }
 
 void ScreeDBTree::LeafUpdateParentsAfterSplit(ScreeDBNode* node, ScreeDBNode* new_node,
-                                              std::string* split_key) {
+                                              const ScreeDBInnerKey* split_key) {
   if (!node->parent) {
-    LOG("   creating new top node for split_key=" << *split_key);
+    LOG("   creating new top node for split_key=" << split_key->data());
     auto top = new ScreeDBInnerNode();
     top->keycount = 1;
-    top->keys[0] = *split_key;
+    top->SetKey(0, split_key);
     top->children[0] = node;
     top->children[1] = new_node;
     node->parent = top;
     new_node->parent = top;
     LeafDebugDumpWithChildren(top);                                      // dump details
-    top_ = top;                                                          // assign new top node
+    top_.store(top, std::memory_order_release);                          // assign new top node
     return;                                                              // end recursion
   }
 
-  LOG("   updating parents for split_key=" << *split_key);
+  LOG("   updating parents for split_key=" << split_key->data());
   ScreeDBInnerNode* inner = (ScreeDBInnerNode*) node->parent;
+  NodeLock(inner);                                                       // until parents updated
   { // insert split_key and new_node into inner node in sorted order
-    const uint8_t keycount = inner->keycount;
-    int idx = 0;  // position where split_key should be inserted
-    while (idx < keycount && inner->keys[idx].compare(*split_key) <= 0) idx++;
-    for (int i = keycount - 1; i >= idx; i--) inner->keys[i + 1] = inner->keys[i];
+    const int keycount = inner->keycount;
+    const int idx = bytewise_ ? inner->FindChild(split_key->slice(), split_key->prefix)
+                              : inner->FindChild(split_key->slice(), comparator_);
+    for (int i = keycount - 1; i >= idx; i--) inner->SetKey(i + 1, inner->keys[i]);
     for (int i = keycount; i >= idx; i--) inner->children[i + 1] = inner->children[i];
-    inner->keys[idx] = *split_key;
+    inner->SetKey(idx, split_key);
     inner->children[idx + 1] = new_node;
-    inner->keycount = (uint8_t) (keycount + 1);
+    inner->keycount = (uint16_t) (keycount + 1);
+  }
+  const int keycount = inner->keycount;
+  if (keycount <= INNER_KEYS) {                                          // no split needed?
+    NodeUnlock(inner);                                                   // readers can proceed
+    return;                                                              // end recursion
   }
-  const uint8_t keycount = inner->keycount;
-  if (keycount <= INNER_KEYS) return;                                    // end recursion
 
   // split inner node at the midpoint, update parents as needed
   auto new_inner = new ScreeDBInnerNode();                               // allocate new node
   new_inner->parent = inner->parent;                                     // set parent reference
   for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                    // copy all upper keys
-    new_inner->keys[i - INNER_KEYS_UPPER] = inner->keys[i];              // copy key string
+    new_inner->SetKey(i - INNER_KEYS_UPPER, inner->keys[i]);             // copy key reference
   }
   for (int i = INNER_KEYS_UPPER; i < keycount + 1; i++) {                // copy all upper children
     new_inner->children[i - INNER_KEYS_UPPER] = inner->children[i];      // copy child reference
     new_inner->children[i - INNER_KEYS_UPPER]->parent = new_inner;       // set parent reference
   }
   new_inner->keycount = INNER_KEYS_MIDPOINT;                             // always half the keys
-  std::string new_split_key = inner->keys[INNER_KEYS_MIDPOINT];          // save for recursion
+  auto new_split_key = inner->keys[INNER_KEYS_MIDPOINT];                 // save for recursion
   inner->keycount = INNER_KEYS_MIDPOINT;                                 // half of keys remain
-  LeafUpdateParentsAfterSplit(inner, new_inner, &new_split_key);         // recursive update
+  LeafUpdateParentsAfterSplit(inner, new_inner, new_split_key);          // recursive update
+  NodeUnlock(inner);                                                     // readers can proceed
 }
 
-// ===============================================================================================
-// PROTECTED LIFECYCLE METHODS
-// ===============================================================================================
-
-void ScreeDBTree::Recover() {
-  LOG("Recovering tree");
-  auto root = pop_.get_root();
-  if (!root->head) {
-    LOG("   creating root");
-    transaction::exec_tx(pop_, [&] {
-      root->opened = 1;
-      root->closed = 0;
-    });
-  } else {
-    LOG("   recovering head: opened=" << root->opened << ", closed=" << root->closed);
-    // todo handle opened/closed inequality, including count correction
-    RebuildNodes();
-    transaction::exec_tx(pop_, [&] { root->opened = root->opened + 1; });
+// Builds each inner level in one pass over the level below, until one node remains, given the
+// highest key each node of the bottom level may hold. Returns the top node, else nullptr.
+ScreeDBNode* ScreeDBTree::NodeBuildParents(std::vector<ScreeDBNode*>& level,
+                                           std::vector<const ScreeDBInnerKey*>& level_keys) {
+  while (level.size() > 1) {
+    std::vector<ScreeDBNode*> parents;
+    std::vector<const ScreeDBInnerKey*> parent_keys;
+    size_t start = 0;
+    while (start < level.size()) {
+      size_t count = std::min<size_t>(INNER_KEYS + 1, level.size() - start);
+      if (level.size() - start - count == 1) count--;                    // never leave one child
+      auto inner = new ScreeDBInnerNode();
+      inner->keycount = (uint16_t) (count - 1);
+      for (size_t i = 0; i < count; i++) {
+        inner->children[i] = level[start + i];
+        inner->children[i]->parent = inner;
+        if (i < count - 1) inner->SetKey((int) i, level_keys[start + i]);
+      }
+      parents.push_back(inner);
+      parent_keys.push_back(level_keys[start + count - 1]);
+      start += count;
+    }
+    level.swap(parents);
+    level_keys.swap(parent_keys);
   }
-  LOG("Recovered tree ok");
+  if (level.empty()) return nullptr;
+  level[0]->parent = nullptr;
+  return level[0];
 }
 
-void ScreeDBTree::RebuildNodes() {
-  LOG("   rebuilding nodes");
+void ScreeDBTree::NodeFree(ScreeDBNode* node) {
+  if (node->is_leaf) delete (ScreeDBLeafNode*) node;
+  else delete (ScreeDBInnerNode*) node;
+}
 
-  // traverse persistent leaves to build list of leaves to recover
-  std::list<ScreeDBRecoveredLeaf*> leaves;
-  auto leaf = pop_.get_root()->head;
-  while (leaf != nullptr) {
-    auto leafnode = new ScreeDBLeafNode();
-    leafnode->leaf = leaf;
-    leafnode->is_leaf = true;
+void ScreeDBTree::NodeLock(ScreeDBNode* node) {
+  node->version.fetch_add(1, std::memory_order_acq_rel);                 // odd while changing
+}
 
-    // find highest sorting key in leaf, while recovering all hashes
-    char* max_key = nullptr;
-    for (int slot = NODE_KEYS; slot--;) {
-      leafnode->hashes[slot] = leaf->hashes[slot];
-      if (leafnode->hashes[slot] == 0) continue;
-      char* key = leaf->kv_keys[slot].get_ro().data();
-      if (max_key == nullptr || strcmp(max_key, key) < 0) max_key = key;
-    }
+uint64_t ScreeDBTree::NodeReadBegin(ScreeDBNode* node) {
+  uint64_t version = node->version.load(std::memory_order_acquire);
+  while (version & 1) {                                                  // wait while changing
+    std::this_thread::yield();
+    version = node->version.load(std::memory_order_acquire);
+  }
+  return version;
+}
 
-    // use highest sorting key to decide how to recover the leaf
-    if (max_key == nullptr) {
-      // todo squelch until decided on handling empty leaf node (part of GC?)
-    } else {
-      auto rleaf = new ScreeDBRecoveredLeaf;
-      rleaf->leafnode = leafnode;
-      rleaf->max_key = max_key;
-      leaves.push_back(rleaf);
-    }
+bool ScreeDBTree::NodeReadValidate(ScreeDBNode* node, const uint64_t version) {
+  std::atomic_thread_fence(std::memory_order_acquire);                   // finish reads first
+  return node->version.load(std::memory_order_relaxed) == version;
+}
 
-    leaf = leaf->next ? leaf->next : nullptr;  // advance to next linked leaf
-  }
+// Removes a child (never the first) along with the key before it, then merges the inner node
+// with a sibling if sparse, or replaces the top node when it has one child left. Requires
+// split_mutex_, and retires removed nodes since readers may still hold them.
+void ScreeDBTree::NodeRemoveChild(ScreeDBInnerNode* inner, ScreeDBNode* child) {
+  NodeLock(inner);
+  const int keycount = inner->keycount;
+  int idx = 1;
+  while (inner->children[idx] != child) idx++;
+  for (int i = idx - 1; i < keycount - 1; i++) inner->SetKey(i, inner->keys[i + 1]);
+  for (int i = idx; i < keycount; i++) inner->children[i] = inner->children[i + 1];
+  inner->keycount = (uint16_t) (keycount - 1);
+  NodeUnlock(inner);
+  NodeRetire(child);
 
-  // sort recovered leaves in ascending key order
-  leaves.sort([](const ScreeDBRecoveredLeaf* lhs, const ScreeDBRecoveredLeaf* rhs) {
-    return (strcmp(lhs->max_key, rhs->max_key) < 0);
-  });
+  if (!inner->parent) {                                                  // top node?
+    if (inner->keycount > 0) return;
+    LOG("   replacing top node with its only child");
+    NodeLock(inner);                                                     // readers must retry
+    inner->children[0]->parent = nullptr;
+    top_.store(inner->children[0], std::memory_order_release);
+    NodeUnlock(inner);
+    NodeRetire(inner);
+    return;
+  }
+  if (inner->keycount >= INNER_KEYS / 4) return;
 
-  // reconstruct top/inner nodes using adjacent pairs of recovered leaves
-  top_ = nullptr;
-  while (!leaves.empty()) {
-    ScreeDBRecoveredLeaf* rleaf = leaves.front();
-    ScreeDBLeafNode* leafnode = rleaf->leafnode;
-    if (top_ == nullptr) top_ = leafnode;
-    leaves.pop_front();
-    if (!leaves.empty()) {
-      std::string split_key = std::string(rleaf->max_key);
-      ScreeDBLeafNode* nextnode = leaves.front()->leafnode;
-      nextnode->parent = leafnode->parent;
-      LeafUpdateParentsAfterSplit(leafnode, nextnode, &split_key);
-    }
-    delete rleaf;
+  // merge right node into left, using key between them from parent
+  ScreeDBInnerNode* parent = (ScreeDBInnerNode*) inner->parent;
+  if (parent->keycount == 0) return;                                     // no siblings
+  int pos = 0;
+  while (parent->children[pos] != inner) pos++;
+  const int left_pos = pos < parent->keycount ? pos : pos - 1;
+  ScreeDBInnerNode* left = (ScreeDBInnerNode*) parent->children[left_pos];
+  ScreeDBInnerNode* right = (ScreeDBInnerNode*) parent->children[left_pos + 1];
+  const int left_keys = left->keycount;
+  const int right_keys = right->keycount;
+  if (left_keys + right_keys + 1 > INNER_KEYS * 3 / 4) return;
+  LOG("   merging inner nodes with " << left_keys << " and " << right_keys << " keys");
+  NodeLock(left);
+  NodeLock(right);
+  left->SetKey(left_keys, parent->keys[left_pos]);
+  for (int i = 0; i < right_keys; i++) left->SetKey(left_keys + 1 + i, right->keys[i]);
+  for (int i = 0; i <= right_keys; i++) {
+    left->children[left_keys + 1 + i] = right->children[i];
+    right->children[i]->parent = left;
   }
+  left->keycount = (uint16_t) (left_keys + right_keys + 1);
+  NodeRemoveChild(parent, right);                                        // recursive update
+  NodeUnlock(right);
+  NodeUnlock(left);
+}
 
-  LOG("   rebuilt nodes ok");
+// Keeps an unlinked node until readers that might have found it have left. Callers that use
+// the node after retiring it must hold an epoch guard, else it may be freed at once.
+void ScreeDBTree::NodeRetire(ScreeDBNode* node) {
+  epochs_.Retire(node);
 }
 
-void ScreeDBTree::Shutdown() {
-  LOG("Shutting down tree");
-  auto root = pop_.get_root();
-  transaction::exec_tx(pop_, [&] { root->closed = root->closed + 1; });
-  LOG("Shut down tree ok");
+void ScreeDBTree::NodeUnlock(ScreeDBNode* node) {
+  node->version.fetch_add(1, std::memory_order_release);                 // even when stable
 }
 
 // ===============================================================================================
-// PROTECTED HELPER METHODS
+// PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
+// Wakes every "interval_ms" to free retired nodes that readers have left, even when no reader
+// exits and no node is retired meanwhile. Also compacts a few leaves at a time if "compact",
+// resuming where the last step stopped, so space freed by deletes returns without CompactRange.
+void ScreeDBTree::BackgroundRun(const uint32_t interval_ms, const bool compact) {
+  std::string resume;                                                    // where last step stopped
+  std::unique_lock<std::mutex> guard(background_mutex_);
+  while (!background_wake_.wait_for(guard, std::chrono::milliseconds(interval_ms),
+                                    [&] { return background_stop_; })) {
+    guard.unlock();
+    if (compact) {
+      const std::string from(resume);
+      const Slice begin(from);
+      Compact(from.empty() ? nullptr : &begin, nullptr, COMPACT_LEAVES, &resume);
+    } else {
+      epochs_.Reclaim();
+    }
+    guard.lock();
+  }
+}
+
+void ScreeDBTree::BackgroundStart(const ScreeDBOptions& options) {
+  if (!open_status_.ok() || options.reclaim_interval_ms == 0) return;
+  background_ = std::thread(&ScreeDBTree::BackgroundRun, this, options.reclaim_interval_ms,
+                            options.compact_in_background);
+}
+
+void ScreeDBTree::BackgroundStop() {
+  if (!background_.joinable()) return;
+  {
+    std::lock_guard<std::mutex> guard(background_mutex_);
+    background_stop_ = true;
+  }
+  background_wake_.notify_one();
+  background_.join();
+}
+
+void ScreeDBTree::OpenPool(const ScreeDBOptions& options) {
+  // pool set files list their parts, which are all created together
+  bool exists = access(GetNamePtr(), F_OK) == 0;
+  bool is_set = false;
+  std::vector<std::string> parts;                                        // files holding pool
+  if (exists) {
+    std::ifstream file(name);
+    std::string line;
+    is_set = std::getline(file, line) && line.compare(0, 11, "PMEMPOOLSET") == 0;
+    while (is_set && std::getline(file, line)) {
+      std::istringstream words(line);
+      std::string size, part;
+      if (!(words >> size >> part) || size[0] == '#') continue;          // blank or comment
+      if (parts.empty()) exists = access(part.c_str(), F_OK) == 0;       // first part present?
+      parts.push_back(part);
+    }
+  }
+  if (!is_set) parts.push_back(name);
+
+  if (exists) {
+    LOG("Opening pool");
+    pop_ = pool<ScreeDBRoot>::open(GetNamePtr(), options.layout);
+  } else {
+    LOG("Creating pool" << (is_set ? " from pool set" : ""));
+    const size_t pool_size = is_set ? 0 : options.pool_size;             // parts give set size
+    pop_ = pool<ScreeDBRoot>::create(GetNamePtr(), options.layout, pool_size, S_IRWXU);
+    if (options.prefault && pool_size > 0) {                             // mapped as one file
+      LOG("   prefaulting " << pool_size << " bytes");
+      const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+      volatile char* base = (volatile char*) pop_.get_handle();          // start of mapping
+      for (size_t offset = 0; offset < pool_size; offset += page) base[offset] = base[offset];
+    }
+  }
+  for (auto& part : parts) {                                             // sized once opened
+    struct stat status;
+    if (stat(part.c_str(), &status) == 0) pool_bytes_ += (uint64_t) status.st_size;
+  }
+}
+
+void ScreeDBTree::Recover() {
+  LOG("Recovering tree");
+  auto root = pop_.get_root();
+  const Slice comparator_name(comparator_->Name());
+  if (!family_) {                                                        // interrupted or closed
+    while (root->dropped != nullptr) ReclaimFamily(root->dropped);
+    BulkDiscard();                                                       // load never published
+  }
+  if (!family_ && !root->head) {
+    LOG("   creating root");
+    TransactionRun([&] {
+      root->opened = 1;
+      root->closed = 0;
+      root->comparator.get_rw().set(comparator_name);
+    });
+  } else {
+    const Slice stored_name = (family_ ? family_->comparator : root->comparator).get_ro().slice();
+    if (stored_name != comparator_name) {
+      open_status_ = Status::InvalidArgument(comparator_name, "does not match existing comparator "
+                                                              + stored_name.ToString());
+      LOG("   comparator mismatch, not recovering");
+      return;
+    }
+    if (family_) {
+      LOG("   recovering column family with id " << GetFamilyId());
+      RebuildNodes();
+    } else {
+      LOG("   recovering head: opened=" << root->opened << ", closed=" << root->closed);
+      // todo handle opened/closed inequality, including count correction
+      RebuildNodes();
+      TransactionRun([&] { root->opened = root->opened + 1; });
+    }
+  }
+  LOG("Recovered tree ok");
+}
+
+void ScreeDBTree::RebuildInnerNodes(std::vector<ScreeDBRecoveredLeaf>& leaves) {
+  LOG("   rebuilding inner nodes from " << leaves.size() << " leaves");
+
+  // link volatile leaves and collect highest key of each as bottom level of tree
+  std::vector<ScreeDBNode*> level;
+  std::vector<const ScreeDBInnerKey*> level_keys;
+  level.reserve(leaves.size());
+  level_keys.reserve(leaves.size());
+  for (size_t i = 0; i < leaves.size(); i++) {
+    ScreeDBLeafNode* leafnode = leaves[i].leafnode;
+    if (i > 0) {
+      leafnode->prev = leaves[i - 1].leafnode;
+      leaves[i - 1].leafnode->next = leafnode;
+    }
+    level.push_back(leafnode);
+    level_keys.push_back(split_keys_.Add(leaves[i].max_key));
+  }
+
+  // build each inner level in one pass over the level below, until one node remains
+  top_ = NodeBuildParents(level, level_keys);
+}
+
+void ScreeDBTree::RebuildNodes() {
+  LOG("   rebuilding nodes");
+  auto micros_since = [](std::chrono::steady_clock::time_point& since) {
+    auto now = std::chrono::steady_clock::now();
+    auto micros = std::chrono::duration_cast<std::chrono::microseconds>(now - since).count();
+    since = now;
+    return (uint64_t) micros;
+  };
+  auto started = std::chrono::steady_clock::now();
+  recovery_stats_ = ScreeDBRecoveryStats();
+
+  // collect persistent leaves, which are linked in ascending key order
+  std::vector<persistent_ptr<ScreeDBLeaf>> chain;
+  for (auto leaf = LeafHead(); leaf != nullptr; leaf = leaf->next) {
+    chain.push_back(leaf);
+  }
+  recovery_stats_.chain_micros = micros_since(started);
+
+  // recover hashes and key bounds for contiguous ranges of leaves in parallel
+  std::vector<ScreeDBRecoveredLeaf> recovered(chain.size());
+  const size_t wanted = chain.size() / RECOVERY_LEAVES_PER_THREAD + 1;
+  const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  const size_t threads = std::min(wanted, cores);
+  const size_t per_thread = (chain.size() + threads - 1) / threads;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      const size_t end = std::min(chain.size(), (t + 1) * per_thread);
+      for (size_t i = t * per_thread; i < end; i++) RecoverLeaf(chain[i], &recovered[i]);
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  recovery_stats_.threads = threads;
+  recovery_stats_.scan_micros = micros_since(started);
+
+  // unlink empty leaves from persistent chain (except head, which keeps the tree present)
+  persistent_ptr<ScreeDBLeaf> kept;
+  for (size_t i = 0; i < chain.size(); i++) {
+    if (i == 0 || recovered[i].leafnode != nullptr) {
+      kept = chain[i];
+      continue;
+    }
+    TransactionRun([&] {
+      kept->next = chain[i]->next;
+      LeafFreePersistent(chain[i]);
+    });
+    recovery_stats_.unlinked++;
+  }
+
+  // drop empty leaves, keeping chain order (which is key order)
+  std::vector<ScreeDBRecoveredLeaf> leaves;
+  leaves.reserve(recovered.size());
+  for (auto& rleaf : recovered) if (rleaf.leafnode != nullptr) leaves.push_back(rleaf);
+  recovery_stats_.leaves = leaves.size();
+
+  RebuildInnerNodes(leaves);
+  recovery_stats_.build_micros = micros_since(started);
+  LOG("   rebuilt nodes ok: leaves=" << recovery_stats_.leaves
+                                     << ", threads=" << recovery_stats_.threads
+                                     << ", chain=" << recovery_stats_.chain_micros
+                                     << "us, scan=" << recovery_stats_.scan_micros
+                                     << "us, build=" << recovery_stats_.build_micros << "us");
+}
+
+void ScreeDBTree::RecoverLeaf(persistent_ptr<ScreeDBLeaf> leaf, ScreeDBRecoveredLeaf* rleaf) {
+  // find lowest and highest sorting keys in leaf, while recomputing full-width hashes
+  auto leafnode = new ScreeDBLeafNode();
+  bool empty = true;
+  Slice min_key;
+  Slice max_key;
+  for (int slot = NODE_KEYS; slot--;) {
+    if (leaf->hashes[slot] == 0) continue;                               // persisted when empty
+    const Slice key = leaf->kv_keys[slot].get_ro().slice();
+    leafnode->hashes[slot] = PearsonHash(key.data(), key.size());
+    IndexAdd(key, leafnode, slot);
+    if (empty || KeyCompare(min_key, key) > 0) min_key = key;
+    if (empty || KeyCompare(max_key, key) < 0) max_key = key;
+    empty = false;
+  }
+
+  // recover leaf unless empty
+  if (empty) {
+    delete leafnode;                                                     // unlinked by caller
+    rleaf->leafnode = nullptr;
+  } else {
+    leafnode->leaf = leaf;
+    leafnode->is_leaf = true;
+    rleaf->leafnode = leafnode;
+    rleaf->min_key = min_key;
+    rleaf->max_key = max_key;
+    ScreeDBLeafCounts counts;                                            // from recovery threads
+    LeafCountAll(leafnode, &counts);
+    LeafCountChange(ScreeDBLeafCounts(), counts);
+  }
+}
+
+void ScreeDBTree::Shutdown() {
+  LOG("Shutting down tree");
+  auto root = pop_.get_root();
+  TransactionRun([&] { root->closed = root->closed + 1; });
+  LOG("Shut down tree ok");
+}
+
+// ===============================================================================================
+// PROTECTED HELPER METHODS
+// ===============================================================================================
+
+// Removes any cached value for the key. Writers call this while holding the key's leaf lock
+// and before changing the leaf, and readers only insert while holding that lock, so a cached
+// value is never older than one read from the leaf.
+void ScreeDBTree::CacheErase(const Slice& key) {
+  if (cache_) cache_->Erase(key);
+}
+
+// Copies a value found in a locked leaf into the cache, charged for key and value bytes.
+void ScreeDBTree::CacheInsert(const Slice& key, const Slice& value) {
+  if (!cache_) return;
+  cache_->Insert(key, new std::string(value.data_, value.size_),
+                 key.size_ + value.size_ + sizeof(std::string),
+                 [](const Slice&, void* cached) { delete (std::string*) cached; });
+}
+
+// Appends a cached value for the key to *value, returning false if not cached.
+bool ScreeDBTree::CacheLookup(const Slice& key, std::string* value) {
+  if (!cache_) return false;
+  Cache::Handle* handle = cache_->Lookup(key);
+  if (!handle) {
+    tickers_.Add(SCREEDB_CACHE_MISSES);
+    return false;
+  }
+  value->append(*(const std::string*) cache_->Value(handle));
+  cache_->Release(handle);
+  tickers_.Add(SCREEDB_CACHE_HITS);
+  return true;
+}
+
+// Records that the key was added to a locked leaf, when keys are indexed by hash. Changes
+// made within a transaction are recorded once it commits, while leaves are still locked.
+void ScreeDBTree::IndexAdd(const Slice& key, ScreeDBLeafNode* leafnode, const int slot) {
+  if (!index_) return;
+  const uint64_t hash = ScreeDBKeyIndex::Hash(key);
+  TransactionDefer([this, hash, leafnode, slot] { index_->Add(hash, leafnode, slot); });
+}
+
+// Records that the key moved to a slot of the same or another locked leaf, when keys are
+// indexed by hash.
+void ScreeDBTree::IndexMove(const Slice& key, ScreeDBLeafNode* from, ScreeDBLeafNode* to,
+                            const int slot) {
+  if (!index_) return;
+  const uint64_t hash = ScreeDBKeyIndex::Hash(key);
+  TransactionDefer([this, hash, from, to, slot] { index_->Move(hash, from, to, slot); });
+}
+
+// Records that the key was removed from a locked leaf, when keys are indexed by hash.
+void ScreeDBTree::IndexRemove(const Slice& key, ScreeDBLeafNode* leafnode) {
+  if (!index_) return;
+  const uint64_t hash = ScreeDBKeyIndex::Hash(key);                      // before key is freed
+  TransactionDefer([this, hash, leafnode] { index_->Remove(hash, leafnode); });
+}
+
+// Merges operand with the existing value (or nullptr if none) using the merge operator.
+// Fixed-width uint64add operands are added directly, without building an operand list.
+Status ScreeDBTree::MergeValue(const Slice& key, const Slice* existing, const Slice& operand,
+                               std::string* merged) {
+  if (uint64add_ && existing && existing->size_ == sizeof(uint64_t)
+      && operand.size_ == sizeof(uint64_t)) {
+    merged->clear();
+    PutFixed64(merged, DecodeFixed64(existing->data_) + DecodeFixed64(operand.data_));
+    return Status::OK();
+  }
+  const std::deque<std::string> operands(1, operand.ToString());
+  if (merge_operator_->FullMerge(key, existing, operands, merged, nullptr)) return Status::OK();
+  LOG("   merge failed for key=" << key.data_);
+  return Status::Corruption("Could not perform merge", key);
+}
+
 // Pearson hashing lookup table from RFC 3074
 const uint8_t PEARSON_LOOKUP_TABLE[256] = {
         251, 175, 119, 215, 81, 14, 79, 191, 103, 49, 181, 143, 186, 157, 0,
@@ -500,41 +2749,955 @@ const uint8_t PEARSON_LOOKUP_TABLE[256] = {
         149, 80, 170, 68, 6, 169, 234, 151
 };
 
-// Modified Pearson hashing algorithm from RFC 3074
-uint8_t ScreeDBTree::PearsonHash(const char* data, const size_t size) {
+// Modified Pearson hashing algorithm from RFC 3074, widened to 16 bits (when configured)
+// by a second pass that increments the first byte, as described in Pearson's paper.
+ScreeDBHash ScreeDBTree::PearsonHash(const char* data, const size_t size) {
   uint8_t hash = (uint8_t) size;
+#if SCREEDB_HASH_BITS == 16
+  uint8_t high = (uint8_t) size;
+#endif
   for (size_t i = size; i > 0;) {  // todo first n chars instead?
-    hash = PEARSON_LOOKUP_TABLE[hash ^ data[--i]];
+    const uint8_t c = (uint8_t) data[--i];
+    hash = PEARSON_LOOKUP_TABLE[hash ^ c];
+#if SCREEDB_HASH_BITS == 16
+    high = PEARSON_LOOKUP_TABLE[high ^ (uint8_t) (i == size - 1 ? c + 1 : c)];
+#endif
   }
 
   // MODIFICATION START
   if (hash == 0) hash = 1;  // never return 0, this is reserved for "null"
   // MODIFICATION END
 
+#if SCREEDB_HASH_BITS == 16
+  return (ScreeDBHash) ((high << 8) | hash);
+#else
   return hash;
+#endif
+}
+
+// Registers a pinned long value, while its leaf is locked so no writer is freeing it.
+void ScreeDBTree::PinAdd(const char* data) {
+  std::lock_guard<std::mutex> guard(pins_mutex_);
+  pins_[data]++;
+  pin_count_.fetch_add(1, std::memory_order_release);
+}
+
+// Returns true if a long value is pinned by a reader, so writers holding its leaf must leave
+// it in place. Readers pin only while holding the leaf, so the answer holds until unlocked.
+bool ScreeDBTree::PinHeld(const ScreeDBString& value) {
+  if (value.is_short() || pin_count_.load(std::memory_order_acquire) == 0) return false;
+  std::lock_guard<std::mutex> guard(pins_mutex_);
+  return pins_.count(value.data()) > 0;
+}
+
+// Releases a pinned long value, to be freed later if it was replaced or deleted meanwhile.
+void ScreeDBTree::PinRelease(const char* data) {
+  std::lock_guard<std::mutex> guard(pins_mutex_);
+  auto entry = pins_.find(data);
+  if (--entry->second == 0) pins_.erase(entry);
+  pin_count_.fetch_sub(1, std::memory_order_release);
+}
+
+// Waits until a long value is no longer pinned, before freeing the leaf holding it.
+void ScreeDBTree::PinWait(const ScreeDBString& value) {
+  while (PinHeld(value)) std::this_thread::yield();
+}
+
+// Numbers the next writes, returning the last number taken. Writers call this while holding
+// the leaves they change, so snapshot readers that lock a leaf wait for writes before them.
+SequenceNumber ScreeDBTree::SequenceNext(const uint64_t count) {
+  return owner_->sequence_.fetch_add(count) + count;
+}
+
+// Volatile changes deferred by this thread's outermost transaction, else nullptr
+static __thread std::vector<std::function<void()>>* screedb_deferred = nullptr;
+
+// Runs the action once the calling thread's outermost transaction commits, so volatile state
+// only follows persistent changes that can no longer be rolled back. Runs it now otherwise.
+void ScreeDBTree::TransactionDefer(std::function<void()> action) {
+  if (screedb_deferred) screedb_deferred->push_back(std::move(action));
+  else action();
+}
+
+// Runs the body in a persistent transaction, timing and counting only outermost transactions
+// since nested ones commit with their parent. Actions deferred by the body run after commit,
+// else are dropped when the transaction aborts and the error is thrown to the caller.
+void ScreeDBTree::TransactionRun(std::function<void()> body) {
+  if (pmemobj_tx_stage() != TX_STAGE_NONE) {
+    transaction::exec_tx(pop_, std::move(body));
+    return;
+  }
+  std::vector<std::function<void()>> deferred;
+  screedb_deferred = &deferred;
+  try {
+    ScreeDBPerfTimer timer(&screedb_perf_context.transaction_nanos);
+    transaction::exec_tx(pop_, std::move(body));
+  } catch (...) {
+    screedb_deferred = nullptr;                                          // rolled back
+    throw;
+  }
+  screedb_deferred = nullptr;
+  for (auto& action : deferred) action();
+  tickers_.Add(SCREEDB_TRANSACTIONS);
+  if (GetPerfLevel() >= kEnableCount) screedb_perf_context.transaction_count++;
+}
+
+// Returns the version a snapshot reads from a key's versions (the first replaced after the
+// snapshot), else nullptr if the snapshot reads the key's current state.
+const ScreeDBVersion* ScreeDBTree::VersionAt(const std::vector<ScreeDBVersion>& versions,
+                                             const SequenceNumber sequence) {
+  for (auto& version : versions) if (version.replaced > sequence) return &version;
+  return nullptr;
+}
+
+// Finds the version of a key read by a snapshot, appending any value and returning true.
+bool ScreeDBTree::VersionFind(const Slice& key, const SequenceNumber sequence,
+                              std::string* value, bool* present) {
+  if (version_bytes_.load(std::memory_order_relaxed) == 0) return false;  // none saved
+  const size_t shard = VersionShard(key);
+  std::lock_guard<std::mutex> guard(owner_->version_mutexes_[shard]);
+  if (versions_[shard].empty()) return false;
+  auto found = versions_[shard].find(key.ToString());
+  if (found == versions_[shard].end()) return false;
+  auto version = VersionAt(found->second, sequence);
+  if (!version) return false;
+  *present = version->present;
+  if (version->present) value->append(version->value);
+  return true;
+}
+
+// Locks every version shard in order, for changes to live snapshots or all versions.
+void ScreeDBTree::VersionLockAll() {
+  for (auto& mutex : owner_->version_mutexes_) mutex.lock();
+}
+
+// Saves the key's value (or its absence) before a write numbered "sequence" changes it, if a
+// live snapshot could read it. That's only the first write to a key after each snapshot, so
+// writes without snapshots pay a single atomic load, and writes with snapshots lock only the
+// shard for the key. Also discards versions when no snapshots remain, for trees that weren't
+// trimmed when snapshots were released.
+void ScreeDBTree::VersionSave(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                              const Slice& key, const SequenceNumber sequence) {
+  if (owner_->snapshot_count_.load() == 0) {
+    if (version_bytes_.load(std::memory_order_relaxed) == 0) return;
+    VersionLockAll();
+    if (owner_->snapshot_count_.load() == 0) {                           // else versions kept
+      for (auto& versions : versions_) versions.clear();
+      version_bytes_.store(0);
+    }
+    VersionUnlockAll();
+    return;
+  }
+  const size_t shard = VersionShard(key);
+  std::lock_guard<std::mutex> guard(owner_->version_mutexes_[shard]);
+  auto& live = owner_->snapshots_;
+  auto& versions = versions_[shard];
+  auto found = versions.find(key.ToString());
+  const SequenceNumber previous = found == versions.end() ? 0 : found->second.back().replaced;
+  auto reader = live.lower_bound(previous);
+  if (reader == live.end() || *reader >= sequence) return;               // no snapshot reads it
+  const int slot = LeafFindSlot(leafnode, hash, key);
+  ScreeDBVersion version{sequence, slot >= 0, std::string()};
+  if (slot >= 0) version.value = leafnode->leaf->kv_values[slot].get_ro().slice().ToString();
+  version_bytes_.fetch_add(version.value.size() + key.size() + sizeof(ScreeDBVersion));
+  if (found == versions.end()) found = versions.emplace(key.ToString(), 0).first;
+  found->second.push_back(std::move(version));
+}
+
+// Finds the nearest key after (or before, unless "forward") the target with a version read by
+// the snapshot, copying its key and any value. A nullptr target starts from the first (or
+// last) key. Returns false if there is no such key. Shards hold keys by hash, so each shard
+// is searched in turn, keeping the nearest key found.
+bool ScreeDBTree::VersionSeek(const Slice* target, const bool forward, const bool inclusive,
+                              const SequenceNumber sequence, std::string* key,
+                              std::string* value, bool* present) {
+  if (version_bytes_.load(std::memory_order_relaxed) == 0) return false;  // none saved
+  const std::string start = target ? target->ToString() : std::string();
+  bool found = false;
+  for (int shard = 0; shard < VERSION_SHARDS; shard++) {
+    std::lock_guard<std::mutex> guard(owner_->version_mutexes_[shard]);
+    auto& versions = versions_[shard];
+    if (versions.empty()) continue;
+    const ScreeDBVersion* version = nullptr;
+    auto it = versions.end();
+    if (forward) {
+      it = !target ? versions.begin()
+                   : inclusive ? versions.lower_bound(start) : versions.upper_bound(start);
+      for (; it != versions.end(); ++it) if ((version = VersionAt(it->second, sequence))) break;
+    } else {
+      it = !target ? versions.end()
+                   : inclusive ? versions.upper_bound(start) : versions.lower_bound(start);
+      while (it != versions.begin() && !(version = VersionAt((--it)->second, sequence))) {}
+    }
+    if (!version) continue;
+    if (found && (KeyCompare(it->first, *key) < 0) != forward) continue;  // not nearer
+    found = true;
+    *key = it->first;
+    *present = version->present;
+    *value = version->value;
+  }
+  return found;
+}
+
+// Returns the shard holding versions of a key, by the high byte of its index hash.
+size_t ScreeDBTree::VersionShard(const Slice& key) {
+  static_assert(VERSION_SHARDS == 256, "shards are chosen by top byte of key hash");
+  return (size_t) (ScreeDBKeyIndex::Hash(key) >> 56);
+}
+
+void ScreeDBTree::VersionUnlockAll() {
+  for (auto& mutex : owner_->version_mutexes_) mutex.unlock();
+}
+
+// Restores and unlocks the leaves of a batch whose transaction aborted, once its persistent
+// changes were rolled back. Leaves split off by the batch were never linked, so are deleted.
+void ScreeDBTree::WriteAbort(ScreeDBBatch* batch) {
+  std::unordered_set<ScreeDBLeafNode*> created;
+  for (auto& split : batch->splits) created.insert(split.second.first);
+  for (auto leafnode : batch->locked) {
+    if (created.count(leafnode)) {
+      delete leafnode;
+    } else {
+      LeafRestoreHashes(leafnode);
+      LeafUnlock(leafnode);
+    }
+  }
+  batch->locked.clear();
+  batch->held.clear();
+  batch->splits.clear();
+}
+
+// Applies a prepared batch within the caller's transaction, splitting leaves as needed.
+// Every update takes the batch's sequence number, which is its last.
+void ScreeDBTree::WriteApply(ScreeDBBatch* batch, const SequenceNumber sequence) {
+  for (auto& update : batch->updates) {
+    auto leafnode = WriteLockForKey(batch, update.key);
+    const ScreeDBHash hash = PearsonHash(update.key.data_, update.key.size_);
+    CacheErase(update.key);                                              // while leaf is locked
+    VersionSave(leafnode, hash, update.key, sequence);
+    if (update.type == SCREEDB_DELETE) {
+      LeafClearSlotForKey(leafnode, hash, update.key);
+    } else if (!LeafFillSlotForKey(leafnode, hash, update.key, update.value)) {
+      const ScreeDBInnerKey* split_key;
+      auto new_leafnode = LeafSplit(leafnode, hash, update.key, update.value, &split_key);
+      batch->held.insert(new_leafnode);
+      batch->locked.push_back(new_leafnode);
+      auto split = batch->splits.find(leafnode);                         // was split before?
+      if (split != batch->splits.end()) batch->splits[new_leafnode] = split->second;
+      batch->splits[leafnode] = {new_leafnode, split_key};
+    }
+  }
+  LOG("Write batch done for " << batch->updates.size() << " updates in "
+                              << batch->locked.size() << " leaves");
+}
+
+// Returns the locked leaf for a key, locking it unless already held by the batch. Leaves
+// made by the batch's own splits aren't reachable from parents until it commits, so keys
+// above a split key are followed into the leaf split off.
+ScreeDBLeafNode* ScreeDBTree::WriteLockForKey(ScreeDBBatch* batch, const Slice& key) {
+  ScreeDBEpochGuard guard(&epochs_);                                     // found leaf not freed
+  while (true) {
+    uint64_t version;
+    auto leafnode = LeafSearch(&key, false, &version);
+    if (batch->held.count(leafnode)) {                                   // only split by us
+      for (auto split = batch->splits.find(leafnode); split != batch->splits.end()
+           && KeyCompare(key, split->second.second->slice()) > 0;
+           split = batch->splits.find(leafnode)) {
+        leafnode = split->second.first;
+      }
+      return leafnode;
+    }
+    LeafLock(leafnode);
+    if (leafnode->version.load(std::memory_order_acquire) == version) {
+      batch->held.insert(leafnode);
+      batch->locked.push_back(leafnode);
+      return leafnode;
+    }
+    LeafUnlock(leafnode);                                                // split since search
+  }
+}
+
+// Sorts updates by key and locks each leaf they touch once, in key order (which can't
+// deadlock). Merges are resolved into puts before writing anything, so a failed merge changes
+// nothing. Returns with leaves locked, unless an error is returned.
+Status ScreeDBTree::WritePrepare(ScreeDBBatch* batch) {
+  LOG("Write batch with " << batch->updates.size() << " updates");
+  auto& sorted = batch->updates;
+  std::stable_sort(sorted.begin(), sorted.end(),
+                   [this](const ScreeDBUpdate& lhs, const ScreeDBUpdate& rhs) {
+                     return KeyCompare(lhs.key, rhs.key) < 0;
+                   });
+  try {
+    while (top_.load(std::memory_order_acquire) == nullptr) LeafCreateHead();
+  } catch (const std::exception& e) {                                    // pool errors from nvml
+    return Status::IOError(name, e.what());
+  }
+  for (size_t i = 0; i < sorted.size(); i++) {
+    auto& update = sorted[i];
+    auto leafnode = WriteLockForKey(batch, update.key);
+    if (update.type != SCREEDB_MERGE) continue;
+    Slice existing;
+    bool found = false;
+    if (i > 0 && KeyCompare(sorted[i - 1].key, update.key) == 0) {      // earlier in batch
+      found = sorted[i - 1].type == SCREEDB_PUT;
+      existing = sorted[i - 1].value;
+    } else {
+      const int slot = LeafFindSlot(leafnode, PearsonHash(update.key.data_, update.key.size_),
+                                    update.key);
+      found = slot >= 0;
+      if (found) existing = leafnode->leaf->kv_values[slot].get_ro().slice();
+    }
+    batch->merged.emplace_back();
+    Status s = MergeValue(update.key, found ? &existing : nullptr, update.value,
+                          &batch->merged.back());
+    if (!s.ok()) {
+      for (auto leafnode : batch->locked) LeafUnlock(leafnode);
+      return s;
+    }
+    update.value = batch->merged.back();
+    update.type = SCREEDB_PUT;
+  }
+  return Status::OK();
+}
+
+// ===============================================================================================
+// ITERATOR CLASS METHODS
+// ===============================================================================================
+
+ScreeDBIterator::ScreeDBIterator(ScreeDBTree* tree) : tree_(tree) {
+  slots_.reserve(NODE_KEYS);                                             // reused for every leaf
+  copies_.resize(NODE_KEYS);
+  values_.resize(NODE_KEYS);
+  pinned_.reserve(NODE_KEYS);
+}
+
+void ScreeDBIterator::SeekToFirst() {
+  auto leafnode = tree_->LeafLockEdge(false, true);
+  if (leafnode) LoadForward(leafnode, nullptr, true);
+  else pos_ = -1;
+}
+
+void ScreeDBIterator::SeekToLast() {
+  auto leafnode = tree_->LeafLockEdge(true, true);
+  if (leafnode) LoadBackward(leafnode, nullptr);
+  else pos_ = -1;
+}
+
+void ScreeDBIterator::Seek(const Slice& target) {
+  auto leafnode = tree_->LeafLockForKey(target, nullptr, true);
+  if (leafnode) LoadForward(leafnode, &target, true);
+  else pos_ = -1;
+}
+
+void ScreeDBIterator::Next() {
+  assert(Valid());
+  if (++pos_ < (int) slots_.size()) return;                              // next slot in leaf
+  const std::string after_key = last_key_;                               // leaf owning last key
+  const Slice after(after_key);
+  auto leafnode = tree_->LeafLockForKey(after, nullptr, true);           // may have been split
+  if (leafnode) LoadForward(leafnode, &after, false);
+  else pos_ = -1;
+}
+
+void ScreeDBIterator::Prev() {
+  assert(Valid());
+  if (--pos_ >= 0) return;                                               // prior slot in leaf
+  const std::string before = first_key_;                                 // leaf owning first key
+  auto leafnode = tree_->LeafLockForKey(before, nullptr, true);          // may have been split
+  if (leafnode) LoadBackward(leafnode, &before);
+  else pos_ = -1;
+}
+
+Slice ScreeDBIterator::key() const {
+  assert(Valid());
+  return copies_[pos_].first;
+}
+
+Slice ScreeDBIterator::value() const {
+  assert(Valid());
+  return values_[pos_];
+}
+
+void ScreeDBIterator::LoadBackward(ScreeDBLeafNode* leafnode, const std::string* before) {
+  while (true) {                                                         // leafnode is locked
+    LoadSlots(leafnode);
+    pos_ = (int) slots_.size() - 1;                                      // find last key before
+    while (before && pos_ >= 0 && tree_->KeyCompare(key(), *before) >= 0) pos_--;
+    if (pos_ >= 0) {                                                     // found a key?
+      LoadValues(leafnode);
+      tree_->LeafUnlock(leafnode, true);
+      return;
+    }
+    ScreeDBEpochGuard guard(&tree_->epochs_);                            // prev not freed unlocked
+    auto prev = leafnode->prev.load(std::memory_order_acquire);          // try prior leaf
+    tree_->LeafUnlock(leafnode, true);
+    if (!prev) return;                                                   // no more leaves
+    tree_->LeafLock(prev, true);                                         // lock prior leaf
+    if (prev->next.load(std::memory_order_acquire) == leafnode) {        // still adjacent?
+      leafnode = prev;
+    } else {                                                             // prior leaf was split
+      tree_->LeafUnlock(prev, true);
+      leafnode = before ? tree_->LeafLockForKey(*before, nullptr, true)
+                        : tree_->LeafLockEdge(true, true);
+      if (!leafnode) return;
+    }
+  }
+}
+
+void ScreeDBIterator::LoadForward(ScreeDBLeafNode* leafnode, const Slice* target,
+                                  const bool inclusive) {
+  while (true) {                                                         // leafnode is locked
+    LoadSlots(leafnode);
+    pos_ = 0;                                                            // find first key after
+    while (target && pos_ < (int) slots_.size()) {
+      const int cmp = tree_->KeyCompare(key(), *target);
+      if (cmp > 0 || (inclusive && cmp == 0)) break;
+      pos_++;
+    }
+    if (pos_ < (int) slots_.size()) {                                    // found a key?
+      LoadValues(leafnode);
+      tree_->LeafUnlock(leafnode, true);
+      return;
+    }
+    auto next = leafnode->next.load(std::memory_order_acquire);          // try next leaf
+    if (next) tree_->LeafLock(next, true);                               // lock before release
+    tree_->LeafUnlock(leafnode, true);
+    if (!next) return;                                                   // no more leaves
+    leafnode = next;
+    target = nullptr;                                                    // all keys are after
+  }
+}
+
+// Sorts the slots of a locked leaf and copies their keys, assigning into strings kept from
+// earlier leaves so that iterating rarely allocates. Keys are always copied, since the first
+// and last are needed to find neighbouring leaves once this one is unlocked.
+void ScreeDBIterator::LoadSlots(ScreeDBLeafNode* leafnode) {
+  const auto leaf = leafnode->leaf;
+  UnpinValues();                                                         // previous leaf is done
+  tree_->LeafSortSlots(leafnode, &slots_);
+  for (size_t i = 0; i < slots_.size(); i++) {                           // copy while locked
+    const ScreeDBString& key = leaf->kv_keys[slots_[i]].get_ro();
+    copies_[i].first.assign(key.data(), key.size());
+  }
+  if (slots_.empty()) return;
+  pos_ = 0;
+  first_key_ = key().ToString();
+  pos_ = (int) slots_.size() - 1;
+  last_key_ = key().ToString();
+}
+
+// Reads the values of the locked leaf that the iterator settled on. Values of at least
+// ITERATOR_PIN_BYTES are pinned where they lie in the pool, like GetPinned, so writers leave
+// them in place as orphans until the iterator moves on. Shorter ones are copied, since a pin
+// (a mutex and a hash map update, then another to release it) costs more than copying them.
+// Short values lie in the leaf itself and are rewritten in place, so they're always copied.
+void ScreeDBIterator::LoadValues(ScreeDBLeafNode* leafnode) {
+  const auto leaf = leafnode->leaf;
+  for (size_t i = 0; i < slots_.size(); i++) {
+    const ScreeDBString& value = leaf->kv_values[slots_[i]].get_ro();
+    if (value.is_short() || value.size() < ITERATOR_PIN_BYTES) {
+      copies_[i].second.assign(value.data(), value.size());
+      values_[i] = Slice(copies_[i].second);
+    } else {
+      tree_->PinAdd(value.data());
+      pinned_.push_back(value.data());
+      values_[i] = value.slice();
+    }
+  }
+}
+
+// Releases values pinned from the current leaf, leaving replaced ones for Compact to free.
+void ScreeDBIterator::UnpinValues() {
+  for (auto data : pinned_) tree_->PinRelease(data);
+  pinned_.clear();
+}
+
+// ===============================================================================================
+// SNAPSHOT ITERATOR CLASS METHODS
+// ===============================================================================================
+
+ScreeDBSnapshotIterator::ScreeDBSnapshotIterator(ScreeDBTree* tree, const SequenceNumber sequence)
+    : tree_(tree), sequence_(sequence), live_(tree) {
+}
+
+void ScreeDBSnapshotIterator::SeekToFirst() {
+  forward_ = true;
+  live_.SeekToFirst();
+  SeekVersion(nullptr, true, true);
+  FindForward();
+}
+
+void ScreeDBSnapshotIterator::SeekToLast() {
+  forward_ = false;
+  live_.SeekToLast();
+  SeekVersion(nullptr, false, true);
+  FindBackward();
+}
+
+void ScreeDBSnapshotIterator::Seek(const Slice& target) {
+  forward_ = true;
+  live_.Seek(target);
+  SeekVersion(&target, true, true);
+  FindForward();
+}
+
+void ScreeDBSnapshotIterator::Next() {
+  assert(Valid());
+  if (!forward_) {                                                       // turn both cursors
+    const std::string current = key().ToString();
+    const Slice after(current);
+    live_.Seek(after);
+    if (live_.Valid() && tree_->KeyCompare(live_.key(), after) == 0) live_.Next();
+    SeekVersion(&after, true, false);
+    forward_ = true;
+  } else if (from_version_) {                                            // live moved past it
+    const Slice after(version_key_);
+    SeekVersion(&after, true, false);
+  } else {                                                               // may load a new leaf
+    const std::string current = live_.key().ToString();
+    live_.Next();
+    const Slice after(current);
+    SeekVersion(&after, true, false);                                    // saved since, too
+  }
+  FindForward();
+}
+
+void ScreeDBSnapshotIterator::Prev() {
+  assert(Valid());
+  if (forward_) {                                                        // turn both cursors
+    const std::string current = key().ToString();
+    const Slice before(current);
+    live_.Seek(before);
+    if (live_.Valid()) live_.Prev();
+    else live_.SeekToLast();                                             // all keys are before
+    SeekVersion(&before, false, false);
+    forward_ = false;
+  } else if (from_version_) {                                            // live moved past it
+    const Slice before(version_key_);
+    SeekVersion(&before, false, false);
+  } else {                                                               // may load a new leaf
+    const std::string current = live_.key().ToString();
+    live_.Prev();
+    const Slice before(current);
+    SeekVersion(&before, false, false);                                  // saved since, too
+  }
+  FindBackward();
+}
+
+Slice ScreeDBSnapshotIterator::key() const {
+  assert(Valid());
+  return from_version_ ? Slice(version_key_) : live_.key();
+}
+
+Slice ScreeDBSnapshotIterator::value() const {
+  assert(Valid());
+  return from_version_ ? Slice(version_value_) : live_.value();
+}
+
+// Positions at the highest key of either cursor, where a saved version replaces the live key
+// and a version without a value hides it.
+void ScreeDBSnapshotIterator::FindBackward() {
+  while (true) {
+    const bool live = live_.Valid();
+    if (!live && !version_valid_) break;
+    const int cmp = !live ? -1 : !version_valid_ ? 1 : tree_->KeyCompare(live_.key(), version_key_);
+    if (cmp > 0) {                                                       // live key is next
+      valid_ = true;
+      from_version_ = false;
+      return;
+    }
+    if (cmp == 0) live_.Prev();                                          // replaced by version
+    if (version_present_) {                                              // version is next
+      valid_ = true;
+      from_version_ = true;
+      return;
+    }
+    const Slice skipped(version_key_);                                   // key was absent
+    SeekVersion(&skipped, false, false);
+  }
+  valid_ = false;
+}
+
+// Positions at the lowest key of either cursor, as above.
+void ScreeDBSnapshotIterator::FindForward() {
+  while (true) {
+    const bool live = live_.Valid();
+    if (!live && !version_valid_) break;
+    const int cmp = !live ? 1 : !version_valid_ ? -1 : tree_->KeyCompare(live_.key(), version_key_);
+    if (cmp < 0) {                                                       // live key is next
+      valid_ = true;
+      from_version_ = false;
+      return;
+    }
+    if (cmp == 0) live_.Next();                                          // replaced by version
+    if (version_present_) {                                              // version is next
+      valid_ = true;
+      from_version_ = true;
+      return;
+    }
+    const Slice skipped(version_key_);                                   // key was absent
+    SeekVersion(&skipped, true, false);
+  }
+  valid_ = false;
+}
+
+void ScreeDBSnapshotIterator::SeekVersion(const Slice* target, const bool forward,
+                                          const bool inclusive) {
+  version_valid_ = tree_->VersionSeek(target, forward, inclusive, sequence_, &version_key_,
+                                      &version_value_, &version_present_);
+}
+
+// ===============================================================================================
+// KEY ARENA CLASS METHODS
+// ===============================================================================================
+
+const ScreeDBInnerKey* ScreeDBKeyArena::Add(const Slice& key) {
+  const size_t align = alignof(ScreeDBInnerKey);
+  const size_t bytes = (sizeof(ScreeDBInnerKey) + key.size_ + 1 + align - 1) & ~(align - 1);
+  char* memory;
+  if (bytes > KEY_ARENA_BLOCK / 4) {                                     // large key?
+    memory = new char[bytes];                                            // gets its own block
+    blocks_.insert(blocks_.begin(), memory);                             // keep current last
+  } else {
+    if (used_ + bytes > KEY_ARENA_BLOCK) {                               // current block full?
+      blocks_.push_back(new char[KEY_ARENA_BLOCK]);                      // start another block
+      used_ = 0;
+    }
+    memory = blocks_.back() + used_;
+    used_ += bytes;
+  }
+  auto inner_key = (ScreeDBInnerKey*) memory;
+  inner_key->prefix = ScreeDBKeyPrefix(key.data_, key.size_);
+  inner_key->size = (uint32_t) key.size_;
+  char* data = (char*) (inner_key + 1);
+  memcpy(data, key.data_, key.size_);
+  data[key.size_] = 0;                                                   // null terminator
+  return inner_key;
+}
+
+// ===============================================================================================
+// KEY INDEX CLASS METHODS
+// ===============================================================================================
+
+void ScreeDBKeyIndex::Add(const uint64_t hash, ScreeDBLeafNode* leafnode, const int slot) {
+  Shard& shard = Lock(hash);
+  if ((shard.used + 1) * 2 > shard.entries.size()) Grow(shard);
+  const size_t mask = shard.entries.size() - 1;
+  size_t pos = hash & mask;
+  while (shard.entries[pos].leafnode) pos = (pos + 1) & mask;
+  shard.entries[pos] = {WithSlot(hash, slot), leafnode};
+  shard.used++;
+  shard.lock.store(false, std::memory_order_release);
+}
+
+bool ScreeDBKeyIndex::Contains(const uint64_t hash, ScreeDBLeafNode* leafnode) {
+  Shard& shard = Lock(hash);
+  const bool found = FindEntry(shard, hash, leafnode) != nullptr;
+  shard.lock.store(false, std::memory_order_release);
+  return found;
+}
+
+// Returns the nth leaf holding a key with the hash, if any, and the slot last used by that key.
+ScreeDBLeafNode* ScreeDBKeyIndex::Find(const uint64_t hash, const size_t nth, int* slot) {
+  Shard& shard = Lock(hash);
+  ScreeDBLeafNode* leafnode = nullptr;
+  if (!shard.entries.empty()) {
+    const size_t mask = shard.entries.size() - 1;
+    size_t skipped = 0;
+    for (size_t pos = hash & mask; shard.entries[pos].leafnode; pos = (pos + 1) & mask) {
+      if (!SameHash(shard.entries[pos].hash, hash) || skipped++ < nth) continue;
+      leafnode = shard.entries[pos].leafnode;
+      *slot = (int) (shard.entries[pos].hash >> 56);
+      break;
+    }
+  }
+  shard.lock.store(false, std::memory_order_release);
+  return leafnode;
+}
+
+ScreeDBKeyIndex::Entry* ScreeDBKeyIndex::FindEntry(Shard& shard, const uint64_t hash,
+                                                   ScreeDBLeafNode* leafnode) {
+  if (shard.entries.empty()) return nullptr;
+  const size_t mask = shard.entries.size() - 1;
+  for (size_t pos = hash & mask; shard.entries[pos].leafnode; pos = (pos + 1) & mask) {
+    Entry& entry = shard.entries[pos];
+    if (SameHash(entry.hash, hash) && entry.leafnode == leafnode) return &entry;
+  }
+  return nullptr;
+}
+
+void ScreeDBKeyIndex::Grow(Shard& shard) {
+  std::vector<Entry> old_entries(std::max<size_t>(16, shard.entries.size() * 2), {0, nullptr});
+  old_entries.swap(shard.entries);
+  const size_t mask = shard.entries.size() - 1;
+  for (auto& entry : old_entries) {
+    if (!entry.leafnode) continue;
+    size_t pos = entry.hash & mask;
+    while (shard.entries[pos].leafnode) pos = (pos + 1) & mask;
+    shard.entries[pos] = entry;
+  }
+}
+
+// Hashes eight bytes at a time with multiply and shift steps, so long keys are cheap.
+uint64_t ScreeDBKeyIndex::Hash(const Slice& key) {
+  const uint64_t multiplier = 0x9E3779B97F4A7C15ULL;                     // golden ratio
+  uint64_t hash = key.size_ * multiplier;
+  size_t pos = 0;
+  for (; pos + sizeof(uint64_t) <= key.size_; pos += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, key.data_ + pos, sizeof(uint64_t));
+    hash = (hash ^ word) * multiplier;
+    hash ^= hash >> 29;
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, key.data_ + pos, key.size_ - pos);
+  hash = (hash ^ tail) * multiplier;
+  return hash ^ (hash >> 32);
+}
+
+ScreeDBKeyIndex::Shard& ScreeDBKeyIndex::Lock(const uint64_t hash) {
+  Shard& shard = shards_[hash >> 56];                                    // top byte picks shard
+  while (shard.lock.exchange(true, std::memory_order_acquire)) std::this_thread::yield();
+  return shard;
+}
+
+void ScreeDBKeyIndex::Move(const uint64_t hash, ScreeDBLeafNode* from, ScreeDBLeafNode* to,
+                           const int slot) {
+  Shard& shard = Lock(hash);
+  Entry* entry = FindEntry(shard, hash, from);
+  if (entry) *entry = {WithSlot(hash, slot), to};
+  shard.lock.store(false, std::memory_order_release);
+}
+
+// Removes an entry by shifting later entries of the same probe sequence back into its place,
+// so lookups never need tombstones.
+void ScreeDBKeyIndex::Remove(const uint64_t hash, ScreeDBLeafNode* leafnode) {
+  Shard& shard = Lock(hash);
+  Entry* entry = FindEntry(shard, hash, leafnode);
+  if (entry) {
+    const size_t mask = shard.entries.size() - 1;
+    size_t hole = entry - shard.entries.data();
+    for (size_t pos = (hole + 1) & mask; shard.entries[pos].leafnode; pos = (pos + 1) & mask) {
+      const size_t home = shard.entries[pos].hash & mask;
+      if (((pos - home) & mask) < ((pos - hole) & mask)) continue;       // home is after hole
+      shard.entries[hole] = shard.entries[pos];
+      hole = pos;
+    }
+    shard.entries[hole] = {0, nullptr};
+    shard.used--;
+  }
+  shard.lock.store(false, std::memory_order_release);
+}
+
+// ===============================================================================================
+// PINNED VALUE CLASS METHODS
+// ===============================================================================================
+
+void ScreeDBPinnedValue::Reset() {
+  if (tree_) tree_->PinRelease(value_.data());
+  tree_ = nullptr;
+  value_.clear();
+  copy_.clear();
+}
+
+// ===============================================================================================
+// PERF CONTEXT CLASS METHODS
+// ===============================================================================================
+
+__thread ScreeDBPerfContext screedb_perf_context;
+
+void ScreeDBPerfContext::Reset() {
+  leaf_search_nanos = 0;
+  transaction_nanos = 0;
+  string_alloc_nanos = 0;
+  transaction_count = 0;
+  leaf_split_count = 0;
+  hash_match_count = 0;
+  hash_false_positive_count = 0;
+}
+
+std::string ScreeDBPerfContext::ToString() const {
+  std::ostringstream out;
+  out << "leaf_search_nanos = " << leaf_search_nanos << ", "
+      << "transaction_nanos = " << transaction_nanos << ", "
+      << "string_alloc_nanos = " << string_alloc_nanos << ", "
+      << "transaction_count = " << transaction_count << ", "
+      << "leaf_split_count = " << leaf_split_count << ", "
+      << "hash_match_count = " << hash_match_count << ", "
+      << "hash_false_positive_count = " << hash_false_positive_count;
+  return out.str();
+}
+
+// ===============================================================================================
+// TICKERS CLASS METHODS
+// ===============================================================================================
+
+uint64_t ScreeDBTickers::Get(const ScreeDBTicker ticker) const {
+  uint64_t total = 0;
+  for (auto& stripe : stripes_) total += stripe.counts[ticker].load(std::memory_order_relaxed);
+  return total;
+}
+
+int ScreeDBTickers::Stripe() {
+  static std::atomic<int> next{0};                                       // assigned round robin
+  static __thread int stripe = -1;                                       // until first count
+  if (stripe < 0) stripe = next.fetch_add(1, std::memory_order_relaxed) % TICKER_STRIPES;
+  return stripe;
+}
+
+// ===============================================================================================
+// EPOCHS CLASS METHODS
+// ===============================================================================================
+
+// Counts the reader in the current epoch's parity, retrying if the epoch moved on meanwhile,
+// so nodes retired before a reader found them are never freed while it remains.
+uint64_t ScreeDBEpochs::Enter() {
+  auto& readers = stripes_[ScreeDBTickers::Stripe()].readers;
+  while (true) {
+    const uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+    readers[epoch & 1].fetch_add(1, std::memory_order_seq_cst);
+    if (epoch_.load(std::memory_order_seq_cst) == epoch) return epoch;
+    readers[epoch & 1].fetch_sub(1, std::memory_order_release);          // entered too late
+  }
+}
+
+// Leaves the epoch, then reclaims any retired nodes, so the last reader holding them back
+// frees them instead of leaving them until the next node is retired.
+void ScreeDBEpochs::Exit(const uint64_t epoch) {
+  stripes_[ScreeDBTickers::Stripe()].readers[epoch & 1].fetch_sub(1, std::memory_order_seq_cst);
+  if (retired_count_.load(std::memory_order_relaxed) > 0) Reclaim();
+}
+
+ScreeDBEpochs::~ScreeDBEpochs() {
+  for (auto& retired : retired_) free_(retired.second);                  // no readers left
+}
+
+// Advances the epoch up to twice, then frees nodes retired two epochs ago, since readers of
+// both those epochs have left. Skipped while another thread reclaims, which frees them too.
+void ScreeDBEpochs::Reclaim() {
+  std::unique_lock<std::mutex> guard(retired_mutex_, std::try_to_lock);
+  if (!guard.owns_lock()) return;
+  if (retired_.empty()) return;
+  if (TryAdvance()) TryAdvance();
+  const uint64_t epoch = Current();
+  while (!retired_.empty() && retired_.front().first + 2 <= epoch) {
+    free_(retired_.front().second);
+    retired_.pop_front();
+  }
+  retired_count_.store(retired_.size(), std::memory_order_relaxed);
+}
+
+// Keeps an unlinked node until readers that might have found it have left.
+void ScreeDBEpochs::Retire(ScreeDBNode* node) {
+  {
+    std::lock_guard<std::mutex> guard(retired_mutex_);
+    retired_.emplace_back(Current(), node);
+    retired_count_.store(retired_.size(), std::memory_order_relaxed);
+  }
+  Reclaim();
+}
+
+// Advances the epoch unless readers remain from the one before, which shares a parity with
+// the next. Requires retired_mutex_, so one thread advances at a time.
+bool ScreeDBEpochs::TryAdvance() {
+  const uint64_t epoch = epoch_.load(std::memory_order_seq_cst);
+  for (auto& stripe : stripes_) {
+    if (stripe.readers[(epoch + 1) & 1].load(std::memory_order_seq_cst) != 0) return false;
+  }
+  epoch_.store(epoch + 1, std::memory_order_seq_cst);
+  return true;
 }
 
 // ===============================================================================================
 // STRING CLASS METHODS
 // ===============================================================================================
 
+#define LONG_SIZE_BITS 0xFFFFFFFFULL                                     // low half of long_size
+
+size_t ScreeDBString::capacity() const {
+  return str ? (size_t) (long_size >> 32) : SSO_CHARS;                   // long or fixed buffer
+}
+
 char* ScreeDBString::data() const {
   return str ? str.get() : const_cast<char*>(sso);                       // return short or long
 }
 
+void ScreeDBString::clear() {
+  if (str) {                                                             // value already present?
+    delete_persistent<char[]>(str, capacity());                          // free value memory
+    str = nullptr;                                                       // zero out pointer
+  }
+  sso[SSO_CHARS] = 0;                                                    // zero length
+}
+
+void ScreeDBString::clear_atomic(pool_base& pool) {
+  if (str) delete_persistent_atomic<char[]>(str, capacity());            // frees, nulls pointer
+  sso[SSO_CHARS] = 0;                                                    // zero length
+  pool.persist(this, sizeof(ScreeDBString));
+}
+
+bool ScreeDBString::equals(const Slice& slice) const {
+  const size_t length = size();                                          // no scan for length
+  return length == slice.size_ && memcmp(data(), slice.data_, length) == 0;
+}
+
+bool ScreeDBString::overwrite(const Slice& slice) {
+  const size_t length = size();
+  if (length != slice.size_) return false;                               // caller must set
+  pmemobj_tx_add_range_direct(data(), length);                           // add only the data
+  memcpy(data(), slice.data_, length);                                   // keep size and storage
+  return true;
+}
+
 void ScreeDBString::set(const Slice& slice) {
   if (slice.size_ <= SSO_CHARS) {                                        // setting short value?
     if (str) {                                                           // value already present?
-      delete_persistent<char[]>(str, strlen(str.get()) + 1);             // free value memory
+      delete_persistent<char[]>(str, capacity());                        // free value memory
       str = nullptr;                                                     // zero out pointer
     }
     pmemobj_tx_add_range_direct(sso, SSO_SIZE);                          // add sso buffer to txn
-    strcpy(sso, slice.data_);                                            // copy slice data
-  } else {                                                               // setting long value?
-    if (str) delete_persistent<char[]>(str, strlen(str.get()) + 1);      // free value if present
-    str = make_persistent<char[]>(slice.size_ + 1);                      // allocate value pmem
-    strcpy(str.get(), slice.data_);                                      // copy slice data
+    memcpy(sso, slice.data_, slice.size_);                               // copy slice data
+    sso[SSO_CHARS] = (char) slice.size_;                                 // zero bytes if empty
+    return;
   }
+  size_t capacity = this->capacity();                                    // values stay under 4GB
+  if (str && slice.size_ <= capacity && slice.size_ * 2 > capacity) {    // reuse existing storage?
+    pmemobj_tx_add_range_direct(str.get(), slice.size_);                 // add only what changes
+  } else {                                                               // allocate new storage
+    ScreeDBPerfTimer timer(&screedb_perf_context.string_alloc_nanos);    // time allocator
+    if (str) delete_persistent<char[]>(str, capacity);                   // free value if present
+    capacity = size_class(slice.size_);                                  // leave room to grow
+    str = make_persistent<char[]>(capacity);                             // allocate value pmem
+  }
+  memcpy(str.get(), slice.data_, slice.size_);                           // copy slice data
+  long_size = (uint64_t) capacity << 32 | slice.size_;                   // store both lengths
+}
+
+void ScreeDBString::set_atomic(pool_base& pool, const Slice& slice) {
+  if (slice.size_ <= SSO_CHARS) {                                        // setting short value?
+    memcpy(sso, slice.data_, slice.size_);                               // copy slice data
+    sso[SSO_CHARS] = (char) slice.size_;                                 // zero bytes if empty
+    pool.persist(this, sizeof(ScreeDBString));
+    return;
+  }
+  const size_t capacity = size_class(slice.size_);                       // leave room to grow
+  long_size = (uint64_t) capacity << 32 | slice.size_;                   // valid before pointer
+  pool.persist(&long_size, sizeof(long_size));
+  {
+    ScreeDBPerfTimer timer(&screedb_perf_context.string_alloc_nanos);    // time allocator
+    make_persistent_atomic<char[]>(pool, str, capacity);                 // allocates, sets str
+  }
+  pool.memcpy_persist(str.get(), slice.data_, slice.size_);              // copy slice data
+}
+
+size_t ScreeDBString::size() const {
+  return str ? (long_size & LONG_SIZE_BITS) : (uint8_t) sso[SSO_CHARS];  // return short or long
+}
+
+size_t ScreeDBString::size_class(size_t size) {
+  if (size <= 128) return (size + 15) & ~(size_t) 15;                    // 16-byte steps at first
+  const size_t step = (size_t) 1 << (61 - __builtin_clzll(size));        // then quarter powers
+  return (size + step - 1) & ~(step - 1);                                // of two, 25% slack max
 }
 
 } // namespace screedb
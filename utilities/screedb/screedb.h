@@ -34,13 +34,39 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
 #include <libpmemobj++/make_persistent.hpp>
 #include <libpmemobj++/make_persistent_array.hpp>
+#include <libpmemobj++/make_persistent_array_atomic.hpp>
 #include <libpmemobj++/persistent_ptr.hpp>
 #include <libpmemobj++/pool.hpp>
 #include <libpmemobj++/transaction.hpp>
+#include "rocksdb/cache.h"
+#include "rocksdb/comparator.h"
 #include "rocksdb/db.h"
+#include "rocksdb/env.h"
+#include "rocksdb/iterator.h"
+#include "rocksdb/merge_operator.h"
+#include "rocksdb/perf_level.h"
+#include "rocksdb/snapshot.h"
+#include "rocksdb/statistics.h"
+#include "rocksdb/write_batch.h"
 
 #define NOOPE override { return Status::NotSupported(); }
 #define sizeof_field(type, field) sizeof(((type *)0)->field)
@@ -50,26 +76,78 @@ using nvml::obj::persistent_ptr;
 using nvml::obj::make_persistent;
 using nvml::obj::transaction;
 using nvml::obj::delete_persistent;
+using nvml::obj::delete_persistent_atomic;
+using nvml::obj::make_persistent_atomic;
 using nvml::obj::pool;
+using nvml::obj::pool_base;
 
 namespace rocksdb {
 namespace screedb {
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
+#define BULK_LOAD_LEAVES 64                                // leaves allocated per bulk transaction
+#define COMPACT_LEAVES 64                                  // leaves visited per background compact
+#ifndef INNER_KEYS
+#define INNER_KEYS 64                                      // maximum keys for inner nodes
+#endif
 #define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
 #define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
+#define ITERATOR_PIN_BYTES 1024                            // shortest value iterators pin, not copy
+#define KEY_ARENA_BLOCK 65536                              // bytes per block of inner node keys
+#define KEY_INDEX_SHARDS 256                               // separately locked parts of key index
+#define LEAF_LOCK_WRITER 0x80000000u                       // leaf lock bit of its one writer
+#define LEAF_MERGE_MAX (NODE_KEYS * 3 / 4)                 // most keys in leaf made by merging
+#define LEAF_UNDERFLOW (NODE_KEYS / 4)                     // fewest keys before leaf is merged
 #define NODE_KEYS 48                                       // maximum keys in tree nodes
-#define NODE_KEYS_MIDPOINT 24                              // halfway point within the node
+#define RECOVERY_LEAVES_PER_THREAD 4096                    // fewest leaves worth another thread
+#ifndef SCREEDB_HASH_BITS
+#define SCREEDB_HASH_BITS 16                               // bits per volatile key fingerprint
+#endif
+#if !defined(SCREEDB_VECTOR_SEARCH) && (defined(__AVX2__) || defined(__SSE4_2__))
+#define SCREEDB_VECTOR_SEARCH 1                            // compare inner prefixes in registers
+#endif
+#ifndef SSO_CHARS
 #define SSO_CHARS 15                                       // chars for short string optimization
-#define SSO_SIZE (SSO_CHARS + 1)                           // sso chars plus null terminator
+#endif
+#define SSO_SIZE (SSO_CHARS + 1)                           // sso chars plus size byte
+#define VERSION_SHARDS 256                                 // separately locked parts of versions
+
+#if SCREEDB_HASH_BITS == 16
+typedef uint16_t ScreeDBHash;                              // low byte is the persisted hash
+#elif SCREEDB_HASH_BITS == 8
+typedef uint8_t ScreeDBHash;                               // same as the persisted hash
+#else
+#error "SCREEDB_HASH_BITS must be 8 or 16"
+#endif
+
+#if SSO_CHARS == 15
+#define SSO_LAYOUT "ScreeDB-2"                             // sized strings, so not the first layout
+#elif SSO_CHARS == 31
+#define SSO_LAYOUT "ScreeDB-2-sso31"                       // strings are not compatible across
+#elif SSO_CHARS == 63
+#define SSO_LAYOUT "ScreeDB-2-sso63"                       // sso sizes, so layouts differ too
+#else
+#error "SSO_CHARS must be 15, 31 or 63"
+#endif
 
 class ScreeDBString {                                      // persistent string class
 public:                                                    // start public fields and methods
-  char* data() const;                                      // returns data as c-style string
+  size_t capacity() const;                                 // bytes that fit without allocating
+  char* data() const;                                      // returns data, not null terminated
+  bool equals(const Slice& slice) const;                   // compares sizes, then bytes
   bool is_short() const { return !str; }                   // returns true for short strings
+  void clear();                                            // free long storage, then empty
+  void clear_atomic(pool_base& pool);                      // clear without a transaction
+  bool overwrite(const Slice& slice);                      // copy in place if sizes match
   void set(const Slice& slice);                            // copy data from slice
+  void set_atomic(pool_base& pool, const Slice& slice);    // set unused string, no transaction
+  size_t size() const;                                     // returns length without scanning
+  Slice slice() const { return Slice(data(), size()); }    // returns data and length
+  static size_t size_class(size_t size);                   // rounds up long allocation size
 private:                                                   // start private fields and methods
-  char sso[SSO_SIZE];                                      // local storage for short strings
+  union {                                                  // layout depends on is_short
+    char sso[SSO_SIZE];                                    // short chars, last byte is size
+    uint64_t long_size;                                    // length, capacity in high 32 bits
+  };
   persistent_ptr<char[]> str;                              // pointer to storage for longer strings
 };
 
@@ -80,76 +158,721 @@ struct ScreeDBLeaf {                                       // persistent leaves
   p<ScreeDBString> kv_values[NODE_KEYS];                   // value strings stored in this leaf
 };
 
+struct ScreeDBFamily {                                     // persistent column family record
+  p<uint32_t> id;                                          // identifies family in write batches
+  p<ScreeDBString> name;                                   // unique among families in pool
+  p<ScreeDBString> comparator;                             // name of comparator ordering keys
+  persistent_ptr<ScreeDBLeaf> head;                        // head of leaves linked in key order
+  persistent_ptr<ScreeDBFamily> next;                      // next family in same list
+};
+
 struct ScreeDBRoot {                                       // persistent root object
   p<uint64_t> opened;                                      // number of times opened
   p<uint64_t> closed;                                      // number of times closed safely
-  persistent_ptr<ScreeDBLeaf> head;                        // head of linked list of leaves
+  persistent_ptr<ScreeDBLeaf> head;                        // head of leaves for default family
+  p<ScreeDBString> comparator;                             // comparator for default family
+  persistent_ptr<ScreeDBFamily> families;                  // other column families in pool
+  persistent_ptr<ScreeDBFamily> dropped;                   // dropped families not yet reclaimed
+  persistent_ptr<ScreeDBLeaf> loading;                     // bulk loaded leaves not yet published
 };
 
 struct ScreeDBNode {                                       // volatile nodes of the tree
   bool is_leaf = false;                                    // indicate inner or leaf node
   ScreeDBNode* parent;                                     // parent of this node (null if top)
+  std::atomic<uint64_t> version;                           // even when stable, odd when changing
+};
+
+// Returns the leading eight bytes of a key as a big-endian integer, padded with zeros, so
+// that comparing prefixes as integers orders keys the same way as comparing their bytes.
+inline uint64_t ScreeDBKeyPrefix(const char* data, const size_t size) {
+  if (size >= sizeof(uint64_t)) {
+    uint64_t prefix;
+    memcpy(&prefix, data, sizeof(uint64_t));
+    return __builtin_bswap64(prefix);
+  }
+  uint64_t prefix = 0;
+  for (size_t i = 0; i < size; i++) prefix |= (uint64_t) (uint8_t) data[i] << (56 - 8 * i);
+  return prefix;
+}
+
+// Orders keys like BytewiseComparator without a virtual call, comparing fixed-width keys of
+// eight bytes (like big-endian integers) as two integers instead of calling memcmp.
+inline int ScreeDBBytewiseCompare(const Slice& a, const Slice& b) {
+  if (a.size_ == sizeof(uint64_t) && b.size_ == sizeof(uint64_t)) {
+    const uint64_t x = ScreeDBKeyPrefix(a.data_, sizeof(uint64_t));
+    const uint64_t y = ScreeDBKeyPrefix(b.data_, sizeof(uint64_t));
+    return x < y ? -1 : x > y;
+  }
+  return a.compare(b);
+}
+
+struct ScreeDBInnerKey {                                   // immutable key used by inner nodes
+  uint64_t prefix;                                         // leading bytes as big-endian integer
+  uint32_t size;                                           // length of key data
+  const char* data() const { return (const char*) (this + 1); }  // data follows this header
+  Slice slice() const { return Slice(data(), size); }      // returns data and length
+
+  // Compares bytewise with a key that has the same prefix, so only sizes and bytes beyond
+  // the prefix can differ (shorter keys are zero-padded, so a shorter key sorts first).
+  int CompareSamePrefix(const Slice& key) const {
+    const size_t skip = sizeof(uint64_t);
+    if (size <= skip || key.size_ <= skip) return size < key.size_ ? -1 : size > key.size_;
+    return Slice(data() + skip, size - skip).compare(Slice(key.data_ + skip, key.size_ - skip));
+  }
 };
 
-struct ScreeDBInnerNode : ScreeDBNode {                    // volatile inner nodes of the tree
-  uint8_t keycount;                                        // count of keys in this node
-  std::string keys[INNER_KEYS + 1];                        // child keys plus one overflow slot
-  ScreeDBNode* children[INNER_KEYS + 2];                   // child nodes plus one overflow slot
+class ScreeDBKeyArena {                                    // append-only storage for inner keys
+public:
+  ScreeDBKeyArena() {}
+  ~ScreeDBKeyArena() { for (auto block : blocks_) delete[] block; }
+  const ScreeDBInnerKey* Add(const Slice& key);            // copy key, never moved or freed
+private:
+  ScreeDBKeyArena(const ScreeDBKeyArena&);                 // prevent copying
+  void operator=(const ScreeDBKeyArena&);                  // prevent assignment
+  std::vector<char*> blocks_;                              // allocated blocks, last is current
+  size_t used_ = KEY_ARENA_BLOCK;                          // bytes used in current block
+};
+
+template<int KEYS>
+struct ScreeDBInnerNodeT : ScreeDBNode {                   // volatile inner nodes of the tree
+  static_assert(KEYS >= 2 && KEYS % 2 == 0, "inner nodes must split into equal halves");
+  uint16_t keycount;                                       // count of keys in this node
+  uint64_t prefixes[KEYS + 1];                             // key prefixes, contiguous for search
+  const ScreeDBInnerKey* keys[KEYS + 1];                   // child keys plus one overflow slot
+  ScreeDBNode* children[KEYS + 2];                         // child nodes plus one overflow slot
+
+  // Returns index of first key not less than the given key (so the child that may hold it),
+  // comparing full keys only when prefixes are equal. Valid only for bytewise ordering, so
+  // other comparators use the overload below.
+  int FindChild(const Slice& key, const uint64_t prefix) const {
+#if SCREEDB_VECTOR_SEARCH
+    return FindChildVector(key, prefix);
+#else
+    return FindChildScalar(key, prefix);
+#endif
+  }
+
+  // Finds child for bytewise ordering by binary search over prefixes.
+  int FindChildScalar(const Slice& key, const uint64_t prefix) const {
+    int lo = 0;
+    int hi = keycount > KEYS + 1 ? KEYS + 1 : keycount;    // may be torn while changing
+    while (lo < hi) {
+      const int mid = (lo + hi) / 2;
+      const uint64_t mid_prefix = prefixes[mid];
+      if (mid_prefix < prefix || (mid_prefix == prefix && keys[mid] &&
+                                  keys[mid]->CompareSamePrefix(key) < 0)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+#if SCREEDB_VECTOR_SEARCH
+  // Finds child for bytewise ordering by counting prefixes below the key's, comparing four
+  // (or two without AVX2) at once and stopping at the first that is not below. Prefixes are
+  // unsigned, so sign bits are flipped for the signed compare. Keys with an equal prefix are
+  // then stepped over while they compare less than the key.
+  int FindChildVector(const Slice& key, const uint64_t prefix) const {
+    const int count = keycount > KEYS + 1 ? KEYS + 1 : keycount;  // may be torn while changing
+    int lo = 0;
+#ifdef __AVX2__
+    const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i target = _mm256_xor_si256(_mm256_set1_epi64x((int64_t) prefix), flip);
+    for (; lo + 4 <= count; lo += 4) {
+      const __m256i block = _mm256_loadu_si256((const __m256i*) (prefixes + lo));
+      const __m256i below = _mm256_cmpgt_epi64(target, _mm256_xor_si256(block, flip));
+      const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(below));
+      if (mask != 0xF) return StepEqualKeys(key, prefix, lo + __builtin_ctz(~mask), count);
+    }
+#else
+    const __m128i flip = _mm_set1_epi64x(INT64_MIN);
+    const __m128i target = _mm_xor_si128(_mm_set1_epi64x((int64_t) prefix), flip);
+    for (; lo + 2 <= count; lo += 2) {
+      const __m128i block = _mm_loadu_si128((const __m128i*) (prefixes + lo));
+      const __m128i below = _mm_cmpgt_epi64(target, _mm_xor_si128(block, flip));
+      const int mask = _mm_movemask_pd(_mm_castsi128_pd(below));
+      if (mask != 0x3) return StepEqualKeys(key, prefix, lo + __builtin_ctz(~mask), count);
+    }
+#endif
+    while (lo < count && prefixes[lo] < prefix) lo++;      // remaining prefixes
+    return StepEqualKeys(key, prefix, lo, count);
+  }
+
+  // Returns index of first key from "idx" (the first with a prefix not below) that is not
+  // less than the given key, only comparing full keys while prefixes are equal.
+  int StepEqualKeys(const Slice& key, const uint64_t prefix, int idx, const int count) const {
+    while (idx < count && prefixes[idx] == prefix && keys[idx] &&
+           keys[idx]->CompareSamePrefix(key) < 0) {
+      idx++;
+    }
+    return idx;
+  }
+#endif
+
+  // Returns index of first key not less than the given key, using any comparator.
+  int FindChild(const Slice& key, const Comparator* comparator) const {
+    int lo = 0;
+    int hi = keycount > KEYS + 1 ? KEYS + 1 : keycount;    // may be torn while changing
+    while (lo < hi) {
+      const int mid = (lo + hi) / 2;
+      const ScreeDBInnerKey* mid_key = keys[mid];
+      if (mid_key && comparator->Compare(mid_key->slice(), key) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  // Store key at the given index, along with its prefix.
+  void SetKey(const int idx, const ScreeDBInnerKey* key) {
+    prefixes[idx] = key->prefix;
+    keys[idx] = key;
+  }
 };
 
+typedef ScreeDBInnerNodeT<INNER_KEYS> ScreeDBInnerNode;
+
 struct ScreeDBLeafNode : ScreeDBNode {                     // volatile leaf nodes of the tree
-  uint8_t hashes[NODE_KEYS];                               // Pearson hashes of keys
+  ScreeDBHash hashes[NODE_KEYS];                           // Pearson hashes of keys (0 if empty)
   persistent_ptr<ScreeDBLeaf> leaf;                        // pointer to persistent leaf
-  bool lock;                                               // boolean modification lock
+  std::atomic<uint32_t> lock;                              // writer bit and count of readers
+  std::atomic<ScreeDBLeafNode*> prev;                      // previous leaf in key order
+  std::atomic<ScreeDBLeafNode*> next;                      // next leaf in key order
 };
 
-struct ScreeDBRecoveredLeaf {                              // temporary wrapper used for recovery
+// Volatile index from full-width key hashes to the leaves holding those keys, and the slot
+// last used by each key, with one entry per key. Entries are only changed while holding the
+// leaf locks involved, so readers check an entry again after locking the leaf it names, and
+// check the key is still in its slot before relying on it.
+class ScreeDBKeyIndex {                                    // volatile index of leaves by key hash
+  static_assert(KEY_INDEX_SHARDS == 256, "shards are chosen by top byte of key hash");
+public:
+  ScreeDBKeyIndex() {}
+  void Add(const uint64_t hash, ScreeDBLeafNode* leafnode, const int slot);
+  bool Contains(const uint64_t hash, ScreeDBLeafNode* leafnode);
+  ScreeDBLeafNode* Find(const uint64_t hash, const size_t nth, int* slot);
+  void Move(const uint64_t hash, ScreeDBLeafNode* from, ScreeDBLeafNode* to, const int slot);
+  void Remove(const uint64_t hash, ScreeDBLeafNode* leafnode);
+  static uint64_t Hash(const Slice& key);
+private:
+  ScreeDBKeyIndex(const ScreeDBKeyIndex&);                 // prevent copying
+  void operator=(const ScreeDBKeyIndex&);                  // prevent assignment
+  struct Entry {                                           // open addressing, linear probing
+    uint64_t hash;                                         // key hash, with slot in top byte
+    ScreeDBLeafNode* leafnode;                             // leaf holding key, nullptr if unused
+  };
+  static bool SameHash(const uint64_t a, const uint64_t b) { return (a ^ b) << 8 == 0; }
+  static uint64_t WithSlot(const uint64_t hash, const int slot) {
+    return (hash << 8 >> 8) | (uint64_t) slot << 56;       // top byte only picks the shard
+  }
+  struct Shard {                                           // lock and table for some hashes
+    std::atomic<bool> lock{false};                         // spinlock, held briefly
+    std::vector<Entry> entries;                            // power of two size, at most half full
+    size_t used = 0;                                       // entries holding keys
+  };
+  Entry* FindEntry(Shard& shard, const uint64_t hash, ScreeDBLeafNode* leafnode);
+  void Grow(Shard& shard);                                 // doubles table, rehashing entries
+  Shard& Lock(const uint64_t hash);                        // returns locked shard for hash
+  Shard shards_[KEY_INDEX_SHARDS];                         // chosen by high bits of hash
+};
+
+struct ScreeDBRecoveredLeaf {                              // leaf being recovered or bulk loaded
   ScreeDBLeafNode* leafnode;                               // leaf node being recovered
-  char* max_key;                                           // highest sorting key present
+  Slice min_key;                                           // lowest sorting key present
+  Slice max_key;                                           // highest sorting key present
+};
+
+enum ScreeDBUpdateType { SCREEDB_PUT, SCREEDB_DELETE, SCREEDB_MERGE };
+
+struct ScreeDBUpdate {                                     // one update from a write batch
+  Slice key;                                               // points into batch
+  Slice value;                                             // batch or merged value
+  ScreeDBUpdateType type;                                  // merges become puts
+};
+
+struct ScreeDBBatch {                                      // updates for one tree in a batch
+  std::vector<ScreeDBUpdate> updates;                      // sorted by key when prepared
+  std::deque<std::string> merged;                          // stable merged values
+  std::vector<ScreeDBLeafNode*> locked;                    // leaves locked, in key order
+  std::unordered_set<ScreeDBLeafNode*> held;               // same leaves, for fast lookup
+  std::unordered_map<ScreeDBLeafNode*, std::pair<ScreeDBLeafNode*, const ScreeDBInnerKey*>>
+          splits;                                          // leaf split off each, and split key
+};
+
+struct ScreeDBVersion {                                    // value replaced while snapshot live
+  SequenceNumber replaced;                                 // write that replaced the value
+  bool present;                                            // else key was absent
+  std::string value;                                       // copy of value before the write
+};
+
+struct ScreeDBVersionOrder {                               // orders saved versions by key
+  const Comparator* comparator;                            // same as tree comparator
+  bool operator()(const std::string& a, const std::string& b) const {
+    return comparator->Compare(a, b) < 0;
+  }
+};
+
+typedef std::map<std::string, std::vector<ScreeDBVersion>, ScreeDBVersionOrder> ScreeDBVersions;
+
+class ScreeDBSnapshot : public Snapshot {                  // sequence number of a live snapshot
+public:
+  explicit ScreeDBSnapshot(const SequenceNumber sequence) : sequence_(sequence) {}
+  virtual SequenceNumber GetSequenceNumber() const override { return sequence_; }
+private:
+  const SequenceNumber sequence_;                          // last write visible to snapshot
+};
+
+struct ScreeDBCacheStats {                                 // counted since tree was opened
+  uint64_t hits = 0;                                       // reads answered from DRAM cache
+  uint64_t misses = 0;                                     // reads that went to persistent leaves
+  uint64_t usage = 0;                                      // bytes charged to cached values
+};
+
+struct ScreeDBLeafCounts {                                 // kept by tickers as leaves change
+  uint64_t leaves = 0;                                     // leaves in the tree
+  uint64_t keys = 0;                                       // keys in all leaves
+  uint64_t orphaned_bytes = 0;                             // long strings kept in unused slots
+  uint64_t pmem_bytes = 0;                                 // leaves and their long strings
+};
+
+struct ScreeDBPerfContext {                                // per-thread, like RocksDB PerfContext
+  void Reset();                                            // reset all counters to zero
+  std::string ToString() const;                            // counters as "name = value" pairs
+  uint64_t leaf_search_nanos;                              // descending inner nodes to leaves
+  uint64_t transaction_nanos;                              // running outermost transactions
+  uint64_t string_alloc_nanos;                             // allocating long persistent strings
+  uint64_t transaction_count;                              // outermost transactions run
+  uint64_t leaf_split_count;                               // leaves split to make room
+  uint64_t hash_match_count;                               // slots with hashes matching a key
+  uint64_t hash_false_positive_count;                      // matching slots holding other keys
+};
+
+extern __thread ScreeDBPerfContext screedb_perf_context;  // counts when PerfLevel allows
+
+class ScreeDBPerfTimer {                                   // adds nanos to a perf context metric
+public:
+  explicit ScreeDBPerfTimer(uint64_t* metric)              // timed at kEnableTimeExceptForMutex
+          : metric_(GetPerfLevel() >= kEnableTimeExceptForMutex ? metric : nullptr),
+            start_(metric_ ? Env::Default()->NowNanos() : 0) {}
+  ~ScreeDBPerfTimer() { if (metric_) *metric_ += Env::Default()->NowNanos() - start_; }
+private:
+  uint64_t* const metric_;                                 // metric to update, else nullptr
+  const uint64_t start_;                                   // nanos when constructed
+};
+
+class ScreeDBStopWatch {                                   // adds micros to a statistics histogram
+public:
+  ScreeDBStopWatch(Env* env, Statistics* stats, const uint32_t histogram)
+          : env_(env), stats_(stats && stats->HistEnabledForType(histogram) ? stats : nullptr),
+            histogram_(histogram), start_(stats_ ? env->NowMicros() : 0) {}
+  ~ScreeDBStopWatch() { if (stats_) stats_->measureTime(histogram_, env_->NowMicros() - start_); }
+private:
+  Env* const env_;                                         // clock for timing
+  Statistics* const stats_;                                // statistics to update, else nullptr
+  const uint32_t histogram_;                               // histogram to update
+  const uint64_t start_;                                   // micros when constructed
+};
+
+enum ScreeDBTicker {                                       // counted per tree since opened
+  SCREEDB_CACHE_HITS,                                      // reads answered from DRAM cache
+  SCREEDB_CACHE_MISSES,                                    // reads that went to persistent leaves
+  SCREEDB_TRANSACTIONS,                                    // outermost transactions run
+  SCREEDB_LEAF_SPLITS,                                     // leaves split to make room
+  SCREEDB_HASH_MATCHES,                                    // slots with hashes matching a key
+  SCREEDB_HASH_FALSE_POSITIVES,                            // matching slots holding other keys
+  SCREEDB_ABSENT_LOOKUPS,                                  // leaves searched for missing keys
+  SCREEDB_ABSENT_HASH_MATCHES,                             // ...where some slot's hash matched
+  SCREEDB_KEY_MAY_EXIST_CALLS,                             // calls to KeyMayExist
+  SCREEDB_KEY_MAY_EXIST_NEGATIVES,                         // ...answering key definitely absent
+  SCREEDB_LEAVES,                                          // leaves in the tree, recovered on open
+  SCREEDB_KEYS,                                            // keys in all leaves
+  SCREEDB_PMEM_BYTES,                                      // leaves and their long strings
+  SCREEDB_ORPHANED_BYTES,                                  // long strings left in empty slots
+  SCREEDB_TICKER_MAX
+};
+
+const int TICKER_STRIPES = 16;                             // threads share stripes beyond this
+
+class ScreeDBTickers {                                     // counters striped across threads
+public:
+  void Add(const ScreeDBTicker ticker, const uint64_t count = 1) {
+    stripes_[Stripe()].counts[ticker].fetch_add(count, std::memory_order_relaxed);
+  }
+  uint64_t Get(const ScreeDBTicker ticker) const;          // sums stripes, approximate if busy
+  static int Stripe();                                     // fixed for each thread
+private:
+  struct ScreeDBTickerStripe {                             // 128 bytes, never sharing cache lines
+    std::atomic<uint64_t> counts[SCREEDB_TICKER_MAX] = {};
+    char padding[128 - SCREEDB_TICKER_MAX * sizeof(uint64_t)];
+  };
+  ScreeDBTickerStripe stripes_[TICKER_STRIPES];            // counts by thread stripe
+};
+
+class ScreeDBEpochs {                                      // readers that may hold retired nodes
+public:
+  explicit ScreeDBEpochs(void (*free)(ScreeDBNode*)) : free_(free) {}
+  ~ScreeDBEpochs();                                        // frees nodes still retired
+  uint64_t Current() const { return epoch_.load(std::memory_order_seq_cst); }
+  uint64_t Enter();                                        // returns epoch entered
+  void Exit(const uint64_t epoch);                         // leaves epoch, reclaiming if retired
+  void Reclaim();                                          // frees nodes no reader can hold
+  void Retire(ScreeDBNode* node);                          // frees once current readers leave
+private:
+  bool TryAdvance();                                       // once readers of prior epoch leave
+  struct ScreeDBEpochStripe {                              // 128 bytes, never sharing cache lines
+    std::atomic<uint64_t> readers[2] = {};                 // by parity of epoch entered
+    char padding[128 - 2 * sizeof(uint64_t)];
+  };
+  std::atomic<uint64_t> epoch_{0};                         // advanced while reclaiming nodes
+  ScreeDBEpochStripe stripes_[TICKER_STRIPES];             // readers by thread stripe
+  void (* const free_)(ScreeDBNode*);                      // frees a node no longer reachable
+  std::mutex retired_mutex_;                               // guards retired nodes and advancing
+  std::deque<std::pair<uint64_t, ScreeDBNode*>> retired_;  // unlinked nodes by epoch retired
+  std::atomic<uint64_t> retired_count_{0};                 // retired nodes, read without locking
+};
+
+class ScreeDBEpochGuard {                                  // holds off freeing nodes while in scope
+public:
+  explicit ScreeDBEpochGuard(ScreeDBEpochs* epochs) : epochs_(epochs), epoch_(epochs->Enter()) {}
+  ~ScreeDBEpochGuard() { epochs_->Exit(epoch_); }
+private:
+  ScreeDBEpochs* const epochs_;                            // epochs entered
+  const uint64_t epoch_;                                   // epoch when constructed
+};
+
+struct ScreeDBRecoveryStats {                              // timings from last recovery
+  uint64_t chain_micros = 0;                               // walking the chain of leaves
+  uint64_t scan_micros = 0;                                // recovering hashes and key bounds
+  uint64_t build_micros = 0;                               // building inner nodes bottom-up
+  uint64_t leaves = 0;                                     // leaves recovered (excluding empty)
+  uint64_t threads = 0;                                    // threads used to scan leaves
+  uint64_t unlinked = 0;                                   // empty leaves removed from chain
+};
+
+struct ScreeDBOptions {                                    // options for persistent pools
+  size_t pool_size = PMEMOBJ_MIN_POOL * 450;               // bytes when creating pool file
+  std::string layout = SSO_LAYOUT;                         // layout name when creating or opening
+  bool prefault = false;                                   // touch every page when creating pool
+  size_t cache_size = 0;                                   // DRAM bytes for hot values, 0 is off
+  bool hash_index = false;                                 // index keys by hash for point lookups
+  uint32_t reclaim_interval_ms = 1000;                     // reclaims retired nodes, 0 is off
+  bool compact_in_background = false;                      // also compacts leaves each interval
 };
 
+class ScreeDBIterator;
+class ScreeDBPinnedValue;
+
 class ScreeDBTree {                                        // persistent tree implementation
+  friend class ScreeDBIterator;
+  friend class ScreeDBPinnedValue;
+  friend class ScreeDBSnapshotIterator;
 public:
-  ScreeDBTree(const std::string& name);
+  ScreeDBTree(const std::string& name, const Comparator* comparator = BytewiseComparator(),
+              const ScreeDBOptions& options = ScreeDBOptions(),
+              const MergeOperator* merge_operator = nullptr);
+  ScreeDBTree(ScreeDBTree* owner, persistent_ptr<ScreeDBFamily> family,
+              const Comparator* comparator = BytewiseComparator(),
+              const ScreeDBOptions& options = ScreeDBOptions(),
+              const MergeOperator* merge_operator = nullptr);
   ~ScreeDBTree();
+  persistent_ptr<ScreeDBFamily> GetFamily() const { return family_; }
+  uint32_t GetFamilyId() const { return family_ ? family_->id.get_ro() : 0; }
+  SequenceNumber GetLatestSequenceNumber() const { return owner_->sequence_.load(); }
   const std::string& GetName() const { return name; }
   const char* GetNamePtr() const { return name.c_str(); }
+  const Status& GetOpenStatus() const { return open_status_; }
+  const ScreeDBRecoveryStats& GetRecoveryStats() const { return recovery_stats_; }
+  ScreeDBCacheStats GetCacheStats() const;
+  ScreeDBLeafCounts GetLeafCounts() const;
+  uint64_t GetPoolBytes() const { return owner_->pool_bytes_; }
+  uint64_t GetSnapshotCount() const { return owner_->snapshot_count_.load(); }
+  uint64_t GetTickerCount(const ScreeDBTicker ticker) const { return tickers_.Get(ticker); }
+  int GetTreeDepth();
+  uint64_t GetVersionBytes() const { return version_bytes_.load(); }
+  Status BulkLoad(Iterator* source);
+  Status Compact(const Slice* begin, const Slice* end, const int max_leaves = 0,
+                 std::string* resume = nullptr);
+  Status CreateFamily(const std::string& family_name, const Comparator* comparator,
+                      persistent_ptr<ScreeDBFamily>* family);
   Status Delete(const Slice& key);
-  Status Get(const Slice& key, std::string* value);
-  std::vector<Status> MultiGet(const std::vector<Slice>& keys,
-                               std::vector<std::string>* values);
+  void DropFamily(persistent_ptr<ScreeDBFamily> family);
+  persistent_ptr<ScreeDBFamily> FindFamily(const std::string& family_name);
+  Status Get(const Slice& key, std::string* value, const Snapshot* snapshot = nullptr);
+  Status GetInPlace(const Slice& key, const Snapshot* snapshot,
+                    const std::function<void(const Slice&)>& visitor);
+  Status GetPinned(const Slice& key, const Snapshot* snapshot, ScreeDBPinnedValue* pinned);
+  const Snapshot* GetSnapshot();
+  bool KeyMayExist(const Slice& key, const Snapshot* snapshot, std::string* value,
+                   bool* value_found);
+  Status Merge(const Slice& key, const Slice& value);
+  std::vector<Status> MultiGet(const std::vector<Slice>& keys, std::vector<std::string>* values,
+                               const Snapshot* snapshot = nullptr);
+  ScreeDBIterator* NewIterator();
+  Iterator* NewIterator(const Snapshot* snapshot);
   Status Put(const Slice& key, const Slice& value);
+  void ReclaimFamily(persistent_ptr<ScreeDBFamily> family);
+  void ReleaseSnapshot(const Snapshot* snapshot);
+  void TrimVersions();
+  Status Write(WriteBatch* updates);
+  static Status Write(WriteBatch* updates, const std::map<uint32_t, ScreeDBTree*>& trees);
 protected:
+  void BackgroundRun(const uint32_t interval_ms, const bool compact);
+  void BackgroundStart(const ScreeDBOptions& options);
+  void BackgroundStop();
+  void BulkDiscard();
+  Status BulkPublish(std::vector<ScreeDBRecoveredLeaf>& loaded);
+  void CacheErase(const Slice& key);
+  void CacheInsert(const Slice& key, const Slice& value);
+  bool CacheLookup(const Slice& key, std::string* value);
+  void IndexAdd(const Slice& key, ScreeDBLeafNode* leafnode, const int slot);
+  void IndexMove(const Slice& key, ScreeDBLeafNode* from, ScreeDBLeafNode* to, const int slot);
+  void IndexRemove(const Slice& key, ScreeDBLeafNode* leafnode);
+  int KeyCompare(const Slice& a, const Slice& b) const {
+    return bytewise_ ? ScreeDBBytewiseCompare(a, b) : comparator_->Compare(a, b);
+  }
+  bool LeafClearSlotForKey(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                           const Slice& key);
+  void LeafCountAll(const ScreeDBLeafNode* leafnode, ScreeDBLeafCounts* counts);
+  void LeafCountChange(const ScreeDBLeafCounts& before, const ScreeDBLeafCounts& after);
+  int LeafCountKeys(const ScreeDBLeafNode* leafnode);
+  void LeafCountSlot(const ScreeDBLeafNode* leafnode, const int slot, ScreeDBLeafCounts* counts);
+  void LeafCreateHead();
   void LeafDebugDump(ScreeDBNode* node);
   void LeafDebugDumpWithChildren(ScreeDBInnerNode* inner);
-  void LeafFillFirstEmptySlot(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                              const Slice& key, const Slice& value);
-  bool LeafFillSlotForKey(ScreeDBLeafNode* leafnode, const uint8_t hash,
+  int LeafFillFirstEmptySlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                             const Slice& key, const Slice& value);
+  bool LeafFillSlotForKey(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
                           const Slice& key, const Slice& value);
-  void LeafFillSpecificSlot(ScreeDBLeafNode* leafnode, const uint8_t hash,
+  uint64_t LeafFreeOrphans(ScreeDBLeafNode* leafnode);
+  void LeafFreePersistent(persistent_ptr<ScreeDBLeaf> leaf);
+  void LeafFreeStrings(persistent_ptr<ScreeDBLeaf> leaf, const int slot);
+  void LeafFillSpecificSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
                             const Slice& key, const Slice& value, const int slot);
-  ScreeDBLeafNode* LeafSearch(const Slice& key);
-  void LeafSplit(ScreeDBLeafNode* leafnode, const uint8_t hash,
-                 const Slice& key, const Slice& value);
+  int LeafFindSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash, const Slice& key);
+  persistent_ptr<ScreeDBLeaf>& LeafHead();
+  void LeafHidePinnedSlot(ScreeDBLeafNode* leafnode, const int slot);
+  bool LeafHoldsPinnedOrphans(ScreeDBLeafNode* leafnode);
+  ScreeDBLeafNode* LeafLockEdge(const bool last, const bool shared = false);
+  ScreeDBLeafNode* LeafLockForKey(const Slice& key, const ScreeDBInnerKey** upper = nullptr,
+                                  const bool shared = false);
+  ScreeDBLeafNode* LeafLockIndexed(const Slice& key, int* slot, const bool shared = false);
+  void LeafLock(ScreeDBLeafNode* leafnode, const bool shared = false);
+  uint64_t LeafMatchSlots(const ScreeDBLeafNode* leafnode, const ScreeDBHash hash);
+  bool LeafMergeNext(ScreeDBLeafNode* leafnode, ScreeDBLeafNode* next);
+  int LeafPublishSlot(ScreeDBLeafNode* leafnode, const ScreeDBHash hash, const Slice& key,
+                      const Slice& value, const int old_slot);
+  void LeafRestoreHashes(ScreeDBLeafNode* leafnode);
+  ScreeDBLeafNode* LeafSearch(const Slice* key, const bool last, uint64_t* version,
+                              const ScreeDBInnerKey** upper = nullptr);
+  void LeafSortSlots(ScreeDBLeafNode* leafnode, std::vector<int>* slots);
+  ScreeDBLeafNode* LeafSplit(ScreeDBLeafNode* leafnode, const ScreeDBHash hash,
+                             const Slice& key, const Slice& value,
+                             const ScreeDBInnerKey** split_key = nullptr);
+  ScreeDBLeafNode* LeafUnderflow(ScreeDBLeafNode* leafnode);
+  void LeafUnlock(ScreeDBLeafNode* leafnode, const bool shared = false);
   void LeafUpdateParentsAfterSplit(ScreeDBNode* node, ScreeDBNode* new_node,
-                                   std::string* split_key);
-  uint8_t PearsonHash(const char* data, const size_t size);
+                                   const ScreeDBInnerKey* split_key);
+  Status MergeValue(const Slice& key, const Slice* existing, const Slice& operand,
+                    std::string* merged);
+  ScreeDBNode* NodeBuildParents(std::vector<ScreeDBNode*>& level,
+                                std::vector<const ScreeDBInnerKey*>& level_keys);
+  static void NodeFree(ScreeDBNode* node);
+  void NodeLock(ScreeDBNode* node);
+  uint64_t NodeReadBegin(ScreeDBNode* node);
+  bool NodeReadValidate(ScreeDBNode* node, const uint64_t version);
+  void NodeRemoveChild(ScreeDBInnerNode* inner, ScreeDBNode* child);
+  void NodeRetire(ScreeDBNode* node);
+  void NodeUnlock(ScreeDBNode* node);
+  void OpenPool(const ScreeDBOptions& options);
+  ScreeDBHash PearsonHash(const char* data, const size_t size);
+  void PinAdd(const char* data);
+  bool PinHeld(const ScreeDBString& value);
+  void PinRelease(const char* data);
+  void PinWait(const ScreeDBString& value);
+  void RebuildInnerNodes(std::vector<ScreeDBRecoveredLeaf>& leaves);
   void RebuildNodes();
   void Recover();
+  void RecoverLeaf(persistent_ptr<ScreeDBLeaf> leaf, ScreeDBRecoveredLeaf* rleaf);
+  SequenceNumber SequenceNext(const uint64_t count);
   void Shutdown();
+  void TransactionDefer(std::function<void()> action);
+  void TransactionRun(std::function<void()> body);
+  static const ScreeDBVersion* VersionAt(const std::vector<ScreeDBVersion>& versions,
+                                         const SequenceNumber sequence);
+  bool VersionFind(const Slice& key, const SequenceNumber sequence, std::string* value,
+                   bool* present);
+  void VersionLockAll();
+  void VersionSave(ScreeDBLeafNode* leafnode, const ScreeDBHash hash, const Slice& key,
+                   const SequenceNumber sequence);
+  bool VersionSeek(const Slice* target, const bool forward, const bool inclusive,
+                   const SequenceNumber sequence, std::string* key, std::string* value,
+                   bool* present);
+  static size_t VersionShard(const Slice& key);
+  void VersionUnlockAll();
+  void WriteAbort(ScreeDBBatch* batch);
+  void WriteApply(ScreeDBBatch* batch, const SequenceNumber sequence);
+  ScreeDBLeafNode* WriteLockForKey(ScreeDBBatch* batch, const Slice& key);
+  Status WritePrepare(ScreeDBBatch* batch);
 private:
   ScreeDBTree(const ScreeDBTree&);                         // prevent copying
   void operator=(const ScreeDBTree&);                      // prevent assignment
   const std::string name;                                  // name when constructed
+  const Comparator* const comparator_;                     // orders keys in leaves and nodes
+  const bool bytewise_;                                    // comparator orders keys as bytes
+  const MergeOperator* const merge_operator_;              // combines merges, else they're puts
+  const bool uint64add_;                                   // merge operator adds fixed64 values
+  Status open_status_;                                     // error if pool could not be used
   pool<ScreeDBRoot> pop_;                                  // pool for persistent root
-  ScreeDBNode* top_ = nullptr;                             // top of volatile tree
+  const persistent_ptr<ScreeDBFamily> family_;             // column family, else default tree
+  ScreeDBTree* const owner_;                               // tree that opened pool, else this
+  std::mutex families_mutex_;                              // serializes changes to family lists
+  std::mutex load_mutex_;                                  // one bulk load per pool, in owner only
+  std::atomic<uint64_t> sequence_{0};                      // last write numbered, in owner only
+  std::atomic<uint64_t> snapshot_count_{0};                // live snapshots, in owner only
+  std::multiset<SequenceNumber> snapshots_;                // live snapshots, in owner only
+  std::mutex version_mutexes_[VERSION_SHARDS];             // guard versions by shard, in owner only
+  ScreeDBVersions versions_[VERSION_SHARDS];               // values replaced since snapshots
+  std::atomic<uint64_t> version_bytes_{0};                 // bytes held by saved versions
+  std::atomic<ScreeDBNode*> top_{nullptr};                 // top of volatile tree
+  std::mutex split_mutex_;                                 // serializes changes to inner nodes
+  ScreeDBKeyArena split_keys_;                             // immutable keys used by inner nodes
+  ScreeDBEpochs epochs_{NodeFree};                         // readers that may hold retired nodes
+  ScreeDBRecoveryStats recovery_stats_;                    // timings from last recovery
+  std::shared_ptr<Cache> cache_;                           // hot values in DRAM, else nullptr
+  std::unique_ptr<ScreeDBKeyIndex> index_;                 // leaves by key hash, else nullptr
+  uint64_t pool_bytes_ = 0;                                // size of pool files, in owner only
+  std::thread background_;                                 // reclaims and compacts, if started
+  std::mutex background_mutex_;                            // guards stopping background thread
+  std::condition_variable background_wake_;                // wakes background thread to stop
+  bool background_stop_ = false;                           // set when closing tree
+  ScreeDBTickers tickers_;                                 // counts kept for properties
+  std::mutex pins_mutex_;                                  // guards pinned values
+  std::unordered_map<const char*, uint64_t> pins_;         // pinned long values by address
+  std::atomic<uint64_t> pin_count_{0};                     // pins held, read without locking
+};
+
+class ScreeDBPinnedValue {                                 // value read in place from the pool
+public:
+  ScreeDBPinnedValue() {}
+  ~ScreeDBPinnedValue() { Reset(); }
+  bool IsPinned() const { return tree_ != nullptr; }       // else copied, being short
+  void Reset();                                            // releases pin, empties value
+  const Slice& value() const { return value_; }            // valid until reset or reused
+private:
+  friend class ScreeDBTree;
+  ScreeDBPinnedValue(const ScreeDBPinnedValue&);           // prevent copying
+  void operator=(const ScreeDBPinnedValue&);               // prevent assignment
+  ScreeDBTree* tree_ = nullptr;                            // tree holding pin, else nullptr
+  Slice value_;                                            // into pool, or into copy
+  std::string copy_;                                       // short values and snapshot reads
+};
+
+class ScreeDBIterator : public Iterator {                  // ordered iterator over leaves
+public:
+  explicit ScreeDBIterator(ScreeDBTree* tree);
+  virtual ~ScreeDBIterator() { UnpinValues(); }
+  virtual bool Valid() const override { return pos_ >= 0 && pos_ < (int) slots_.size(); }
+  virtual void SeekToFirst() override;
+  virtual void SeekToLast() override;
+  virtual void Seek(const Slice& target) override;
+  virtual void Next() override;
+  virtual void Prev() override;
+  virtual Slice key() const override;
+  virtual Slice value() const override;
+  virtual Status status() const override { return Status::OK(); }
+private:
+  ScreeDBIterator(const ScreeDBIterator&);                 // prevent copying
+  void operator=(const ScreeDBIterator&);                  // prevent assignment
+  void LoadBackward(ScreeDBLeafNode* leafnode, const std::string* before);
+  void LoadForward(ScreeDBLeafNode* leafnode, const Slice* target, const bool inclusive);
+  void LoadSlots(ScreeDBLeafNode* leafnode);
+  void LoadValues(ScreeDBLeafNode* leafnode);
+  void UnpinValues();
+  ScreeDBTree* const tree_;                                // tree being iterated
+  std::vector<int> slots_;                                 // leaf slots in ascending key order
+  std::vector<std::pair<std::string, std::string>> copies_;  // keys and unpinned values, reused
+  std::vector<Slice> values_;                              // into pool, or into copies
+  std::vector<const char*> pinned_;                        // long values pinned in current leaf
+  int pos_ = -1;                                           // current index into slots
+  std::string first_key_;                                  // lowest key among slots
+  std::string last_key_;                                   // highest key among slots
+};
+
+class ScreeDBSnapshotIterator : public Iterator {          // ordered iterator as of a snapshot
+public:
+  ScreeDBSnapshotIterator(ScreeDBTree* tree, const SequenceNumber sequence);
+  virtual bool Valid() const override { return valid_; }
+  virtual void SeekToFirst() override;
+  virtual void SeekToLast() override;
+  virtual void Seek(const Slice& target) override;
+  virtual void Next() override;
+  virtual void Prev() override;
+  virtual Slice key() const override;
+  virtual Slice value() const override;
+  virtual Status status() const override { return Status::OK(); }
+private:
+  ScreeDBSnapshotIterator(const ScreeDBSnapshotIterator&); // prevent copying
+  void operator=(const ScreeDBSnapshotIterator&);          // prevent assignment
+  void FindBackward();
+  void FindForward();
+  void SeekVersion(const Slice* target, const bool forward, const bool inclusive);
+  ScreeDBTree* const tree_;                                // tree being iterated
+  const SequenceNumber sequence_;                          // snapshot being read
+  ScreeDBIterator live_;                                   // current leaf of live tree
+  bool forward_ = true;                                    // direction of last move
+  bool valid_ = false;                                     // positioned at an entry
+  bool from_version_ = false;                              // entry is a saved version
+  bool version_valid_ = false;                             // saved version found
+  bool version_present_ = false;                           // saved version holds a value
+  std::string version_key_;                                // key of saved version
+  std::string version_value_;                              // value of saved version
+};
+
+class ScreeDB;
+
+class ScreeDBColumnFamilyHandle : public ColumnFamilyHandle {  // names one tree in the pool
+  friend class ScreeDB;
+public:
+  ScreeDBColumnFamilyHandle(ScreeDB* db, ScreeDBTree* tree, const std::string& name,
+                            const ColumnFamilyOptions& options);
+  virtual ~ScreeDBColumnFamilyHandle();
+  virtual const std::string& GetName() const override { return name_; }
+  virtual uint32_t GetID() const override { return id_; }
+  virtual Status GetDescriptor(ColumnFamilyDescriptor* desc) override;
+  ScreeDBTree* GetTree() const { return tree_; }
+private:
+  ScreeDBColumnFamilyHandle(const ScreeDBColumnFamilyHandle&);           // prevent copying
+  void operator=(const ScreeDBColumnFamilyHandle&);                      // prevent assignment
+  ScreeDB* const db_;                                      // database that opened the family
+  ScreeDBTree* const tree_;                                // owned by database until dropped
+  const std::string name_;                                 // name when created
+  const uint32_t id_;                                      // used by write batches
+  const ColumnFamilyOptions options_;                      // keeps comparator and merges alive
+  bool dropped_ = false;                                   // handle owns tree, frees on delete
 };
 
 class ScreeDB : public DB {                                // RocksDB API on persistent tree
+  friend class ScreeDBColumnFamilyHandle;
 public:
   // Open database using specified configuration options and name.
   static Status Open(const Options& options, const std::string& dbname, ScreeDB** dbptr);
 
+  // Open database using specified configuration options, pool options and name. The name may
+  // be a pool set file (starting with "PMEMPOOLSET") to span several files, which creates its
+  // parts when they don't yet exist, ignoring the pool size.
+  static Status Open(const Options& options, const ScreeDBOptions& screedb_options,
+                     const std::string& dbname, ScreeDB** dbptr);
+
+  // Open database with the named column families, returning a handle for each in the same
+  // order. Families missing from the pool are created if create_missing_column_families is
+  // set. Families in the pool but not listed stay closed. The default family's options are
+  // used for the default tree, which is always opened. Other families recover in parallel.
+  static Status Open(const DBOptions& db_options, const ScreeDBOptions& screedb_options,
+                     const std::string& dbname,
+                     const std::vector<ColumnFamilyDescriptor>& column_families,
+                     std::vector<ColumnFamilyHandle*>* handles, ScreeDB** dbptr);
+
   // Safely close the database.
   virtual ~ScreeDB();
 
@@ -161,18 +884,29 @@ public:
   // on error.  It is not an error if "key" did not exist in the database.
   using DB::Delete;
   virtual Status Delete(const WriteOptions& options, ColumnFamilyHandle* column_family,
-                        const Slice& key) override {
-    return dbtree->Delete(key);
-  }
+                        const Slice& key) override;
 
   // If the database contains an entry for "key" store the corresponding value in *value
   // and return OK. If there is no entry for "key" leave *value unchanged and return a status
   // for which Status::IsNotFound() returns true. May return some other Status on an error.
   using DB::Get;
   virtual Status Get(const ReadOptions& options, ColumnFamilyHandle* column_family,
-                     const Slice& key, std::string* value) override {
-    return dbtree->Get(key, value);
-  }
+                     const Slice& key, std::string* value) override;
+
+  // Like Get(), but passes the value to "visitor" in place, without copying it out of the
+  // pool. The visitor runs while the leaf holding the key is locked, so it must not keep the
+  // slice, and must not read or write the database. Not called if the key is not found.
+  Status GetInPlace(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                    const Slice& key, const std::function<void(const Slice&)>& visitor);
+
+  // Like Get(), but pins the value where it lies in the pool instead of copying it, until
+  // released by Reset() or by deleting *pinned. Writers never wait for pins: a pinned value
+  // that is replaced or deleted is left in its emptied slot (and its leaf isn't merged), to
+  // be freed by CompactRange() once released. Pins must be released before the database (or
+  // the column family handle) is deleted. Short values, and values read at a snapshot, are
+  // copied instead.
+  Status GetPinned(const ReadOptions& options, ColumnFamilyHandle* column_family,
+                   const Slice& key, ScreeDBPinnedValue* pinned);
 
   // If the key definitely does not exist in the database, then this method returns false,
   // else true. If the caller wants to obtain value when the key is found in memory, a bool
@@ -180,19 +914,22 @@ public:
   // set properly. This check is potentially lighter-weight than invoking DB::Get(). One way
   // to make this lighter weight is to avoid doing any IOs. Default implementation here returns
   // true and sets 'value_found' to false.
+  //
+  // ScreeDB answers from DRAM only, never reading the pool: from the value cache (which also
+  // finds the value), else the hash index, else the slot hashes of the leaf that would hold
+  // the key. Snapshot reads always return true, since saved versions may hold deleted keys.
+  // See "rocksdb.screedb.key-may-exist-false-positive-rate".
   using DB::KeyMayExist;
   virtual bool KeyMayExist(const ReadOptions& options, ColumnFamilyHandle* column_family,
                            const Slice& key, std::string* value,
-                           bool* value_found = nullptr) override { return true; }
+                           bool* value_found = nullptr) override;
 
   // Merge the database entry for "key" with "value".  Returns OK on success, and a non-OK
   // status on error. The semantics of this operation is determined by the user provided
   // merge_operator when opening DB.
   using DB::Merge;
   virtual Status Merge(const WriteOptions& options, ColumnFamilyHandle* column_family,
-                       const Slice& key, const Slice& value) {
-    return Put(options, column_family, key, value);  // todo not using merge_operator, see #7
-  }
+                       const Slice& key, const Slice& value);
 
   // If keys[i] does not exist in the database, then the i'th returned status will be one for
   // which Status::IsNotFound() is true, and (*values)[i] will be set to some arbitrary value
@@ -205,17 +942,13 @@ public:
   virtual std::vector<Status> MultiGet(const ReadOptions& options,
                                        const std::vector<ColumnFamilyHandle*>& column_family,
                                        const std::vector<Slice>& keys,
-                                       std::vector<std::string>* values) override {
-    return dbtree->MultiGet(keys, values);
-  }
+                                       std::vector<std::string>* values) override;
 
   // Set the database entry for "key" to "value". If "key" already exists, it will be overwritten.
   // Returns OK on success, and a non-OK status on error.
   using DB::Put;
   virtual Status Put(const WriteOptions& options, ColumnFamilyHandle* column_family,
-                     const Slice& key, const Slice& value) override {
-    return dbtree->Put(key, value);
-  }
+                     const Slice& key, const Slice& value) override;
 
   // Remove the database entry for "key". Requires that the key exists and was not overwritten.
   // Returns OK on success, and a non-OK status on error.  It is not an error if "key" did not
@@ -236,7 +969,7 @@ public:
   // Apply the specified updates to the database. If `updates` contains no update, WAL will
   // still be synced if options.sync=true. Returns OK on success, non-OK on failure.
   using DB::Write;
-  virtual Status Write(const WriteOptions& options, WriteBatch* updates) NOOPE;
+  virtual Status Write(const WriteOptions& options, WriteBatch* updates) override;
 
   // =============================================================================================
   // ITERATOR METHODS
@@ -248,16 +981,28 @@ public:
   // should be deleted before this db is deleted.
   using DB::NewIterator;
   virtual Iterator* NewIterator(const ReadOptions& options,
-                                ColumnFamilyHandle* column_family) override { return nullptr; }
+                                ColumnFamilyHandle* column_family) override {
+    return TreeFor(column_family)->NewIterator(options.snapshot);
+  }
 
   // Returns iterators from a consistent database state across multiple column families.
   // Iterators are heap allocated and need to be deleted before the db is deleted.
   virtual Status NewIterators(const ReadOptions& options,
                               const std::vector<ColumnFamilyHandle*>& column_families,
-                              std::vector<Iterator*>* iterators) NOOPE;
+                              std::vector<Iterator*>* iterators) override {
+    iterators->clear();
+    for (size_t i = 0; i < column_families.size(); i++) {
+      iterators->push_back(TreeFor(column_families[i])->NewIterator(options.snapshot));
+    }
+    return Status::OK();
+  }
 
   // Returns the sequence number of the most recent transaction.
-  virtual SequenceNumber GetLatestSequenceNumber() const override { return 0; }
+  // ScreeDB numbers writes from zero each time the pool is opened, since snapshots don't
+  // survive a close, and a write batch takes as many numbers as it holds updates.
+  virtual SequenceNumber GetLatestSequenceNumber() const override {
+    return dbtree->GetLatestSequenceNumber();
+  }
 
   // Sets iter to an iterator that is positioned at a write-batch containing seq_number.
   // If the sequence number is non existent, it returns an iterator at the first available
@@ -278,26 +1023,37 @@ public:
   // observe a stable snapshot of the current DB state.  The caller must call
   // ReleaseSnapshot(result) when the snapshot is no longer needed.
   // nullptr will be returned if the DB fails to take a snapshot or does not support snapshot.
-  virtual const Snapshot* GetSnapshot() override { return nullptr; }
+  //
+  // ScreeDB snapshots cover every column family and cost nothing until keys are written.
+  // The first write to a key after a live snapshot copies the key's previous value (or notes
+  // its absence) into DRAM, and readers of the snapshot prefer that copy. So each live
+  // snapshot holds at most one version per key written since it was taken, costing the key
+  // and value bytes plus sizeof(ScreeDBVersion) and a map node.
+  // See "rocksdb.screedb.snapshot-bytes".
+  virtual const Snapshot* GetSnapshot() override { return dbtree->GetSnapshot(); }
 
   // Release a previously acquired snapshot.  The caller must not use snapshot after this call.
-  virtual void ReleaseSnapshot(const Snapshot* snapshot) override {}
+  virtual void ReleaseSnapshot(const Snapshot* snapshot) override;
 
   // =============================================================================================
   // COLUMN FAMILY METHODS
   // =============================================================================================
 
   // Create a column_family and return the handle of column family through the argument handle.
+  // Each family is a separate tree in the same pool, ordered by its own comparator.
   virtual Status CreateColumnFamily(const ColumnFamilyOptions& options,
                                     const std::string& column_family_name,
-                                    ColumnFamilyHandle** handle) NOOPE;
+                                    ColumnFamilyHandle** handle) override;
 
   // Returns default column family.
-  virtual ColumnFamilyHandle* DefaultColumnFamily() const override { return nullptr; }
+  virtual ColumnFamilyHandle* DefaultColumnFamily() const override { return dbdefault; }
 
   // Drop a column family specified by column_family handle. This call only records a drop
   // record in the manifest and prevents the column family from flushing and compacting.
-  virtual Status DropColumnFamily(ColumnFamilyHandle* column_family) NOOPE;
+  // ScreeDB moves the family to a dropped list in constant time, and its leaves are freed
+  // when the handle is deleted (or on the next open, if interrupted). Until then the handle
+  // still reads and writes the dropped tree, but write batches can no longer name it.
+  virtual Status DropColumnFamily(ColumnFamilyHandle* column_family) override;
 
   // Obtains the meta data of the specified column family of the DB. Status::NotFound() will be
   // returned if the current DB does not have any column family match the specified name.
@@ -311,9 +1067,10 @@ public:
   // =============================================================================================
 
   // Like GetIntProperty(), but returns the aggregated int property from all column families.
+  // ScreeDB sums counts over open families, takes the deepest tree for
+  // "rocksdb.screedb.tree-depth", and reports pool-wide properties once.
   using DB::GetAggregatedIntProperty;
-  virtual bool GetAggregatedIntProperty(const Slice& property,
-                                        uint64_t* value) override { return false; }
+  virtual bool GetAggregatedIntProperty(const Slice& property, uint64_t* value) override;
 
   // Like GetProperty(), but only works for a subset of properties whose return value is an
   // integer. Return the value by integer. Supported properties:
@@ -341,17 +1098,42 @@ public:
   //  "rocksdb.estimate-pending-compaction-bytes"
   //  "rocksdb.num-running-compactions"
   //  "rocksdb.num-running-flushes"
+  // ScreeDB supports only:
+  //  "rocksdb.screedb.num-leaves" (leaves in the tree)
+  //  "rocksdb.screedb.num-keys" (keys in all leaves)
+  //  "rocksdb.screedb.orphaned-string-bytes" (long strings in unused slots: mostly values
+  //      still pinned when replaced or deleted, plus strings left by a crash, until freed)
+  //  "rocksdb.screedb.cache-hits" (reads answered from the value cache)
+  //  "rocksdb.screedb.cache-misses" (reads that searched leaves with the value cache enabled)
+  //  "rocksdb.screedb.cache-usage" (bytes charged to the value cache)
+  //  "rocksdb.screedb.num-snapshots" (live snapshots across all column families)
+  //  "rocksdb.screedb.snapshot-bytes" (keys and values copied for live snapshots in the family)
+  //  "rocksdb.screedb.tree-depth" (levels from the top node down to leaves, 0 when empty)
+  //  "rocksdb.screedb.pmem-bytes-used" (persistent leaves and their long strings in the family)
+  //  "rocksdb.screedb.pmem-bytes-free" (pool file bytes not used by leaves of open families)
+  //  "rocksdb.screedb.transactions" (outermost persistent transactions run for the family)
+  //  "rocksdb.screedb.leaf-splits" (leaves split to make room)
+  //  "rocksdb.screedb.hash-matches" (leaf slots whose hash matched a searched key)
+  //  "rocksdb.screedb.hash-false-positives" (matching slots that held a different key)
+  //  "rocksdb.screedb.key-may-exist-calls" (calls to KeyMayExist for the family)
+  //  "rocksdb.screedb.key-may-exist-negatives" (calls to KeyMayExist that found the key absent)
   using DB::GetIntProperty;
   virtual bool GetIntProperty(ColumnFamilyHandle* column_family, const Slice& property,
-                              uint64_t* value) override { return false; }
+                              uint64_t* value) override;
 
   // DB implementations can export properties about their state via this method. If "property"
   // is a valid property understood by this DB implementation (see Properties struct above
   // for valid options), fills "*value" with its current value and returns true.
-  // Otherwise, returns false.
+  // Otherwise, returns false. ScreeDB supports the integer properties listed above, and:
+  //  "rocksdb.screedb.leaf-fill-factor" (fraction of leaf slots holding keys)
+  //  "rocksdb.screedb.hash-false-positive-rate" (fraction of hash matches that held a
+  //      different key)
+  //  "rocksdb.screedb.key-may-exist-false-positive-rate" (fraction of leaf searches for
+  //      missing keys that matched some slot's hash, so KeyMayExist without a hash index
+  //      returns true)
   using DB::GetProperty;
   virtual bool GetProperty(ColumnFamilyHandle* column_family,
-                           const Slice& property, std::string* value) override { return false; }
+                           const Slice& property, std::string* value) override;
 
   // =============================================================================================
   // CONFIGURATION METHODS
@@ -429,11 +1211,20 @@ public:
   // (1) Key range in loaded table file can't overlap with existing keys or tombstones in DB.
   // (2) No other writes are allowed during AddFile call, otherwise DB may get corrupted.
   // (3) No snapshots are held.
+  // Keys and values are copied from the file into the pool, so the file is always read (and
+  // must match the entry count and key range of ExternalSstFileInfo), and is deleted
+  // afterwards when moved. See BulkLoad for how they are added.
   using DB::AddFile;
   virtual Status AddFile(ColumnFamilyHandle* column_family, const ExternalSstFileInfo* file_info,
-                         bool move_file) NOOPE;
+                         bool move_file) override;
   virtual Status AddFile(ColumnFamilyHandle* column_family,
-                         const std::string& file_path, bool move_file) NOOPE;
+                         const std::string& file_path, bool move_file) override;
+
+  // Load sorted keys and values from "source" into "column_family" with the same limits as
+  // AddFile, which reads table files with this. Entries are packed into full leaves outside
+  // the tree and published together in one transaction, so either all are added or none are
+  // (even after a crash). Keys must be strictly ascending in the column family's order.
+  Status BulkLoad(ColumnFamilyHandle* column_family, Iterator* source);
 
   // CompactFiles() inputs a list of files specified by file numbers and compacts them to the
   // specified level. Note that the behavior is different from CompactRange() in that this
@@ -461,10 +1252,15 @@ public:
   // not be appropriate for hosting all the files. In this case, client could set
   // options.change_level to true, to move the files back to the minimum level capable of
   // holding the data set or a given level (specified by non-negative options.target_level).
+  //
+  // ScreeDB merges sparse neighbouring leaves in the range instead, while other threads
+  // continue reading and writing, so this may be called periodically to reclaim space.
   using DB::CompactRange;
   virtual Status CompactRange(const CompactRangeOptions& options,
                               ColumnFamilyHandle* column_family,
-                              const Slice* begin, const Slice* end) NOOPE;
+                              const Slice* begin, const Slice* end) override {
+    return TreeFor(column_family)->Compact(begin, end);
+  }
 
   // Delete the file name from the db directory and update the internal state to reflect that.
   // Supports deletion of sst and log files only. 'name' must be path relative to the db
@@ -525,14 +1321,32 @@ public:
 
 protected:
   // Hide constructor, call Open() to create instead
-  ScreeDB(const Options& options, const std::string& dbname);
+  ScreeDB(const Options& options, const ScreeDBOptions& screedb_options,
+          const std::string& dbname);
 
 private:
   ScreeDB(const ScreeDB&);                                               // prevent copying
   void operator=(const ScreeDB&);                                        // prevent assignment
+  void CloseFamily(ScreeDBColumnFamilyHandle* handle);
+  bool GetTreeIntProperty(ScreeDBTree* tree, const Slice& property, uint64_t* value);
+  Status LoadFile(ColumnFamilyHandle* column_family, const std::string& file_path,
+                  const ExternalSstFileInfo* file_info, bool move_file);
+  void RecordTick(const uint32_t ticker, const uint64_t count = 1) const {
+    if (dbstats) dbstats->recordTick(ticker, count);
+  }
+  ScreeDBTree* TreeFor(ColumnFamilyHandle* column_family) const {
+    return column_family ? ((ScreeDBColumnFamilyHandle*) column_family)->GetTree() : dbtree;
+  }
+  void UpdateTrees(ScreeDBTree* added, ScreeDBTree* removed);
   const std::string dbname;                                              // name when opened
   const DBOptions dboptions;                                             // options when opened
-  ScreeDBTree* dbtree;                                                   // persistent tree
+  Statistics* const dbstats;                                             // from options, or null
+  const ScreeDBOptions dbtree_options;                                   // options for trees
+  const std::shared_ptr<MergeOperator> dbmerge_operator;                 // keeps operator alive
+  ScreeDBTree* dbtree;                                                   // default family tree
+  ScreeDBColumnFamilyHandle* dbdefault;                                  // default family handle
+  std::mutex dbfamilies_mutex;                                           // serializes families
+  std::shared_ptr<const std::map<uint32_t, ScreeDBTree*>> dbtrees;       // open trees by id
 };
 
 } // namespace screedb
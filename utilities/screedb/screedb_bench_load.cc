@@ -0,0 +1,151 @@
+/*
+ * Copyright 2016, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+// Benchmark comparing loading sorted keys with Put, BulkLoad and AddFile.
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sys/time.h>
+#include "rocksdb/sst_file_writer.h"
+#include "screedb.h"
+
+#define LOG(msg) std::cout << msg << "\n"
+
+using namespace rocksdb;
+using namespace rocksdb::screedb;
+
+const int COUNT = 3100000;
+const std::string PATH = "/dev/shm/screedb";
+const std::string SST_PATH = "/dev/shm/screedb.sst";
+
+unsigned long current_millis() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long long) (tv.tv_sec) * 1000 + (unsigned long long) (tv.tv_usec) / 1000;
+}
+
+class VectorSource : public Iterator {                     // sorted keys, each its own value
+public:
+  explicit VectorSource(const std::vector<std::string>& keys) : keys_(keys) {}
+  bool Valid() const override { return pos_ < keys_.size(); }
+  void SeekToFirst() override { pos_ = 0; }
+  void SeekToLast() override { pos_ = keys_.size() - 1; }
+  void Seek(const Slice& target) override {
+    pos_ = std::lower_bound(keys_.begin(), keys_.end(), target.ToString()) - keys_.begin();
+  }
+  void Next() override { pos_++; }
+  void Prev() override { pos_ = pos_ > 0 ? pos_ - 1 : keys_.size(); }
+  Slice key() const override { return keys_[pos_]; }
+  Slice value() const override { return keys_[pos_]; }
+  Status status() const override { return Status::OK(); }
+private:
+  const std::vector<std::string>& keys_;
+  size_t pos_ = 0;
+};
+
+void Report(const std::string& label, const unsigned long started, ScreeDB* db) {
+  const auto millis = current_millis() - started;
+  std::string leaves, splits, transactions;
+  db->GetProperty("rocksdb.screedb.num-leaves", &leaves);
+  db->GetProperty("rocksdb.screedb.leaf-splits", &splits);
+  db->GetProperty("rocksdb.screedb.transactions", &transactions);
+  LOG("   " << label << " in " << millis << " ms (" << leaves << " leaves, " << splits
+             << " splits, " << transactions << " transactions)");
+}
+
+ScreeDB* Open() {
+  std::remove(PATH.c_str());
+  ScreeDB* db;
+  Status s = ScreeDB::Open(Options(), PATH, &db);
+  if (!s.ok()) LOG("!!! could not open: " << s.ToString());
+  return db;
+}
+
+void Verify(ScreeDB* db, const std::vector<std::string>& probes) {
+  size_t found = 0;
+  std::string value;
+  for (auto& probe : probes) {
+    if (db->Get(ReadOptions(), probe, &value).ok() && value == probe) found++;
+    value.clear();
+  }
+  if (found != probes.size()) LOG("!!! found " << found << " of " << probes.size() << " keys");
+}
+
+int main() {
+  LOG("Generating " << COUNT << " sorted keys");
+  std::mt19937_64 random(42);
+  std::vector<std::string> keys;
+  for (int i = 0; i < COUNT; i++) keys.push_back(std::to_string(random()));
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+  std::vector<std::string> probes;
+  for (int i = 0; i < 100000; i++) probes.push_back(keys[random() % keys.size()]);
+
+  LOG("Loading with Put");
+  auto db = Open();
+  auto started = current_millis();
+  for (auto& key : keys) db->Put(WriteOptions(), key, key);
+  Report("put", started, db);
+  Verify(db, probes);
+  delete db;
+
+  LOG("Loading with BulkLoad");
+  db = Open();
+  VectorSource source(keys);
+  started = current_millis();
+  Status s = db->BulkLoad(nullptr, &source);
+  if (!s.ok()) LOG("!!! bulk load failed: " << s.ToString());
+  Report("bulk load", started, db);
+  Verify(db, probes);
+  delete db;
+
+  LOG("Loading with AddFile");
+  const Options options;
+  SstFileWriter writer(EnvOptions(), ImmutableCFOptions(options), options.comparator);
+  writer.Open(SST_PATH);
+  for (auto& key : keys) writer.Add(key, key);
+  writer.Finish();
+  db = Open();
+  started = current_millis();
+  s = db->AddFile(SST_PATH, true);
+  if (!s.ok()) LOG("!!! add file failed: " << s.ToString());
+  Report("add file", started, db);
+  Verify(db, probes);
+  delete db;
+
+  std::remove(PATH.c_str());
+  std::remove(SST_PATH.c_str());
+  LOG("Finished");
+  return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2016, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Benchmark comparing point lookups through inner nodes and through the hash index.
+
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <sys/time.h>
+#include "screedb.h"
+
+#define LOG(msg) std::cout << msg << "\n"
+
+using namespace rocksdb::screedb;
+
+const int COUNT = 3100000;
+const int SEARCHES = 2000000;
+const std::string PATH = "/dev/shm/screedb";
+
+unsigned long current_millis() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long long) (tv.tv_sec) * 1000 + (unsigned long long) (tv.tv_usec) / 1000;
+}
+
+ScreeDBTree* Open(const bool hash_index) {
+  ScreeDBOptions options;
+  options.hash_index = hash_index;
+  auto started = current_millis();
+  auto tree = new ScreeDBTree(PATH, rocksdb::BytewiseComparator(), options);
+  LOG("   opened in " << current_millis() - started << " ms");
+  return tree;
+}
+
+void Time(const std::string& label, ScreeDBTree* tree, const std::vector<std::string>& probes) {
+  auto started = current_millis();
+  size_t found = 0;
+  std::string value;
+  for (auto& probe : probes) {
+    if (tree->Get(probe, &value).ok()) found++;
+    value.clear();
+  }
+  LOG("   " << label << " in " << current_millis() - started << " ms (" << found << " found)");
+}
+
+void TestLookups(const std::string& mode, ScreeDBTree* tree,
+                 const std::vector<std::string>& hits, const std::vector<std::string>& misses) {
+  Time(mode + " existing keys", tree, hits);
+  Time(mode + " missing keys", tree, misses);
+}
+
+int main() {
+  LOG("Generating " << COUNT << " keys");
+  std::mt19937_64 random(42);
+  std::vector<std::string> keys;
+  for (int i = 0; i < COUNT; i++) keys.push_back(std::to_string(random()));
+  std::vector<std::string> hits;
+  std::vector<std::string> misses;
+  for (int i = 0; i < SEARCHES; i++) {
+    hits.push_back(keys[random() % keys.size()]);
+    misses.push_back(std::to_string(random()) + "?");
+  }
+
+  LOG("Inserting " << COUNT << " keys");
+  std::remove(PATH.c_str());
+  auto tree = Open(false);
+  auto started = current_millis();
+  for (auto& key : keys) tree->Put(key, key);
+  LOG("   inserted in " << current_millis() - started << " ms");
+
+  LOG("Searching inner nodes " << SEARCHES << " times");
+  TestLookups("inner nodes", tree, hits, misses);
+  delete tree;
+
+  LOG("Searching hash index " << SEARCHES << " times");
+  tree = Open(true);                                       // index is rebuilt by recovery
+  TestLookups("hash index", tree, hits, misses);
+  delete tree;
+
+  std::remove(PATH.c_str());
+  LOG("Finished");
+  return 0;
+}
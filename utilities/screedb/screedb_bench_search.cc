@@ -0,0 +1,202 @@
+/*
+ * Copyright 2016, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Microbenchmark comparing descent through inner nodes of different layouts.
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sys/time.h>
+#include "screedb.h"
+
+#define LOG(msg) std::cout << msg << "\n"
+
+using rocksdb::Slice;
+using namespace rocksdb::screedb;
+
+const int COUNT = 3100000;
+const int SEARCHES = 2000000;
+
+unsigned long current_millis() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (unsigned long long) (tv.tv_sec) * 1000 + (unsigned long long) (tv.tv_usec) / 1000;
+}
+
+// =============================================================================================
+// LEGACY LAYOUT (FOUR STRING KEYS PER NODE, LINEAR STRCMP)
+// =============================================================================================
+
+struct LegacyInnerNode : ScreeDBNode {
+  uint8_t keycount;
+  std::string keys[4];
+  ScreeDBNode* children[5];
+};
+
+ScreeDBNode* LegacySearch(ScreeDBNode* node, const Slice& key) {
+  bool matched;
+  while (!node->is_leaf) {
+    matched = false;
+    LegacyInnerNode* inner = (LegacyInnerNode*) node;
+    const uint8_t keycount = inner->keycount;
+    for (uint8_t idx = 0; idx < keycount; idx++) {
+      node = inner->children[idx];
+      if (strcmp(key.data_, inner->keys[idx].c_str()) <= 0) {
+        matched = true;
+        break;
+      }
+    }
+    if (!matched) node = inner->children[keycount];
+  }
+  return node;
+}
+
+// =============================================================================================
+// BUILDING TREES OVER THE SAME LEAVES
+// =============================================================================================
+
+struct LevelEntry {
+  ScreeDBNode* node;                                       // node at this level
+  const std::string* max_key;                              // highest key beneath node
+};
+
+void SetLegacyKey(LegacyInnerNode* inner, int idx, const std::string* key, ScreeDBKeyArena*) {
+  inner->keys[idx] = *key;
+}
+
+template<int KEYS>
+void SetArenaKey(ScreeDBInnerNodeT<KEYS>* inner, int idx, const std::string* key,
+                 ScreeDBKeyArena* arena) {
+  inner->SetKey(idx, arena->Add(*key));
+}
+
+template<typename NodeT, int KEYS, typename SetKeyFn>
+ScreeDBNode* Build(std::vector<LevelEntry> level, ScreeDBKeyArena* arena, SetKeyFn set_key,
+                   std::vector<ScreeDBNode*>* allocated) {
+  while (level.size() > 1) {
+    std::vector<LevelEntry> parents;
+    for (size_t first = 0; first < level.size(); first += KEYS + 1) {
+      const size_t count = std::min((size_t) KEYS + 1, level.size() - first);
+      auto inner = new NodeT();
+      allocated->push_back(inner);
+      inner->keycount = (uint16_t) (count - 1);
+      for (size_t i = 0; i < count; i++) {
+        inner->children[i] = level[first + i].node;
+        if (i < count - 1) set_key(inner, (int) i, level[first + i].max_key, arena);
+      }
+      parents.push_back({inner, level[first + count - 1].max_key});
+    }
+    level.swap(parents);
+  }
+  return level[0].node;
+}
+
+// =============================================================================================
+// TIMING DESCENTS
+// =============================================================================================
+
+template<typename SearchFn>
+ScreeDBNode* Time(const std::string& label, const std::vector<std::string>& probes,
+                  SearchFn search) {
+  auto started = current_millis();
+  uintptr_t checksum = 0;
+  for (auto& probe : probes) checksum += (uintptr_t) search(Slice(probe));
+  LOG("   " << label << " in " << current_millis() - started << " ms");
+  return (ScreeDBNode*) checksum;
+}
+
+template<int KEYS>
+void TestFanout(const std::vector<LevelEntry>& leaves, const std::vector<std::string>& probes,
+                ScreeDBNode* expected) {
+  ScreeDBKeyArena arena;
+  std::vector<ScreeDBNode*> allocated;
+  auto top = Build<ScreeDBInnerNodeT<KEYS>, KEYS>(leaves, &arena, SetArenaKey<KEYS>, &allocated);
+  auto checksum = Time("fanout " + std::to_string(KEYS + 1), probes, [&](const Slice& key) {
+    const uint64_t prefix = ScreeDBKeyPrefix(key.data(), key.size());
+    ScreeDBNode* node = top;
+    while (!node->is_leaf) {
+      auto inner = (ScreeDBInnerNodeT<KEYS>*) node;
+      node = inner->children[inner->FindChildScalar(key, prefix)];
+    }
+    return node;
+  });
+  if (checksum != expected) LOG("!!! fanout " << (KEYS + 1) << " found different leaves");
+#if SCREEDB_VECTOR_SEARCH
+  checksum = Time("fanout " + std::to_string(KEYS + 1) + " vector", probes, [&](const Slice& key) {
+    const uint64_t prefix = ScreeDBKeyPrefix(key.data(), key.size());
+    ScreeDBNode* node = top;
+    while (!node->is_leaf) {
+      auto inner = (ScreeDBInnerNodeT<KEYS>*) node;
+      node = inner->children[inner->FindChildVector(key, prefix)];
+    }
+    return node;
+  });
+  if (checksum != expected) LOG("!!! fanout " << (KEYS + 1) << " vector found different leaves");
+#endif
+  for (auto node : allocated) delete (ScreeDBInnerNodeT<KEYS>*) node;
+}
+
+int main() {
+  LOG("Generating " << COUNT << " keys");
+  std::mt19937_64 random(42);
+  std::vector<std::string> keys;
+  for (int i = 0; i < COUNT; i++) keys.push_back(std::to_string(random()));
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  std::vector<LevelEntry> leaves;
+  for (size_t first = 0; first < keys.size(); first += NODE_KEYS) {
+    auto leaf = new ScreeDBNode();
+    leaf->is_leaf = true;
+    leaves.push_back({leaf, &keys[std::min(first + NODE_KEYS, keys.size()) - 1]});
+  }
+  std::vector<std::string> probes;
+  for (int i = 0; i < SEARCHES; i++) probes.push_back(keys[random() % keys.size()]);
+  LOG("Searching " << leaves.size() << " leaves " << SEARCHES << " times");
+
+  std::vector<ScreeDBNode*> allocated;
+  auto legacy = Build<LegacyInnerNode, 4>(leaves, nullptr, SetLegacyKey, &allocated);
+  auto expected = Time("legacy fanout 5", probes, [&](const Slice& key) {
+    return LegacySearch(legacy, key);
+  });
+  for (auto node : allocated) delete (LegacyInnerNode*) node;
+
+  TestFanout<4>(leaves, probes, expected);
+  TestFanout<16>(leaves, probes, expected);
+  TestFanout<64>(leaves, probes, expected);
+  TestFanout<256>(leaves, probes, expected);
+
+  for (auto& leaf : leaves) delete leaf.node;
+  LOG("Finished");
+  return 0;
+}
@@ -43,6 +43,7 @@ using namespace rocksdb::screedb;
 
 #define CLASS ScreeDB                    // "ScreeDB" or "DB"
 const unsigned long COUNT = 30000000;    // 1M or 30M or 90M
+const unsigned long BATCH = 1000;        // updates per write batch
 
 unsigned long current_millis() {
   struct timeval tv;
@@ -63,6 +64,30 @@ void testGet(DB* impl) {
   LOG("   in " << current_millis() - started << " ms");
 }
 
+void testPutBatch(DB* impl) {
+  auto started = current_millis();
+  WriteBatch batch;
+  for (int i = 0; i < COUNT; i++) {
+    std::string str = std::to_string(i);
+    batch.Put(str, str);
+    if (batch.Count() == BATCH) {
+      impl->Write(WriteOptions(), &batch);
+      batch.Clear();
+    }
+  }
+  impl->Write(WriteOptions(), &batch);
+  LOG("   in " << current_millis() - started << " ms");
+}
+
+void testScan(DB* impl) {
+  auto started = current_millis();
+  unsigned long count = 0;
+  Iterator* it = impl->NewIterator(ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) count++;
+  delete it;
+  LOG("   " << count << " values in " << current_millis() - started << " ms");
+}
+
 void testPut(DB* impl) {
   auto started = current_millis();
   for (int i = 0; i < COUNT; i++) {
@@ -85,12 +110,18 @@ int main() {
   testPut(impl);
   LOG("Getting " << COUNT << " values");
   testGet(impl);
+  LOG("Scanning " << COUNT << " values");
+  testScan(impl);
   LOG("Updating " << COUNT << " values");
   testPut(impl);
   LOG("Deleting " << COUNT << " values");
   testDelete(impl);
   LOG("Reinserting " << COUNT << " values");
   testPut(impl);
+  LOG("Deleting " << COUNT << " values");
+  testDelete(impl);
+  LOG("Reinserting " << COUNT << " values in batches of " << BATCH);
+  testPutBatch(impl);
 
   LOG("Closing");
   delete impl;
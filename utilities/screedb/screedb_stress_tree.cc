@@ -32,7 +32,10 @@
 
 // Stress test for persistent tree using NVML backend.
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
+#include <vector>
 #include <sys/time.h>
 #include "screedb.h"
 
@@ -53,17 +56,27 @@ unsigned long current_millis() {
   return (unsigned long long) (tv.tv_sec) * 1000 + (unsigned long long) (tv.tv_usec) / 1000;
 }
 
+void log_elapsed(const unsigned long started, const char* op) {
+  auto elapsed = current_millis() - started;
+  LOG("   in " << elapsed << " ms (" << elapsed * 1000.0 / COUNT << " us per " << op << ")");
+}
+
 ScreeDBTree* open() {
   auto started = current_millis();
   auto impl = new ScreeDBTree(PATH);
   LOG("   in " << current_millis() - started << " ms");
+  auto stats = impl->GetRecoveryStats();
+  LOG("   recovered " << stats.leaves << " leaves with " << stats.threads << " threads: chain="
+                      << stats.chain_micros / 1000 << " ms, scan=" << stats.scan_micros / 1000
+                      << " ms, build="
+                      << stats.build_micros / 1000 << " ms");
   return impl;
 }
 
 void testDelete(ScreeDBTree* impl) {
   auto started = current_millis();
   for (int i = 0; i < COUNT; i++) { impl->Delete(std::to_string(i)); }
-  LOG("   in " << current_millis() - started << " ms");
+  log_elapsed(started, "delete");
 }
 
 void testGet(ScreeDBTree* impl) {
@@ -72,13 +85,45 @@ void testGet(ScreeDBTree* impl) {
     std::string value;
     impl->Get(std::to_string(i), &value);
   }
-  LOG("   in " << current_millis() - started << " ms");
+  log_elapsed(started, "get");
 }
 
 void testPut(ScreeDBTree* impl) {
   auto started = current_millis();
   for (int i = 0; i < COUNT; i++) impl->Put(std::to_string(i), std::to_string(i) + LOREM_IPSUM_120);
-  LOG("   in " << current_millis() - started << " ms");
+  log_elapsed(started, "put");
+}
+
+void testThreaded(ScreeDBTree* impl, const unsigned threads, const bool put) {
+  auto started = current_millis();
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([impl, threads, put, t] {
+      std::string value;
+      for (unsigned long i = t; i < COUNT; i += threads) {
+        const std::string istr = std::to_string(i);
+        if (put) impl->Put(istr, istr + LOREM_IPSUM_120);
+        else impl->Get(istr, &value);
+        value.clear();
+      }
+    });
+  }
+  for (auto& worker : workers) worker.join();
+  auto elapsed = current_millis() - started;
+  LOG("   " << threads << " threads in " << elapsed << " ms ("
+            << (elapsed ? COUNT * 1000 / elapsed : 0) << " ops/sec)");
+}
+
+void testScaling(ScreeDBTree* impl) {
+  const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+  LOG("Getting " << COUNT << " values with up to " << max_threads << " threads");
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    testThreaded(impl, threads, false);
+  }
+  LOG("Updating " << COUNT << " values with up to " << max_threads << " threads");
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    testThreaded(impl, threads, true);
+  }
 }
 
 int main() {
@@ -100,6 +145,7 @@ int main() {
   testDelete(impl);
   LOG("Reinserting " << COUNT << " values");
   testPut(impl);
+  testScaling(impl);
   delete impl;
 
   LOG("\nFinished");
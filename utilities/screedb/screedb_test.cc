@@ -32,7 +32,14 @@
 
 // Unit tests for RocksDB database using NVML backend.
 
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+#include "rocksdb/sst_file_writer.h"
+#include "util/coding.h"
 #include "screedb.h"
+#include "../merge_operators.h"
 #include "gtest/gtest.h"
 
 using namespace rocksdb;
@@ -75,14 +82,39 @@ private:
 
 TEST_F(ScreeDBTest, SizeofTest) {
   // persistent types
-  ASSERT_TRUE(sizeof(ScreeDBRoot) == 32);
-  ASSERT_TRUE(sizeof(ScreeDBLeaf) == 3136);
+  ASSERT_TRUE(sizeof(ScreeDBRoot) == 32 + SSO_SIZE + 16 + 48);
+  ASSERT_TRUE(sizeof(ScreeDBFamily) == 8 + 2 * (SSO_SIZE + 16) + 32);
+  ASSERT_TRUE(sizeof(ScreeDBLeaf) == 64 + NODE_KEYS * 2 * (SSO_SIZE + 16));
   ASSERT_TRUE(sizeof_field(ScreeDBLeaf, hashes) + sizeof_field(ScreeDBLeaf, next) == 64);
-  ASSERT_TRUE(sizeof(ScreeDBString) == 32);
+  ASSERT_TRUE(sizeof(ScreeDBString) == SSO_SIZE + 16);
 
   // volatile types
-  ASSERT_TRUE(sizeof(ScreeDBInnerNode) == 232);
-  ASSERT_TRUE(sizeof(ScreeDBLeafNode) == 88);
+  ASSERT_TRUE(sizeof(ScreeDBInnerNode) == 1600);
+  ASSERT_TRUE(sizeof(ScreeDBLeafNode) == 64 + sizeof_field(ScreeDBLeafNode, hashes));
+}
+
+TEST_F(ScreeDBTest, BinaryKeysAndValuesTest) {
+  const std::string key1("a\0b", 3);
+  const std::string key2("a\0c", 3);
+  const std::string long_key("long key with \0 past the short string limit", 43);
+  const std::string value1("\0\x01\x02", 3);
+  const std::string long_value(std::string(100, '\0') + "tail");
+  ASSERT_TRUE(db->Put(WriteOptions(), key1, value1).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), key2, long_value).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), long_key, value1).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "a", "not truncated").ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), key1, &value).ok() && value == value1);
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), key2, &value).ok() && value == long_value);
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), long_key, &value).ok() && value == value1);
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), "a", &value).ok() && value == "not truncated");
+  ASSERT_TRUE(db->Delete(WriteOptions(), key1).ok());
+  ASSERT_TRUE(db->Get(ReadOptions(), key1, &value).IsNotFound());
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), key2, &value).ok() && value == long_value);
 }
 
 TEST_F(ScreeDBTest, DeleteAllTest) {
@@ -167,6 +199,40 @@ TEST_F(ScreeDBTest, GetMultipleAfterDeleteTest) {
   ASSERT_TRUE(db->Get(ReadOptions(), "key3", &value3).ok() && value3 == "VALUE3");
 }
 
+TEST_F(ScreeDBTest, GetInPlaceTest) {
+  const std::string long_value(4096, 'x');
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", long_value).ok());
+  int visits = 0;
+  ASSERT_TRUE(db->GetInPlace(ReadOptions(), nullptr, "key1", [&](const Slice& value) {
+    visits++;
+    ASSERT_TRUE(value == long_value);
+  }).ok());
+  ASSERT_TRUE(db->GetInPlace(ReadOptions(), nullptr, "waldo", [&](const Slice& value) {
+    visits++;
+  }).IsNotFound());
+  ASSERT_TRUE(visits == 1);
+}
+
+TEST_F(ScreeDBTest, GetPinnedTest) {
+  const std::string long_value(4096, 'x');
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", long_value).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key2", "short").ok());
+  ScreeDBPinnedValue pinned;
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "key1", &pinned).ok());
+  ASSERT_TRUE(pinned.IsPinned() && pinned.value() == long_value);
+  ScreeDBPinnedValue again;                                              // same value twice
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "key1", &again).ok());
+  ASSERT_TRUE(again.IsPinned() && again.value().data() == pinned.value().data());
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "key2", &pinned).ok());
+  ASSERT_TRUE(!pinned.IsPinned() && pinned.value() == "short");          // copied when short
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "waldo", &pinned).IsNotFound());
+  ASSERT_TRUE(!pinned.IsPinned() && pinned.value().empty());
+  again.Reset();
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "replaced").ok());         // no pins remain
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "key1", &pinned).ok());
+  ASSERT_TRUE(pinned.value() == "replaced");
+}
+
 TEST_F(ScreeDBTest, GetNonexistentTest) {
   ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
   std::string value;
@@ -215,6 +281,32 @@ TEST_F(ScreeDBTest, PutExistingTest) {
   ASSERT_TRUE(db->Get(ReadOptions(), "key1", &new_value3).ok() && new_value3 == "?");
 }
 
+TEST_F(ScreeDBTest, PutFillsEverySlotTest) {
+  for (int i = 0; i < NODE_KEYS; i++) {                                  // fill without split
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  for (int i = 0; i < NODE_KEYS; i += 2) {                               // empty every other slot
+    ASSERT_TRUE(db->Delete(WriteOptions(), std::to_string(i)).ok());
+  }
+  for (int i = 0; i < NODE_KEYS; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    if (i % 2 == 0) ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).IsNotFound());
+    else ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+  }
+  for (int i = 0; i < NODE_KEYS; i += 2) {                               // refill empty slots
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "?").ok());
+  }
+  for (int i = 0; i < NODE_KEYS; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok());
+    ASSERT_TRUE(value == istr + (i % 2 == 0 ? "?" : "!"));
+  }
+}
+
 TEST_F(ScreeDBTest, PutKeysOfDifferentLengthsTest) {
   std::string value;
   ASSERT_TRUE(db->Put(WriteOptions(), "123456789ABCDE", "A").ok());      // 2 under the sso limit
@@ -259,17 +351,90 @@ TEST_F(ScreeDBTest, PutValuesOfDifferentLengthsTest) {
   ASSERT_TRUE(db->Get(ReadOptions(), "E", &value5).ok() && value5 == "123456789ABCDEFGHI");
 }
 
+TEST_F(ScreeDBTest, PutValuesResizedInPlaceTest) {
+  const size_t lengths[] = {100, 112, 97, 60, 100, 16, 15, 300, 257, 1000, 129, 100};
+  for (int i = 0; i < NODE_KEYS; i++) {
+    std::string istr = std::to_string(i);
+    for (size_t length : lengths) {                                      // grow, shrink, cross sso
+      std::string expected = istr + std::string(length - istr.size(), 'a' + length % 26);
+      std::string value;
+      ASSERT_TRUE(db->Put(WriteOptions(), istr, expected).ok());
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == expected);
+    }
+  }
+  Reopen();
+  for (int i = 0; i < NODE_KEYS; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok());
+    ASSERT_TRUE(value == istr + std::string(100 - istr.size(), 'a' + 100 % 26));
+  }
+}
+
+TEST_F(ScreeDBTest, StringSizeClassTest) {
+  ASSERT_TRUE(ScreeDBString::size_class(SSO_CHARS + 1) == SSO_CHARS + 1);
+  ASSERT_TRUE(ScreeDBString::size_class(17) == 32);
+  ASSERT_TRUE(ScreeDBString::size_class(128) == 128);
+  ASSERT_TRUE(ScreeDBString::size_class(129) == 160);
+  ASSERT_TRUE(ScreeDBString::size_class(1000) == 1024);
+  ASSERT_TRUE(ScreeDBString::size_class(1025) == 1280);
+  for (size_t size = SSO_CHARS + 1; size < 100000; size++) {             // little slack, no gaps
+    const size_t size_class = ScreeDBString::size_class(size);
+    ASSERT_TRUE(size_class >= size && size_class <= size + size / 4 + 15);
+    ASSERT_TRUE(ScreeDBString::size_class(size_class) == size_class);
+  }
+}
+
 TEST_F(ScreeDBTest, WriteTest) {
   WriteBatch batch;
   batch.Delete("key1");
+  batch.Put("key3", "value3");
   batch.Put("key2", "value2");
-  ASSERT_TRUE(db->Write(WriteOptions(), &batch).IsNotSupported());
+  batch.Put("key2", "value2b");                                          // last update wins
+  batch.Delete("key3");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), "key2", &value).ok() && value == "value2b");
+  ASSERT_TRUE(db->Get(ReadOptions(), "key3", &value).IsNotFound());
+}
+
+TEST_F(ScreeDBTest, WriteEmptyBatchTest) {
+  WriteBatch batch;
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).IsNotFound());
 }
 
 // =============================================================================================
 // TEST RECOVERY OF SINGLE-LEAF TREE
 // =============================================================================================
 
+TEST_F(ScreeDBTest, BinaryKeysAndValuesAfterRecoveryTest) {
+  for (int i = 0; i < NODE_KEYS * 4; i++) {                              // keys differ after nul
+    const std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), std::string("\0", 1) + istr, istr + '\0').ok());
+  }
+  Reopen();
+  for (int i = 0; i < NODE_KEYS * 4; i++) {
+    const std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), std::string("\0", 1) + istr, &value).ok());
+    ASSERT_TRUE(value == istr + '\0');
+  }
+  int count = 0;
+  std::string last;
+  auto it = db->NewIterator(ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_TRUE(it->key().size() > 1 && it->key()[0] == '\0');
+    ASSERT_TRUE(count == 0 || last < it->key().ToString());
+    last = it->key().ToString();
+    count++;
+  }
+  delete it;
+  ASSERT_TRUE(count == NODE_KEYS * 4);
+}
+
 TEST_F(ScreeDBTest, DeleteHeadlessAfterRecoveryTest) {
   Reopen();
   ASSERT_TRUE(db->Delete(WriteOptions(), "nada").ok());
@@ -397,6 +562,44 @@ TEST_F(ScreeDBTest, SingleInnerNodeDescendingTest2) {
   }
 }
 
+TEST_F(ScreeDBTest, SingleInnerNodeWriteBatchTest) {
+  WriteBatch batch;
+  for (int i = SINGLE_INNER_LIMIT; i > 0; i--) {                         // splits leaves in batch
+    std::string istr = std::to_string(i);
+    batch.Put(istr, istr + "!");
+  }
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  for (int pass = 0; pass < 2; pass++) {                                 // before and after reopen
+    for (int i = 1; i <= SINGLE_INNER_LIMIT; i++) {
+      std::string istr = std::to_string(i);
+      std::string value;
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+    }
+    Reopen();
+  }
+}
+
+TEST_F(ScreeDBTest, SingleInnerNodeMultiGetTest) {
+  for (int i = 1; i <= SINGLE_INNER_LIMIT; i += 2) {                     // odd keys only
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  std::vector<std::string> strings;
+  for (int i = SINGLE_INNER_LIMIT; i >= 1; i -= 3) strings.push_back(std::to_string(i));
+  strings.push_back("1");                                                // duplicate key
+  std::vector<Slice> keys(strings.begin(), strings.end());
+  std::vector<std::string> values(3, "stale");
+  std::vector<Status> status = db->MultiGet(ReadOptions(), keys, &values);
+  ASSERT_TRUE(status.size() == keys.size() && values.size() == keys.size());
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (std::stoi(strings[i]) % 2) {
+      ASSERT_TRUE(status[i].ok() && values[i] == strings[i] + "!");
+    } else {
+      ASSERT_TRUE(status[i].IsNotFound() && values[i].empty());
+    }
+  }
+}
+
 // =============================================================================================
 // TEST RECOVERY OF TREE WITH SINGLE INNER NODE
 // =============================================================================================
@@ -453,6 +656,20 @@ TEST_F(ScreeDBTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
   }
 }
 
+TEST_F(ScreeDBTest, RecoveryStatsTest) {
+  for (int i = 1; i <= NODE_KEYS * 4; i++) {
+    std::string istr = std::to_string(i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  delete db;
+  auto tree = new ScreeDBTree(PATH);
+  auto stats = tree->GetRecoveryStats();
+  delete tree;
+  ASSERT_TRUE(ScreeDB::Open(Options(), PATH, &db).ok());
+  ASSERT_TRUE(stats.leaves > 1);
+  ASSERT_TRUE(stats.threads >= 1);
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -516,3 +733,1991 @@ TEST_F(ScreeDBTest, LargeDescendingAfterRecoveryTest) {
     assert(db->Get(ReadOptions(), istr, &value).ok() && value == ("ABC" + istr));
   }
 }
+
+// =============================================================================================
+// TEST LEAF MERGING AND COMPACTION
+// =============================================================================================
+
+const int COMPACT_LIMIT = NODE_KEYS * 100;
+
+uint64_t IntProperty(ScreeDB* db, const std::string& property) {
+  uint64_t value = 0;
+  bool found = db->GetIntProperty(property, &value);
+  assert(found);
+  return value;
+}
+
+double FillFactor(ScreeDB* db) {
+  std::string value;
+  bool found = db->GetProperty("rocksdb.screedb.leaf-fill-factor", &value);
+  assert(found);
+  return std::stod(value);
+}
+
+void CheckEveryTenthKey(ScreeDB* db) {
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    Status s = db->Get(ReadOptions(), istr, &value);
+    if (i % 10) {
+      ASSERT_TRUE(s.IsNotFound());
+    } else {
+      ASSERT_TRUE(s.ok() && value == istr + "!");
+    }
+  }
+  int count = 0;
+  std::string last;
+  auto it = db->NewIterator(ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_TRUE(it->key().ToString() > last);
+    last = it->key().ToString();
+    count++;
+  }
+  delete it;
+  ASSERT_TRUE(count == COMPACT_LIMIT / 10);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == COMPACT_LIMIT / 10);
+}
+
+TEST_F(ScreeDBTest, DeleteMergesLeavesTest) {
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  ASSERT_TRUE(leaves >= COMPACT_LIMIT / NODE_KEYS);
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    if (i % 10) {
+      ASSERT_TRUE(db->Delete(WriteOptions(), std::to_string(i)).ok());
+    }
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") < leaves / 2);
+  CheckEveryTenthKey(db);
+  Reopen();
+  CheckEveryTenthKey(db);
+}
+
+TEST_F(ScreeDBTest, DeleteAllMergesLeavesTest) {
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 1; i <= COMPACT_LIMIT; i++) {
+      std::string istr = std::to_string(i);
+      ASSERT_TRUE(db->Put(WriteOptions(), istr, istr).ok());
+    }
+    const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+    for (int i = 1; i <= COMPACT_LIMIT; i++) {
+      ASSERT_TRUE(db->Delete(WriteOptions(), std::to_string(i)).ok());
+    }
+    ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == 0);
+    ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") < leaves / 10);
+    auto it = db->NewIterator(ReadOptions());
+    it->SeekToFirst();
+    ASSERT_TRUE(!it->Valid());
+    delete it;
+  }
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
+  Reopen();
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).ok() && value == "value1");
+}
+
+TEST_F(ScreeDBTest, CompactRangeTest) {
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  WriteBatch batch;                                                      // batches don't merge
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    if (i % 10) batch.Delete(std::to_string(i));
+  }
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  const double fill = FillFactor(db);
+  ASSERT_TRUE(fill < 0.2);
+  const Slice begin("2");
+  const Slice end("4");
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), &begin, &end).ok());
+  const uint64_t range_leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  ASSERT_TRUE(range_leaves < leaves && range_leaves > leaves / 2);
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") < range_leaves);
+  ASSERT_TRUE(FillFactor(db) > 2 * fill);
+  CheckEveryTenthKey(db);
+  Reopen();
+  CheckEveryTenthKey(db);
+}
+
+TEST_F(ScreeDBTest, DeleteFreesLongStringsTest) {
+  const std::string padding(100, '.');
+  for (int i = 0; i < NODE_KEYS * 4; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), padding + istr, padding + istr).ok());
+  }
+  WriteBatch batch;
+  for (int i = 0; i < NODE_KEYS * 4; i++) {
+    std::string istr = std::to_string(i);
+    if (i % 2) {
+      ASSERT_TRUE(db->Delete(WriteOptions(), padding + istr).ok());
+    } else {
+      batch.Delete(padding + istr);
+    }
+  }
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  for (int i = 0; i < NODE_KEYS * 4; i++) {                              // reuse freed slots
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, i % 2 ? istr : padding + istr).ok());
+  }
+  Reopen();
+  for (int i = 0; i < NODE_KEYS * 4; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok());
+    ASSERT_TRUE(value == (i % 2 ? istr : padding + istr));
+    ASSERT_TRUE(db->Get(ReadOptions(), padding + istr, &value).IsNotFound());
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+}
+
+TEST_F(ScreeDBTest, PutFreesReplacedLongStringsTest) {
+  const std::string padding(100, '.');
+  for (int count : {8, NODE_KEYS - 1}) {                                 // publish, else txn
+    for (int round = 0; round < 4; round++) {
+      for (int i = 0; i < count; i++) {
+        std::string istr = std::to_string(i);
+        std::string expected = round % 2 ? istr : padding + istr + std::to_string(round);
+        ASSERT_TRUE(db->Put(WriteOptions(), istr, expected).ok());
+      }
+      ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") == 1);
+      ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == (uint64_t) count);
+      ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+    }
+    Reopen();
+    for (int i = 0; i < count; i++) {
+      std::string istr = std::to_string(i);
+      std::string value;
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+    }
+  }
+}
+
+TEST_F(ScreeDBTest, RecoveryUnlinksEmptyLeavesTest) {
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  WriteBatch batch;
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    if (i % 10) batch.Delete(std::to_string(i));
+  }
+  for (int i = COMPACT_LIMIT / 2; i <= COMPACT_LIMIT; i += 10) {         // empties some leaves
+    batch.Delete(std::to_string(i));
+  }
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  delete db;
+  auto tree = new ScreeDBTree(PATH);
+  const uint64_t unlinked = tree->GetRecoveryStats().unlinked;
+  ASSERT_TRUE(unlinked > 0);
+  delete tree;
+  tree = new ScreeDBTree(PATH);
+  ASSERT_TRUE(tree->GetRecoveryStats().unlinked == 0);
+  delete tree;
+  ASSERT_TRUE(ScreeDB::Open(Options(), PATH, &db).ok());
+  for (int i = 10; i < COMPACT_LIMIT / 2; i += 10) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+  }
+}
+
+TEST_F(ScreeDBTest, CompactPinnedOrphansTest) {
+  const std::string long_value(4096, 'x');
+  for (int i = 0; i < NODE_KEYS; i++) {                                  // fill the leaf
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), long_value).ok());
+  }
+  ScreeDBPinnedValue pinned[3];
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, std::to_string(i), &pinned[i]).ok());
+  }
+  const std::string new_value(4096, 'y');
+  ASSERT_TRUE(db->Put(WriteOptions(), "0", new_value).ok());            // splits full leaf
+  ASSERT_TRUE(db->Put(WriteOptions(), "1", new_value).ok());            // publishes in place
+  ASSERT_TRUE(db->Delete(WriteOptions(), "2").ok());
+  for (int i = 0; i < 3; i++) ASSERT_TRUE(pinned[i].value() == long_value);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "0", &value).ok() && value == std::string(4096, 'y'));
+  ASSERT_TRUE(db->Get(ReadOptions(), "2", &value).IsNotFound());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS - 1);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") >= 3 * long_value.size());
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") >= 3 * long_value.size());
+  for (int i = 0; i < 3; i++) pinned[i].Reset();
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS - 1);
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), "1", &value).ok() && value == std::string(4096, 'y'));
+}
+
+TEST_F(ScreeDBTest, SplitLeafOfPinnedOrphansTest) {
+  const std::string long_value(4096, 'x');
+  for (int i = 0; i < NODE_KEYS; i++) {                                  // fill the leaf
+    ASSERT_TRUE(db->Put(WriteOptions(), "k" + std::to_string(i + 10), long_value).ok());
+  }
+  std::vector<ScreeDBPinnedValue> pinned(NODE_KEYS);
+  for (int i = 0; i < NODE_KEYS; i++) {
+    const std::string key = "k" + std::to_string(i + 10);
+    ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, key, &pinned[i]).ok());
+    if (i >= 2) ASSERT_TRUE(db->Delete(WriteOptions(), key).ok());      // leaves pinned orphans
+  }
+  ASSERT_TRUE(db->Put(WriteOptions(), "k5", "split by three used keys").ok());
+  for (int i = 0; i < 2; i++) {                                          // only orphans are left
+    ASSERT_TRUE(db->Delete(WriteOptions(), "k" + std::to_string(i + 10)).ok());
+  }
+  for (int i = 0; i < NODE_KEYS; i++) {                                  // splits leaf of orphans
+    ASSERT_TRUE(db->Put(WriteOptions(), "k" + std::to_string(i + 100), "v").ok());
+  }
+  for (int i = 0; i < NODE_KEYS; i++) ASSERT_TRUE(pinned[i].value() == long_value);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS + 1);
+  int count = 0;
+  auto it = db->NewIterator(ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_TRUE(it->key().ToString() == (count < NODE_KEYS ? "k" + std::to_string(count + 100)
+                                                           : "k5"));
+    count++;
+  }
+  delete it;
+  ASSERT_TRUE(count == NODE_KEYS + 1);
+  for (int i = 0; i < NODE_KEYS; i++) pinned[i].Reset();
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS + 1);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "k5", &value).ok() && value == "split by three used keys");
+}
+
+TEST_F(ScreeDBTest, LeafCountsMatchRecoveryTest) {
+  const std::string long_value(100, 'x');
+  for (int i = 0; i < NODE_KEYS * 4; i++) {                              // splits leaves
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), long_value).ok());
+  }
+  for (int i = 0; i < NODE_KEYS * 2; i++) {                              // merges leaves
+    ASSERT_TRUE(db->Delete(WriteOptions(), std::to_string(i * 2)).ok());
+  }
+  WriteBatch batch;
+  for (int i = 0; i < 10; i++) batch.Put("b" + std::to_string(i), long_value);
+  batch.Delete("3");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  ScreeDBPinnedValue pinned;
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "1", &pinned).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "1", std::string(200, 'y')).ok()); // orphans pinned value
+  pinned.Reset();
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  const uint64_t keys = IntProperty(db, "rocksdb.screedb.num-keys");
+  const uint64_t pmem_bytes = IntProperty(db, "rocksdb.screedb.pmem-bytes-used");
+  const uint64_t orphaned_bytes = IntProperty(db, "rocksdb.screedb.orphaned-string-bytes");
+  ASSERT_TRUE(keys == NODE_KEYS * 2 + 9);
+  ASSERT_TRUE(orphaned_bytes >= long_value.size());
+  ASSERT_TRUE(pmem_bytes >= leaves * sizeof(ScreeDBLeaf) + keys * long_value.size());
+  Reopen();                                                              // counted by scanning
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") == leaves);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == keys);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.pmem-bytes-used") == pmem_bytes);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == orphaned_bytes);
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.pmem-bytes-used") < pmem_bytes);
+}
+
+TEST_F(ScreeDBTest, BackgroundCompactionTest) {
+  delete db;
+  std::remove(PATH.c_str());
+  ScreeDBOptions screedb_options;
+  screedb_options.reclaim_interval_ms = 10;
+  screedb_options.compact_in_background = true;
+  ASSERT_TRUE(ScreeDB::Open(Options(), screedb_options, PATH, &db).ok());
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  const std::string long_value(100, 'x');
+  ASSERT_TRUE(db->Put(WriteOptions(), "long", long_value).ok());
+  ScreeDBPinnedValue pinned;
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "long", &pinned).ok());
+  WriteBatch batch;                                                      // batches don't merge
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    if (i % 10) batch.Delete(std::to_string(i));
+  }
+  batch.Delete("long");                                                  // orphans pinned value
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") >= long_value.size());
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  pinned.Reset();
+  for (int wait = 0; wait < 500; wait++) {                               // without CompactRange
+    if (IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0 &&
+        IntProperty(db, "rocksdb.screedb.num-leaves") < leaves / 2) break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") < leaves / 2);
+  CheckEveryTenthKey(db);
+  Reopen();
+  CheckEveryTenthKey(db);
+}
+
+// =============================================================================================
+// TEST ITERATORS
+// =============================================================================================
+
+TEST_F(ScreeDBTest, IteratorEmptyTest) {
+  Iterator* it = db->NewIterator(ReadOptions());
+  it->SeekToFirst();
+  ASSERT_FALSE(it->Valid());
+  it->SeekToLast();
+  ASSERT_FALSE(it->Valid());
+  it->Seek("abc");
+  ASSERT_FALSE(it->Valid());
+  delete it;
+}
+
+TEST_F(ScreeDBTest, IteratorSingleLeafTest) {
+  ASSERT_TRUE(db->Put(WriteOptions(), "def", "B2").ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "abc", "A1").ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "hij", "C3").ok());
+  Iterator* it = db->NewIterator(ReadOptions());
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid() && it->key() == "abc" && it->value() == "A1");
+  it->Next();
+  ASSERT_TRUE(it->Valid() && it->key() == "def" && it->value() == "B2");
+  it->Next();
+  ASSERT_TRUE(it->Valid() && it->key() == "hij" && it->value() == "C3");
+  it->Next();
+  ASSERT_FALSE(it->Valid());
+  it->SeekToLast();
+  ASSERT_TRUE(it->Valid() && it->key() == "hij");
+  it->Prev();
+  ASSERT_TRUE(it->Valid() && it->key() == "def");
+  it->Prev();
+  ASSERT_TRUE(it->Valid() && it->key() == "abc");
+  it->Prev();
+  ASSERT_FALSE(it->Valid());
+  it->Seek("b");
+  ASSERT_TRUE(it->Valid() && it->key() == "def");
+  it->Seek("def");
+  ASSERT_TRUE(it->Valid() && it->key() == "def");
+  it->Seek("z");
+  ASSERT_FALSE(it->Valid());
+  ASSERT_TRUE(it->status().ok());
+  delete it;
+}
+
+TEST_F(ScreeDBTest, IteratorLargeTest) {
+  for (int i = 100000; i < 200000; i++) {
+    std::string istr = std::to_string(i);
+    assert(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  for (int i = 150000; i < 160000; i++) {
+    assert(db->Delete(WriteOptions(), std::to_string(i)).ok());        // leaves go empty
+  }
+  Iterator* it = db->NewIterator(ReadOptions());
+  int expected = 100000;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    if (expected == 150000) expected = 160000;
+    assert(it->key() == std::to_string(expected));
+    assert(it->value() == std::to_string(expected) + "!");
+    expected++;
+  }
+  ASSERT_TRUE(expected == 200000);
+  for (it->SeekToLast(); it->Valid(); it->Prev()) {
+    expected--;
+    if (expected == 159999) expected = 149999;
+    assert(it->key() == std::to_string(expected));
+  }
+  ASSERT_TRUE(expected == 100000);
+  it->Seek("155555");
+  ASSERT_TRUE(it->Valid() && it->key() == "160000");
+  it->Prev();
+  ASSERT_TRUE(it->Valid() && it->key() == "149999");
+  delete it;
+}
+
+TEST_F(ScreeDBTest, IteratorAfterRecoveryTest) {
+  for (int i = 1; i <= SINGLE_INNER_LIMIT; i++) {
+    std::string istr = std::to_string(10000 + i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  Reopen();
+  Iterator* it = db->NewIterator(ReadOptions());
+  int count = 0;
+  std::string last;
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_TRUE(it->key().ToString() > last);
+    last = it->key().ToString();
+    count++;
+  }
+  ASSERT_TRUE(count == SINGLE_INNER_LIMIT);
+  delete it;
+}
+
+TEST_F(ScreeDBTest, IteratorPinnedValuesTest) {
+  const std::string long_value(4096, 'x');
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", long_value).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key2", long_value).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key3", "short").ok());
+  Iterator* it = db->NewIterator(ReadOptions());
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid() && it->key() == "key1" && it->value() == long_value);
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", std::string(4096, 'y')).ok());
+  ASSERT_TRUE(db->Delete(WriteOptions(), "key2").ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key3", "other").ok());
+  ASSERT_TRUE(it->value() == long_value);                                // left in place
+  it->Next();
+  ASSERT_TRUE(it->Valid() && it->key() == "key2" && it->value() == long_value);
+  it->Next();
+  ASSERT_TRUE(it->Valid() && it->key() == "key3" && it->value() == "short");
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") >= 2 * long_value.size());
+  delete it;                                                             // releases pins
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+  it = db->NewIterator(ReadOptions());
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid() && it->key() == "key1" && it->value() == std::string(4096, 'y'));
+  delete it;
+}
+
+TEST_F(ScreeDBTest, NewIteratorsTest) {
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
+  std::vector<Iterator*> iterators;
+  std::vector<ColumnFamilyHandle*> families = {db->DefaultColumnFamily()};
+  ASSERT_TRUE(db->NewIterators(ReadOptions(), families, &iterators).ok());
+  ASSERT_TRUE(iterators.size() == 1);
+  iterators[0]->SeekToFirst();
+  ASSERT_TRUE(iterators[0]->Valid() && iterators[0]->key() == "key1");
+  delete iterators[0];
+}
+
+// =============================================================================================
+// TEST COMPARATORS
+// =============================================================================================
+
+const int COMPARATOR_LIMIT = NODE_KEYS * 20;
+
+std::string BigEndianKey(uint64_t n) {
+  std::string key(sizeof(n), 0);
+  for (int i = sizeof(n); i--; n >>= 8) key[i] = (char) (n & 0xFF);
+  return key;
+}
+
+TEST_F(ScreeDBTest, BigEndianIntegerKeysTest) {
+  for (int i = COMPARATOR_LIMIT; i > 0; i--) {                           // includes zero bytes
+    ASSERT_TRUE(db->Put(WriteOptions(), BigEndianKey(i * 255), std::to_string(i)).ok());
+  }
+  Reopen();
+  int expected = 1;
+  auto it = db->NewIterator(ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    ASSERT_TRUE(it->key() == BigEndianKey(expected * 255));
+    ASSERT_TRUE(it->value() == std::to_string(expected++));
+  }
+  delete it;
+  ASSERT_TRUE(expected == COMPARATOR_LIMIT + 1);
+}
+
+TEST_F(ScreeDBTest, ComparatorMismatchTest) {
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
+  delete db;
+  Options options;
+  options.comparator = ReverseBytewiseComparator();
+  ASSERT_TRUE(ScreeDB::Open(options, PATH, &db).IsInvalidArgument() && db == nullptr);
+  ASSERT_TRUE(ScreeDB::Open(Options(), PATH, &db).ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).ok() && value == "value1");
+}
+
+TEST_F(ScreeDBTest, ReverseComparatorTest) {
+  delete db;
+  std::remove(PATH.c_str());
+  Options options;
+  options.comparator = ReverseBytewiseComparator();
+  ASSERT_TRUE(ScreeDB::Open(options, PATH, &db).ok());
+  for (int i = 1; i <= COMPARATOR_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  for (int pass = 0; pass < 2; pass++) {                                 // before and after reopen
+    for (int i = 1; i <= COMPARATOR_LIMIT; i++) {
+      std::string istr = std::to_string(i);
+      std::string value;
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+    }
+    int count = 0;
+    std::string last;
+    auto it = db->NewIterator(ReadOptions());
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      ASSERT_TRUE(count == 0 || it->key().ToString() < last);            // descending bytes
+      last = it->key().ToString();
+      count++;
+    }
+    it->Seek("5");
+    ASSERT_TRUE(it->Valid() && it->key() == "5");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->key() == "499");
+    delete it;
+    ASSERT_TRUE(count == COMPARATOR_LIMIT);
+    const std::string limit = std::to_string(COMPARATOR_LIMIT);
+    std::vector<Slice> keys = {"1", "zzz", limit, "5", "0"};
+    std::vector<std::string> values;
+    std::vector<Status> status = db->MultiGet(ReadOptions(), keys, &values);
+    ASSERT_TRUE(status[0].ok() && values[0] == "1!" && status[1].IsNotFound());
+    ASSERT_TRUE(status[2].ok() && values[2] == limit + "!");
+    ASSERT_TRUE(status[3].ok() && values[3] == "5!" && status[4].IsNotFound());
+    delete db;
+    ASSERT_TRUE(ScreeDB::Open(options, PATH, &db).ok());
+  }
+}
+
+// =============================================================================================
+// TEST MERGE OPERATORS
+// =============================================================================================
+
+std::string EncodeCounter(const uint64_t counter) {                     // as uint64add reads
+  std::string result;
+  PutFixed64(&result, counter);
+  return result;
+}
+
+class FailingMergeOperator : public AssociativeMergeOperator {          // fails on "bad" operand
+public:
+  virtual bool Merge(const Slice& key, const Slice* existing_value, const Slice& value,
+                     std::string* new_value, Logger* logger) const override {
+    if (value == "bad") return false;
+    *new_value = (existing_value ? existing_value->ToString() : "") + value.ToString();
+    return true;
+  }
+  virtual const char* Name() const override { return "FailingMergeOperator"; }
+};
+
+ScreeDB* OpenWithMergeOperator(ScreeDB* db, std::shared_ptr<MergeOperator> merge_operator) {
+  delete db;
+  Options options;
+  options.merge_operator = merge_operator;
+  ScreeDB* merging_db;
+  Status s = ScreeDB::Open(options, PATH, &merging_db);
+  assert(s.ok());
+  return merging_db;
+}
+
+TEST_F(ScreeDBTest, UInt64AddMergeTest) {
+  db = OpenWithMergeOperator(db, MergeOperators::CreateUInt64AddOperator());
+  for (int pass = 1; pass <= 3; pass++) {
+    for (int i = 1; i <= COMPARATOR_LIMIT; i++) {
+      ASSERT_TRUE(db->Merge(WriteOptions(), std::to_string(i), EncodeCounter(i)).ok());
+    }
+  }
+  WriteBatch batch;
+  batch.Merge("1", EncodeCounter(1ULL << 40));
+  batch.Merge("1", EncodeCounter(1));
+  batch.Put("2", EncodeCounter(100));
+  batch.Merge("2", EncodeCounter(1));
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  db = OpenWithMergeOperator(db, MergeOperators::CreateUInt64AddOperator());
+  for (int i = 1; i <= COMPARATOR_LIMIT; i++) {
+    std::string value;
+    const uint64_t expected = i == 1 ? (1ULL << 40) + 4 : i == 2 ? 101 : i * 3;
+    ASSERT_TRUE(db->Get(ReadOptions(), std::to_string(i), &value).ok());
+    ASSERT_TRUE(value == EncodeCounter(expected));
+  }
+}
+
+TEST_F(ScreeDBTest, StringAppendMergeTest) {
+  db = OpenWithMergeOperator(db, MergeOperators::CreateStringAppendOperator());
+  std::string expected;
+  for (int i = 1; i <= 20; i++) {                                        // grows past short size
+    ASSERT_TRUE(db->Merge(WriteOptions(), "list", std::to_string(i)).ok());
+    expected += (i == 1 ? "" : ",") + std::to_string(i);
+  }
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "list", &value).ok() && value == expected);
+  WriteBatch batch;
+  batch.Merge("list", "21");
+  batch.Delete("other");
+  batch.Merge("other", "a");
+  batch.Merge("other", "b");
+  batch.Delete("list");
+  batch.Merge("list", "x");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  std::string value2;
+  ASSERT_TRUE(db->Get(ReadOptions(), "list", &value2).ok() && value2 == "x");
+  std::string value3;
+  ASSERT_TRUE(db->Get(ReadOptions(), "other", &value3).ok() && value3 == "a,b");
+}
+
+TEST_F(ScreeDBTest, FailedMergeWriteBatchTest) {
+  db = OpenWithMergeOperator(db, std::make_shared<FailingMergeOperator>());
+  ASSERT_TRUE(db->Merge(WriteOptions(), "key1", "value").ok());
+  ASSERT_TRUE(db->Merge(WriteOptions(), "key1", "bad").IsCorruption());
+  WriteBatch batch;
+  batch.Put("key0", "value0");
+  batch.Merge("key1", "1");
+  batch.Merge("key2", "bad");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).IsCorruption());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key0", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).ok() && value == "value");
+  ASSERT_TRUE(db->Put(WriteOptions(), "key3", "value3").ok());           // locks were released
+}
+
+// =============================================================================================
+// TEST POOL OPTIONS
+// =============================================================================================
+
+TEST_F(ScreeDBTest, PoolOptionsTest) {
+  delete db;
+  std::remove(PATH.c_str());
+  ScreeDBOptions screedb_options;
+  screedb_options.pool_size = PMEMOBJ_MIN_POOL * 16;
+  screedb_options.layout = "ScreeDBPoolOptionsTest";
+  screedb_options.prefault = true;
+  ASSERT_TRUE(ScreeDB::Open(Options(), screedb_options, PATH, &db).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
+  delete db;
+  ASSERT_TRUE(ScreeDB::Open(Options(), PATH, &db).IsIOError() && db == nullptr);
+  ASSERT_TRUE(ScreeDB::Open(Options(), screedb_options, PATH, &db).ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).ok() && value == "value1");
+}
+
+TEST_F(ScreeDBTest, WriteFullPoolTest) {
+  delete db;
+  std::remove(PATH.c_str());
+  ScreeDBOptions screedb_options;
+  screedb_options.pool_size = PMEMOBJ_MIN_POOL;
+  ASSERT_TRUE(ScreeDB::Open(Options(), screedb_options, PATH, &db).ok());
+  for (int i = 0; i < 1000; i++) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), std::to_string(i)).ok());
+  }
+  WriteBatch batch;                                                      // splits, then runs out
+  const std::string big(4096, 'x');
+  for (int i = 0; i < 4000; i++) batch.Put("big" + std::to_string(i), big);
+  batch.Delete("500");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).IsIOError());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "big0", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), "500", &value).ok() && value == "500");
+  ASSERT_TRUE(db->Put(WriteOptions(), "big0", "small").ok());           // leaves were unlocked
+  ASSERT_TRUE(db->Delete(WriteOptions(), "999").ok());
+  auto count_keys = [&] {
+    int count = 0;
+    Iterator* it = db->NewIterator(ReadOptions());
+    for (it->SeekToFirst(); it->Valid(); it->Next()) count++;
+    delete it;
+    return count;
+  };
+  ASSERT_EQ(count_keys(), 1000);
+  delete db;
+  ASSERT_TRUE(ScreeDB::Open(Options(), screedb_options, PATH, &db).ok());
+  ASSERT_EQ(count_keys(), 1000);
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), "big0", &value).ok() && value == "small");
+}
+
+TEST_F(ScreeDBTest, PoolSetTest) {
+  delete db;
+  const std::string set_path = PATH + ".set";
+  const std::string part1 = PATH + ".part1";
+  const std::string part2 = PATH + ".part2";
+  std::remove(part1.c_str());
+  std::remove(part2.c_str());
+  {
+    std::ofstream set_file(set_path);
+    set_file << "PMEMPOOLSET\n"
+             << "# two parts on the same device\n"
+             << "32M " << part1 << "\n"
+             << "32M " << part2 << "\n";
+  }
+  ASSERT_TRUE(ScreeDB::Open(Options(), set_path, &db).ok());
+  for (int i = 1; i <= NODE_KEYS * 4; i++) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), "set").ok());
+  }
+  delete db;
+  ASSERT_TRUE(access(part1.c_str(), F_OK) == 0 && access(part2.c_str(), F_OK) == 0);
+  ASSERT_TRUE(ScreeDB::Open(Options(), set_path, &db).ok());
+  for (int i = 1; i <= NODE_KEYS * 4; i++) {
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), std::to_string(i), &value).ok() && value == "set");
+  }
+  delete db;
+  db = nullptr;
+  std::remove(set_path.c_str());
+  std::remove(part1.c_str());
+  std::remove(part2.c_str());
+  ASSERT_TRUE(ScreeDB::Open(Options(), PATH, &db).ok());
+}
+
+// =============================================================================================
+// TEST VALUE CACHE
+// =============================================================================================
+
+void OpenWithCache(ScreeDB** db, const size_t cache_size) {
+  delete *db;
+  ScreeDBOptions screedb_options;
+  screedb_options.cache_size = cache_size;
+  Status s = ScreeDB::Open(Options(), screedb_options, PATH, db);
+  assert(s.ok());
+}
+
+TEST_F(ScreeDBTest, CacheHitsAndMissesTest) {
+  OpenWithCache(&db, 1 << 20);
+  for (int i = 0; i < NODE_KEYS * 4; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  for (int pass = 0; pass < 2; pass++) {                                 // miss, then hit
+    for (int i = 0; i < NODE_KEYS * 4; i++) {
+      std::string istr = std::to_string(i);
+      std::string value;
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+    }
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-misses") == NODE_KEYS * 4);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-hits") == NODE_KEYS * 4);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-usage") > 0);
+
+  std::string value;
+  ASSERT_TRUE(db->Put(WriteOptions(), "1", "put").ok());
+  ASSERT_TRUE(db->Get(ReadOptions(), "1", &value).ok() && value == "put");
+  ASSERT_TRUE(db->Delete(WriteOptions(), "2").ok());
+  ASSERT_TRUE(db->Get(ReadOptions(), "2", &value).IsNotFound());
+  ASSERT_TRUE(db->Merge(WriteOptions(), "3", "merge").ok());             // no merge operator
+  std::string value3;
+  ASSERT_TRUE(db->Get(ReadOptions(), "3", &value3).ok() && value3 == "merge");
+  WriteBatch batch;
+  batch.Put("4", "batch");
+  batch.Delete("5");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  std::string value4;
+  ASSERT_TRUE(db->Get(ReadOptions(), "4", &value4).ok() && value4 == "batch");
+  ASSERT_TRUE(db->Get(ReadOptions(), "5", &value4).IsNotFound());
+}
+
+TEST_F(ScreeDBTest, CacheBudgetTest) {
+  const size_t budget = 64 * 1024;
+  OpenWithCache(&db, budget);
+  const std::string padding(1000, '.');
+  for (int i = 0; i < NODE_KEYS * 10; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, padding + istr).ok());
+  }
+  for (int i = 0; i < NODE_KEYS * 10; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == padding + istr);
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-usage") <= budget);
+  OpenWithCache(&db, 0);                                                 // disabled by default
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "1", &value).ok() && value == padding + "1");
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-hits") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-misses") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.cache-usage") == 0);
+}
+
+// =============================================================================================
+// TEST HASH INDEX
+// =============================================================================================
+
+void OpenWithHashIndex(ScreeDB** db) {
+  delete *db;
+  ScreeDBOptions screedb_options;
+  screedb_options.hash_index = true;
+  Status s = ScreeDB::Open(Options(), screedb_options, PATH, db);
+  assert(s.ok());
+}
+
+TEST_F(ScreeDBTest, HashIndexTest) {
+  OpenWithHashIndex(&db);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "1", &value).IsNotFound());        // headless
+  ASSERT_TRUE(db->Delete(WriteOptions(), "1").ok());
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {                             // splits move keys
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+    value.clear();
+  }
+  ASSERT_TRUE(db->Get(ReadOptions(), "0", &value).IsNotFound());
+  for (int i = 1; i <= COMPACT_LIMIT; i++) {                             // merges move keys
+    if (i % 10 == 0) continue;
+    ASSERT_TRUE(db->Delete(WriteOptions(), std::to_string(i)).ok());
+  }
+  ASSERT_TRUE(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  for (int pass = 0; pass < 2; pass++) {                                 // index is rebuilt
+    for (int i = 1; i <= COMPACT_LIMIT; i++) {
+      std::string istr = std::to_string(i);
+      Status s = db->Get(ReadOptions(), istr, &value);
+      ASSERT_TRUE(i % 10 ? s.IsNotFound() : s.ok() && value == istr + "!");
+      value.clear();
+    }
+    OpenWithHashIndex(&db);
+  }
+}
+
+TEST_F(ScreeDBTest, HashIndexSlotsTest) {
+  OpenWithHashIndex(&db);
+  std::string value;
+  for (int round = 0; round < 4; round++) {                              // updates move slots
+    for (int i = 0; i < NODE_KEYS / 2; i++) {
+      std::string istr = std::to_string(i);
+      ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + std::to_string(round)).ok());
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok());
+      ASSERT_TRUE(value == istr + std::to_string(round));
+      value.clear();
+    }
+  }
+  ScreeDBPinnedValue pinned;
+  ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, "1", &pinned).ok());
+  WriteBatch batch;                                                      // pinned slot is hidden
+  batch.Put("1", "batched");
+  batch.Put("2", "batched");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  ASSERT_TRUE(pinned.value() == "13");
+  pinned.Reset();
+  for (int i = NODE_KEYS / 2; i < NODE_KEYS * 2; i++) {                  // splits move keys
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), "split").ok());
+  }
+  for (int pass = 0; pass < 2; pass++) {                                 // index is rebuilt
+    for (int i = 0; i < NODE_KEYS * 2; i++) {
+      std::string istr = std::to_string(i);
+      ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok());
+      ASSERT_TRUE(value == (i == 1 || i == 2 ? "batched" : i < NODE_KEYS / 2 ? istr + "3"
+                                                                         : "split"));
+      value.clear();
+    }
+    OpenWithHashIndex(&db);
+  }
+}
+
+// =============================================================================================
+// TEST COLUMN FAMILIES
+// =============================================================================================
+
+const int FAMILY_LIMIT = NODE_KEYS * 10;
+
+Status OpenWithFamilies(ScreeDB** db, const std::vector<std::string>& names,
+                        std::vector<ColumnFamilyHandle*>* handles, bool create = false) {
+  for (auto handle : *handles) delete handle;
+  handles->clear();
+  delete *db;
+  DBOptions db_options;
+  db_options.create_missing_column_families = create;
+  std::vector<ColumnFamilyDescriptor> families;
+  for (auto& name : names) families.push_back(ColumnFamilyDescriptor(name, ColumnFamilyOptions()));
+  return ScreeDB::Open(db_options, ScreeDBOptions(), PATH, families, handles, db);
+}
+
+TEST_F(ScreeDBTest, DefaultColumnFamilyTest) {
+  auto handle = db->DefaultColumnFamily();
+  ASSERT_TRUE(handle != nullptr);
+  ASSERT_TRUE(handle->GetName() == kDefaultColumnFamilyName && handle->GetID() == 0);
+  ASSERT_TRUE(db->Put(WriteOptions(), handle, "key", "value").ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key", &value).ok() && value == "value");
+  ASSERT_TRUE(db->DropColumnFamily(handle).IsInvalidArgument());
+  ColumnFamilyHandle* created;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), kDefaultColumnFamilyName,
+                                     &created).IsInvalidArgument());
+}
+
+TEST_F(ScreeDBTest, ColumnFamiliesTest) {
+  ColumnFamilyOptions reverse_options;
+  reverse_options.comparator = ReverseBytewiseComparator();
+  ColumnFamilyHandle* one;
+  ColumnFamilyHandle* two;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "one", &one).ok());
+  ASSERT_TRUE(db->CreateColumnFamily(reverse_options, "two", &two).ok());
+  ASSERT_TRUE(one->GetName() == "one" && one->GetID() == 1 && two->GetID() == 2);
+  ColumnFamilyHandle* duplicate;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "one",
+                                     &duplicate).IsInvalidArgument());
+  for (int i = 1; i <= FAMILY_LIMIT; i++) {                              // same keys, split apart
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+    ASSERT_TRUE(db->Put(WriteOptions(), one, istr, istr + "1").ok());
+    if (i % 2) {
+      ASSERT_TRUE(db->Put(WriteOptions(), two, istr, istr + "2").ok());
+    }
+  }
+  WriteBatch batch;                                                      // spans three families
+  batch.Delete("1");
+  batch.Put(one, "1", "one");
+  batch.Merge(two, "1", "two");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  delete one;                                                            // stays open in db
+  delete two;
+
+  std::vector<ColumnFamilyHandle*> handles;
+  ASSERT_TRUE(OpenWithFamilies(&db, {"two", kDefaultColumnFamilyName, "missing"},
+                               &handles).IsInvalidArgument());
+  ASSERT_TRUE(db == nullptr);
+  Options options;
+  options.comparator = ReverseBytewiseComparator();
+  std::vector<ColumnFamilyDescriptor> families = {{"two", options}, {"one", options}};
+  ASSERT_TRUE(ScreeDB::Open(DBOptions(), ScreeDBOptions(), PATH, families, &handles,
+                            &db).IsInvalidArgument());                   // comparator mismatch
+  ASSERT_TRUE(db == nullptr);
+  families[1].options = ColumnFamilyOptions();
+  ASSERT_TRUE(ScreeDB::Open(DBOptions(), ScreeDBOptions(), PATH, families, &handles, &db).ok());
+  ASSERT_TRUE(handles.size() == 2 && handles[0]->GetName() == "two" && handles[1]->GetID() == 1);
+  two = handles[0];
+  one = handles[1];
+  std::vector<Status> status;
+  std::vector<std::string> values;
+  status = db->MultiGet(ReadOptions(), {db->DefaultColumnFamily(), one, two}, {"1", "1", "1"},
+                        &values);
+  ASSERT_TRUE(status[0].IsNotFound() && values[1] == "one" && values[2] == "two");
+  for (int i = 2; i <= FAMILY_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), istr, &value).ok() && value == istr + "!");
+    value.clear();
+    ASSERT_TRUE(db->Get(ReadOptions(), one, istr, &value).ok() && value == istr + "1");
+    value.clear();
+    Status s = db->Get(ReadOptions(), two, istr, &value);
+    ASSERT_TRUE(i % 2 ? s.ok() && value == istr + "2" : s.IsNotFound());
+  }
+  auto it = db->NewIterator(ReadOptions(), two);                         // in reverse order
+  it->SeekToFirst();
+  ASSERT_TRUE(it->Valid() && it->key() == "99");
+  delete it;
+  uint64_t keys;
+  ASSERT_TRUE(db->GetIntProperty(one, "rocksdb.screedb.num-keys", &keys) && keys == FAMILY_LIMIT);
+  ASSERT_TRUE(db->GetIntProperty(two, "rocksdb.screedb.num-keys", &keys) &&
+              keys == FAMILY_LIMIT / 2);
+  for (auto handle : handles) delete handle;
+}
+
+TEST_F(ScreeDBTest, DropColumnFamilyTest) {
+  std::vector<ColumnFamilyHandle*> handles;
+  ASSERT_TRUE(OpenWithFamilies(&db, {"one", "two"}, &handles, true).ok());
+  for (int i = 1; i <= FAMILY_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), handles[0], istr, istr).ok());
+  }
+  auto one = handles[0];
+  ASSERT_TRUE(db->DropColumnFamily(one).ok());
+  ASSERT_TRUE(db->DropColumnFamily(one).IsInvalidArgument());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), one, "1", &value).ok() && value == "1");  // still open
+  WriteBatch batch;
+  batch.Put(one, "1", "dropped");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).IsInvalidArgument());
+  ASSERT_TRUE(OpenWithFamilies(&db, {"one"}, &handles).IsInvalidArgument());  // handle reclaims
+  ASSERT_TRUE(OpenWithFamilies(&db, {"one", "two"}, &handles, true).ok());
+  ASSERT_TRUE(handles[0]->GetID() == 3 && handles[1]->GetID() == 2);    // ids aren't reused
+  ASSERT_TRUE(db->Get(ReadOptions(), handles[0], "1", &value).IsNotFound());
+  ASSERT_TRUE(db->DropColumnFamily(handles[0]).ok());
+  delete handles[0];                                                     // frees leaves now
+  handles.erase(handles.begin());
+  ColumnFamilyHandle* three;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "three", &three).ok());
+  ASSERT_TRUE(three->GetID() == 3);                                      // reclaimed id is free
+  handles.push_back(three);
+  ASSERT_TRUE(OpenWithFamilies(&db, {"two", "three"}, &handles).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), handles[1], "key", "value").ok());
+  for (auto handle : handles) delete handle;
+  delete db;
+  db = nullptr;
+
+  auto owner = new ScreeDBTree(PATH);                                    // closed before reclaim
+  owner->DropFamily(owner->FindFamily("three"));
+  delete owner;
+  owner = new ScreeDBTree(PATH);                                         // reclaims on open
+  persistent_ptr<ScreeDBFamily> four;
+  ASSERT_TRUE(owner->CreateFamily("four", BytewiseComparator(), &four).ok());
+  ASSERT_TRUE(four->id.get_ro() == 3 && owner->FindFamily("three") == nullptr);
+  delete owner;
+}
+
+// =============================================================================================
+// TEST SNAPSHOTS
+// =============================================================================================
+
+const int SNAPSHOT_LIMIT = NODE_KEYS * 10;
+
+TEST_F(ScreeDBTest, SnapshotTest) {
+  const SequenceNumber empty = db->GetLatestSequenceNumber();
+  const Snapshot* before = db->GetSnapshot();                            // sees no keys
+  ASSERT_TRUE(before->GetSequenceNumber() == empty);
+  for (int i = 1; i <= SNAPSHOT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Put(WriteOptions(), istr, istr + "!").ok());
+  }
+  ASSERT_TRUE(db->GetLatestSequenceNumber() == empty + SNAPSHOT_LIMIT);
+  const Snapshot* snapshot = db->GetSnapshot();
+  for (int i = 1; i <= SNAPSHOT_LIMIT; i++) {                            // splits leaves again
+    std::string istr = std::to_string(i);
+    Status s = i % 3 == 0 ? db->Delete(WriteOptions(), istr)
+               : i % 3 == 1 ? db->Put(WriteOptions(), istr, istr + "?") : Status::OK();
+    ASSERT_TRUE(s.ok());
+    ASSERT_TRUE(db->Put(WriteOptions(), istr + "+", "new").ok());
+  }
+  uint64_t count, bytes;
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.num-snapshots", &count) && count == 2);
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.snapshot-bytes", &bytes) && bytes > 0);
+
+  ReadOptions at_snapshot;
+  at_snapshot.snapshot = snapshot;
+  ReadOptions at_before;
+  at_before.snapshot = before;
+  std::string value;
+  for (int i = 1; i <= SNAPSHOT_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    ASSERT_TRUE(db->Get(at_snapshot, istr, &value).ok() && value == istr + "!");
+    value.clear();
+    ASSERT_TRUE(db->Get(at_snapshot, istr + "+", &value).IsNotFound());
+    ASSERT_TRUE(db->Get(at_before, istr, &value).IsNotFound());
+    Status s = db->Get(ReadOptions(), istr, &value);
+    ASSERT_TRUE(i % 3 == 0 ? s.IsNotFound() : s.ok() && value == istr + (i % 3 == 1 ? "?" : "!"));
+    value.clear();
+  }
+  std::vector<std::string> values;
+  auto statuses = db->MultiGet(at_snapshot, {"1", "1+", "3"}, &values);
+  ASSERT_TRUE(statuses[0].ok() && statuses[1].IsNotFound() && statuses[2].ok());
+  ASSERT_TRUE(values[0] == "1!" && values[2] == "3!");
+
+  std::vector<std::string> expected;
+  for (int i = 1; i <= SNAPSHOT_LIMIT; i++) expected.push_back(std::to_string(i));
+  std::sort(expected.begin(), expected.end());
+  Iterator* it = db->NewIterator(at_snapshot);
+  size_t pos = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next(), pos++) {
+    ASSERT_TRUE(pos < expected.size() && it->key() == expected[pos]);
+    ASSERT_TRUE(it->value() == expected[pos] + "!");
+  }
+  ASSERT_TRUE(pos == expected.size());
+  for (it->SeekToLast(); it->Valid(); it->Prev()) {
+    ASSERT_TRUE(it->key() == expected[--pos]);
+  }
+  ASSERT_TRUE(pos == 0);
+  it->Seek("3");                                                         // deleted since
+  ASSERT_TRUE(it->Valid() && it->key() == "3" && it->value() == "3!");
+  it->Next();
+  ASSERT_TRUE(it->Valid() && it->key() == "30");                         // skips "3+"
+  it->Prev();
+  it->Prev();
+  ASSERT_TRUE(it->Valid() && it->key() == "299");
+  delete it;
+  it = db->NewIterator(at_before);
+  it->SeekToFirst();
+  ASSERT_TRUE(!it->Valid());
+  delete it;
+
+  db->ReleaseSnapshot(snapshot);
+  ASSERT_TRUE(db->Get(at_before, "1", &value).IsNotFound());             // still kept
+  db->ReleaseSnapshot(before);
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.num-snapshots", &count) && count == 0);
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.snapshot-bytes", &bytes) && bytes == 0);
+  ASSERT_TRUE(db->Put(WriteOptions(), "1", "later").ok());               // saves nothing
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.snapshot-bytes", &bytes) && bytes == 0);
+}
+
+TEST_F(ScreeDBTest, SnapshotIteratorWritesTest) {
+  auto key = [](int i) { return std::to_string(SNAPSHOT_LIMIT + i); };   // sorts numerically
+  for (int i = 0; i < SNAPSHOT_LIMIT; i++) ASSERT_TRUE(db->Put(WriteOptions(), key(i), "old").ok());
+  ReadOptions options;
+  options.snapshot = db->GetSnapshot();
+  Iterator* it = db->NewIterator(options);
+  it->SeekToFirst();                                                     // before any versions
+  ASSERT_TRUE(it->Valid() && it->key() == key(0));
+  ASSERT_TRUE(db->Put(WriteOptions(), key(SNAPSHOT_LIMIT - 1), "new").ok());
+  ASSERT_TRUE(db->Delete(WriteOptions(), key(SNAPSHOT_LIMIT / 2)).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), key(SNAPSHOT_LIMIT / 2) + "+", "new").ok());
+  int count = 0;
+  for (; it->Valid(); it->Next(), count++) {
+    ASSERT_TRUE(it->key() == key(count) && it->value() == "old");
+  }
+  ASSERT_TRUE(count == SNAPSHOT_LIMIT);
+  it->SeekToLast();                                                      // and backward
+  ASSERT_TRUE(it->Valid() && it->key() == key(SNAPSHOT_LIMIT - 1) && it->value() == "old");
+  ASSERT_TRUE(db->Put(WriteOptions(), key(0), "new").ok());
+  ASSERT_TRUE(db->Delete(WriteOptions(), key(1)).ok());
+  for (; it->Valid(); it->Prev()) {
+    ASSERT_TRUE(it->key() == key(--count) && it->value() == "old");
+  }
+  ASSERT_TRUE(count == 0);
+  delete it;
+  db->ReleaseSnapshot(options.snapshot);
+}
+
+TEST_F(ScreeDBTest, SnapshotWriteBatchTest) {
+  ColumnFamilyHandle* other;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "other", &other).ok());
+  WriteBatch first;
+  first.Put("key", "1");
+  first.Put(other, "key", "1");
+  ASSERT_TRUE(db->Write(WriteOptions(), &first).ok());
+  const SequenceNumber sequence = db->GetLatestSequenceNumber();
+  ReadOptions options;
+  options.snapshot = db->GetSnapshot();                                  // covers both families
+  ASSERT_TRUE(options.snapshot->GetSequenceNumber() == sequence);
+  WriteBatch second;
+  second.Put("key", "2");
+  second.Delete(other, "key");
+  second.Put(other, "new", "2");
+  ASSERT_TRUE(db->Write(WriteOptions(), &second).ok());
+  ASSERT_TRUE(db->GetLatestSequenceNumber() == sequence + 3);            // one per update
+  std::string value;
+  ASSERT_TRUE(db->Get(options, "key", &value).ok() && value == "1");
+  value.clear();
+  ASSERT_TRUE(db->Get(options, other, "key", &value).ok() && value == "1");
+  ASSERT_TRUE(db->Get(options, other, "new", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), other, "key", &value).IsNotFound());
+  uint64_t bytes;
+  ASSERT_TRUE(db->GetIntProperty(other, "rocksdb.screedb.snapshot-bytes", &bytes) && bytes > 0);
+  db->ReleaseSnapshot(options.snapshot);                                 // trims every family
+  ASSERT_TRUE(db->GetIntProperty(other, "rocksdb.screedb.snapshot-bytes", &bytes) && bytes == 0);
+  delete other;
+}
+
+// =============================================================================================
+// TEST BULK LOADING
+// =============================================================================================
+
+const int BULK_LIMIT = NODE_KEYS * 100 + 7;
+
+class SortedSource : public Iterator {                                   // entries from a vector
+public:
+  explicit SortedSource(const std::vector<std::pair<std::string, std::string>>& entries,
+                        const Status& status = Status::OK())
+          : entries_(entries), status_(status) {}
+  bool Valid() const override { return pos_ < entries_.size(); }
+  void SeekToFirst() override { pos_ = 0; }
+  void SeekToLast() override { pos_ = entries_.size() - 1; }
+  void Seek(const Slice& target) override {
+    for (pos_ = 0; Valid() && Slice(entries_[pos_].first).compare(target) < 0; pos_++) {}
+  }
+  void Next() override { pos_++; }
+  void Prev() override { pos_ = pos_ > 0 ? pos_ - 1 : entries_.size(); }
+  Slice key() const override { return entries_[pos_].first; }
+  Slice value() const override { return entries_[pos_].second; }
+  Status status() const override { return status_; }
+private:
+  const std::vector<std::pair<std::string, std::string>> entries_;
+  const Status status_;                                                  // reported when done
+  size_t pos_ = 0;
+};
+
+std::vector<std::pair<std::string, std::string>> BulkEntries(const std::string& prefix,
+                                                             const int count) {
+  std::vector<std::pair<std::string, std::string>> entries;
+  for (int i = 0; i < count; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s%06d", prefix.c_str(), i);
+    const std::string long_value(100, (char) ('a' + i % 26));
+    entries.emplace_back(key, i % 3 ? std::string(key) + "!" : long_value);
+  }
+  return entries;
+}
+
+void VerifyBulkEntries(ScreeDB* db,
+                       const std::vector<std::pair<std::string, std::string>>& entries) {
+  for (auto& entry : entries) {
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), entry.first, &value).ok() && value == entry.second);
+  }
+}
+
+TEST_F(ScreeDBTest, BulkLoadTest) {
+  auto entries = BulkEntries("key", BULK_LIMIT);
+  SortedSource source(entries);
+  ASSERT_TRUE(db->BulkLoad(nullptr, &source).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == BULK_LIMIT);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") ==
+              (BULK_LIMIT + NODE_KEYS - 1) / NODE_KEYS);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.tree-depth") == 3);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.leaf-splits") == 0);
+  VerifyBulkEntries(db, entries);
+  auto it = db->NewIterator(ReadOptions());
+  size_t count = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next(), count++) {
+    ASSERT_TRUE(it->key() == entries[count].first && it->value() == entries[count].second);
+  }
+  delete it;
+  ASSERT_TRUE(count == entries.size());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key000100+", "new").ok());        // splits packed leaf
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.leaf-splits") == 1);
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == BULK_LIMIT + 1);
+  VerifyBulkEntries(db, entries);
+}
+
+TEST_F(ScreeDBTest, BulkLoadBetweenKeysTest) {
+  for (int i = 0; i < NODE_KEYS * 4; i++) {                              // several leaves
+    ASSERT_TRUE(db->Put(WriteOptions(), "a" + std::to_string(i), "a").ok());
+    ASSERT_TRUE(db->Put(WriteOptions(), "c" + std::to_string(i), "c").ok());
+  }
+  ASSERT_TRUE(db->Put(WriteOptions(), "e1", "e").ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "e9", "e").ok());
+  auto before = BulkEntries("0", NODE_KEYS * 3);                         // before first key
+  auto between = BulkEntries("b", NODE_KEYS * 3);                        // between leaves
+  auto inside = BulkEntries("e5", NODE_KEYS * 3);                        // between keys of leaf
+  auto after = BulkEntries("f", NODE_KEYS * 3);                          // after last key
+  for (auto entries : {before, between, inside, after}) {
+    SortedSource source(entries);
+    ASSERT_TRUE(db->BulkLoad(nullptr, &source).ok());
+  }
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS * 8 + 2 + NODE_KEYS * 12);
+  for (auto entries : {before, between, inside, after}) VerifyBulkEntries(db, entries);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "e1", &value).ok() && value == "e");
+  value.clear();
+  ASSERT_TRUE(db->Get(ReadOptions(), "e9", &value).ok() && value == "e");
+  auto it = db->NewIterator(ReadOptions());
+  std::string last;
+  size_t count = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next(), count++) {
+    ASSERT_TRUE(count == 0 || it->key().ToString() > last);
+    last = it->key().ToString();
+  }
+  delete it;
+  ASSERT_TRUE(count == NODE_KEYS * 20 + 2);
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == NODE_KEYS * 20 + 2);
+  for (auto entries : {before, between, inside, after}) VerifyBulkEntries(db, entries);
+}
+
+TEST_F(ScreeDBTest, BulkLoadMergesEmptiedLeavesTest) {
+  const int count = NODE_KEYS * 8;
+  auto entries = BulkEntries("key", count);
+  for (auto& entry : entries) ASSERT_TRUE(db->Put(WriteOptions(), entry.first, entry.second).ok());
+  std::vector<ScreeDBPinnedValue> pinned(count / 2);
+  for (int i = 0; i < count / 2; i++) {                                  // empty middle leaves,
+    const std::string& key = entries[count / 4 + i].first;               // kept unmerged by pins
+    ASSERT_TRUE(db->GetPinned(ReadOptions(), nullptr, key, &pinned[i]).ok());
+    ASSERT_TRUE(db->Delete(WriteOptions(), key).ok());
+  }
+  for (auto& pin : pinned) pin.Reset();
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  std::vector<std::pair<std::string, std::string>> middle(entries.begin() + count / 4,
+                                                          entries.begin() + count * 3 / 4);
+  SortedSource source(middle);
+  ASSERT_TRUE(db->BulkLoad(nullptr, &source).ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == count);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") <
+              leaves + (middle.size() + NODE_KEYS - 1) / NODE_KEYS);     // emptied leaves merged
+  VerifyBulkEntries(db, entries);
+  auto it = db->NewIterator(ReadOptions());
+  size_t n = 0;
+  for (it->SeekToFirst(); it->Valid(); it->Next(), n++) {
+    ASSERT_TRUE(it->key() == entries[n].first && it->value() == entries[n].second);
+  }
+  for (it->SeekToLast(); it->Valid(); it->Prev()) n--;
+  delete it;
+  ASSERT_TRUE(n == 0);
+  const uint64_t merged_leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-leaves") == merged_leaves);
+  VerifyBulkEntries(db, entries);
+}
+
+TEST_F(ScreeDBTest, BulkLoadFailuresTest) {
+  ASSERT_TRUE(db->Put(WriteOptions(), "key000500", "existing").ok());
+  const uint64_t pmem_bytes = IntProperty(db, "rocksdb.screedb.pmem-bytes-used");
+  SortedSource overlapping(BulkEntries("key", BULK_LIMIT));
+  ASSERT_TRUE(db->BulkLoad(nullptr, &overlapping).IsNotSupported());
+  auto unsorted_entries = BulkEntries("key", NODE_KEYS * 2);
+  std::swap(unsorted_entries[NODE_KEYS], unsorted_entries[NODE_KEYS + 1]);
+  SortedSource unsorted(unsorted_entries);
+  ASSERT_TRUE(db->BulkLoad(nullptr, &unsorted).IsInvalidArgument());
+  SortedSource failing(BulkEntries("x", NODE_KEYS * 2), Status::IOError("source failed"));
+  ASSERT_TRUE(db->BulkLoad(nullptr, &failing).IsIOError());
+  auto snapshot = db->GetSnapshot();
+  SortedSource snapshotted(BulkEntries("x", NODE_KEYS * 2));
+  ASSERT_TRUE(db->BulkLoad(nullptr, &snapshotted).IsNotSupported());
+  db->ReleaseSnapshot(snapshot);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == 1);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.pmem-bytes-used") == pmem_bytes);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key000000", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), "x000000", &value).IsNotFound());
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == 1);
+}
+
+TEST_F(ScreeDBTest, BulkLoadColumnFamilyTest) {
+  ColumnFamilyHandle* handle;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "bulk", &handle).ok());
+  auto entries = BulkEntries("key", BULK_LIMIT);
+  SortedSource source(entries);
+  ASSERT_TRUE(db->BulkLoad(handle, &source).ok());
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "key000000", &value).IsNotFound());
+  ASSERT_TRUE(db->Get(ReadOptions(), handle, "key000000", &value).ok());
+  uint64_t keys;
+  ASSERT_TRUE(db->GetIntProperty(handle, "rocksdb.screedb.num-keys", &keys) && keys == BULK_LIMIT);
+  delete handle;
+}
+
+TEST_F(ScreeDBTest, AddFileTest) {
+  const std::string file_path = PATH + ".sst";
+  const Options options;
+  auto entries = BulkEntries("key", BULK_LIMIT);
+  SstFileWriter writer(EnvOptions(), ImmutableCFOptions(options), options.comparator);
+  ASSERT_TRUE(writer.Open(file_path).ok());
+  for (auto& entry : entries) ASSERT_TRUE(writer.Add(entry.first, entry.second).ok());
+  ExternalSstFileInfo file_info;
+  ASSERT_TRUE(writer.Finish(&file_info).ok());
+  ExternalSstFileInfo wrong_info = file_info;
+  wrong_info.num_entries--;
+  ASSERT_TRUE(db->AddFile(&wrong_info, false).IsInvalidArgument());
+  wrong_info = file_info;
+  wrong_info.smallest_key = "key";
+  ASSERT_TRUE(db->AddFile(&wrong_info, false).IsInvalidArgument());
+  wrong_info = file_info;
+  wrong_info.largest_key = entries[BULK_LIMIT - 2].first;
+  ASSERT_TRUE(db->AddFile(&wrong_info, false).IsInvalidArgument());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == 0);         // nothing loaded
+  ASSERT_TRUE(db->AddFile(&file_info, false).ok());
+  ASSERT_TRUE(access(file_path.c_str(), F_OK) == 0);                     // copied, not moved
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == BULK_LIMIT);
+  VerifyBulkEntries(db, entries);
+  ASSERT_TRUE(db->AddFile(file_path, true).IsNotSupported());            // overlaps itself
+  ASSERT_TRUE(access(file_path.c_str(), F_OK) == 0);                     // kept after failure
+
+  auto more = BulkEntries("more", NODE_KEYS * 3);
+  ASSERT_TRUE(writer.Open(file_path).ok());
+  for (auto& entry : more) ASSERT_TRUE(writer.Add(entry.first, entry.second).ok());
+  ASSERT_TRUE(writer.Finish().ok());
+  ASSERT_TRUE(db->AddFile(file_path, true).ok());
+  ASSERT_TRUE(access(file_path.c_str(), F_OK) != 0);                     // moved into pool
+  ASSERT_TRUE(db->AddFile(file_path, true).IsIOError());                 // already gone
+  Reopen();
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.num-keys") == BULK_LIMIT + NODE_KEYS * 3);
+  VerifyBulkEntries(db, entries);
+  VerifyBulkEntries(db, more);
+}
+
+// =============================================================================================
+// TEST STATISTICS
+// =============================================================================================
+
+const int STATS_LIMIT = NODE_KEYS * 20;
+
+TEST_F(ScreeDBTest, TreePropertiesTest) {
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.tree-depth") == 0);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.pmem-bytes-used") == 0);
+  ASSERT_TRUE(db->Put(WriteOptions(), "1", "1!").ok());
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.tree-depth") == 1);
+  const std::string long_value(100, '!');
+  for (int i = 1; i <= STATS_LIMIT; i++) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), long_value).ok());
+  }
+  for (int i = 1; i <= STATS_LIMIT; i++) {
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), std::to_string(i), &value).ok());
+  }
+  const uint64_t leaves = IntProperty(db, "rocksdb.screedb.num-leaves");
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.tree-depth") == 2);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.leaf-splits") == leaves - 1); // no merges yet
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.transactions") > 0);      // at least for splits
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.pmem-bytes-used") >=
+              leaves * sizeof(ScreeDBLeaf) + STATS_LIMIT * long_value.size());
+  const uint64_t matches = IntProperty(db, "rocksdb.screedb.hash-matches");
+  const uint64_t false_positives = IntProperty(db, "rocksdb.screedb.hash-false-positives");
+  ASSERT_TRUE(matches >= STATS_LIMIT && false_positives < matches);
+  std::string rate;
+  ASSERT_TRUE(db->GetProperty("rocksdb.screedb.hash-false-positive-rate", &rate));
+  ASSERT_TRUE(std::stod(rate) == (double) false_positives / matches);
+  uint64_t free_bytes;
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.pmem-bytes-free", &free_bytes));
+
+  ColumnFamilyHandle* other;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "other", &other).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), other, "1", "1!").ok());
+  uint64_t value;
+  ASSERT_TRUE(db->GetAggregatedIntProperty("rocksdb.screedb.num-keys", &value));
+  ASSERT_TRUE(value == STATS_LIMIT + 1);
+  ASSERT_TRUE(db->GetAggregatedIntProperty("rocksdb.screedb.tree-depth", &value) && value == 2);
+  ASSERT_TRUE(db->GetAggregatedIntProperty("rocksdb.screedb.pmem-bytes-free", &value));
+  ASSERT_TRUE(value <= free_bytes);
+  ASSERT_FALSE(db->GetAggregatedIntProperty("rocksdb.screedb.no-such-property", &value));
+  delete other;
+}
+
+TEST_F(ScreeDBTest, StatisticsTest) {
+  delete db;
+  Options options;
+  options.statistics = CreateDBStatistics();
+  ASSERT_TRUE(ScreeDB::Open(options, PATH, &db).ok());
+  ASSERT_TRUE(db->Put(WriteOptions(), "key1", "value1").ok());
+  ASSERT_TRUE(db->Merge(WriteOptions(), "key2", "value2").ok());
+  ASSERT_TRUE(db->Delete(WriteOptions(), "key3").ok());
+  WriteBatch batch;
+  batch.Put("key4", "value4");
+  batch.Put("key5", "value5");
+  ASSERT_TRUE(db->Write(WriteOptions(), &batch).ok());
+  Statistics* stats = options.statistics.get();
+  ASSERT_TRUE(stats->getTickerCount(NUMBER_KEYS_WRITTEN) == 5);
+  ASSERT_TRUE(stats->getTickerCount(WRITE_DONE_BY_SELF) == 1);
+  ASSERT_TRUE(stats->getTickerCount(BYTES_WRITTEN) >= 4 + 10 + 4 + 4 + 6 + 4 + 6);
+
+  std::string value = "prefix";                                          // Get appends
+  ASSERT_TRUE(db->Get(ReadOptions(), "key1", &value).ok() && value == "prefixvalue1");
+  ASSERT_TRUE(db->Get(ReadOptions(), "key3", &value).IsNotFound());
+  ASSERT_TRUE(stats->getTickerCount(NUMBER_KEYS_READ) == 2);
+  ASSERT_TRUE(stats->getTickerCount(BYTES_READ) == 6);
+  std::vector<std::string> values;
+  db->MultiGet(ReadOptions(), {"key1", "key3", "key4"}, &values);
+  ASSERT_TRUE(stats->getTickerCount(NUMBER_MULTIGET_CALLS) == 1);
+  ASSERT_TRUE(stats->getTickerCount(NUMBER_MULTIGET_KEYS_READ) == 3);
+  ASSERT_TRUE(stats->getTickerCount(NUMBER_MULTIGET_BYTES_READ) == 12);
+}
+
+TEST_F(ScreeDBTest, PerfContextTest) {
+  SetPerfLevel(kEnableTime);
+  screedb_perf_context.Reset();
+  const std::string long_value(100, '!');
+  for (int i = 1; i <= STATS_LIMIT; i++) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), long_value).ok());
+  }
+  ASSERT_TRUE(screedb_perf_context.transaction_count > 0);
+  ASSERT_TRUE(screedb_perf_context.leaf_split_count ==
+              IntProperty(db, "rocksdb.screedb.leaf-splits"));
+  ASSERT_TRUE(screedb_perf_context.leaf_search_nanos > 0);
+  ASSERT_TRUE(screedb_perf_context.transaction_nanos > 0);
+  ASSERT_TRUE(screedb_perf_context.string_alloc_nanos > 0);
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "1", &value).ok());
+  ASSERT_TRUE(screedb_perf_context.hash_match_count >= 1);
+  ASSERT_TRUE(screedb_perf_context.ToString().find("leaf_split_count = ") != std::string::npos);
+
+  SetPerfLevel(kDisable);
+  screedb_perf_context.Reset();
+  for (int i = 1; i <= STATS_LIMIT; i++) {
+    ASSERT_TRUE(db->Put(WriteOptions(), "new" + std::to_string(i), long_value).ok());
+  }
+  ASSERT_TRUE(screedb_perf_context.transaction_count == 0);
+  ASSERT_TRUE(screedb_perf_context.transaction_nanos == 0);
+  SetPerfLevel(kEnableCount);                                            // default level
+}
+
+TEST_F(ScreeDBTest, KeyMayExistTest) {
+  delete db;
+  Options options;
+  options.statistics = CreateDBStatistics();
+  ASSERT_TRUE(ScreeDB::Open(options, PATH, &db).ok());
+  std::string value;
+  ASSERT_FALSE(db->KeyMayExist(ReadOptions(), "1", &value));             // empty tree
+  for (int i = 0; i < STATS_LIMIT; i += 2) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), std::to_string(i) + "!").ok());
+  }
+  uint64_t negatives = 0;
+  for (int i = 0; i < STATS_LIMIT; i++) {
+    bool value_found = true;
+    const bool may_exist = db->KeyMayExist(ReadOptions(), std::to_string(i), &value,
+                                           &value_found);
+    ASSERT_TRUE(!value_found && value.empty());                          // pool never read
+    ASSERT_TRUE(may_exist || i % 2);                                     // no false negatives
+    if (!may_exist) negatives++;
+  }
+  ASSERT_TRUE(negatives > STATS_LIMIT / 4);                              // most absent keys
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.key-may-exist-calls") == STATS_LIMIT + 1);
+  ASSERT_TRUE(IntProperty(db, "rocksdb.screedb.key-may-exist-negatives") == negatives + 1);
+  ASSERT_TRUE(options.statistics->getTickerCount(BLOOM_FILTER_USEFUL) == negatives + 1);
+
+  for (int i = 1; i < STATS_LIMIT; i += 2) {
+    ASSERT_TRUE(db->Get(ReadOptions(), std::to_string(i), &value).IsNotFound());
+  }
+  std::string rate;
+  ASSERT_TRUE(db->GetProperty("rocksdb.screedb.key-may-exist-false-positive-rate", &rate));
+  ASSERT_TRUE(std::stod(rate) > 0.0 && std::stod(rate) < 0.5);
+
+  auto snapshot = db->GetSnapshot();
+  ASSERT_TRUE(db->Delete(WriteOptions(), "0").ok());
+  ReadOptions snapshot_options;
+  snapshot_options.snapshot = snapshot;
+  ASSERT_TRUE(db->KeyMayExist(snapshot_options, "0", &value));           // still in snapshot
+  db->ReleaseSnapshot(snapshot);
+}
+
+TEST_F(ScreeDBTest, KeyMayExistCachedOrIndexedTest) {
+  OpenWithCache(&db, 1 << 20);
+  ASSERT_TRUE(db->Put(WriteOptions(), "key", "value").ok());
+  std::string value;
+  bool value_found = false;
+  ASSERT_TRUE(db->KeyMayExist(ReadOptions(), "key", &value, &value_found) && !value_found);
+  ASSERT_TRUE(db->Get(ReadOptions(), "key", &value).ok());               // now cached
+  value.clear();
+  ASSERT_TRUE(db->KeyMayExist(ReadOptions(), "key", &value, &value_found) && value_found);
+  ASSERT_TRUE(value == "value");
+
+  OpenWithHashIndex(&db);
+  for (int i = 0; i < STATS_LIMIT; i += 2) {
+    ASSERT_TRUE(db->Put(WriteOptions(), std::to_string(i), std::to_string(i) + "!").ok());
+  }
+  for (int i = 0; i < STATS_LIMIT; i++) {                                // full-width hashes
+    ASSERT_TRUE(db->KeyMayExist(ReadOptions(), std::to_string(i), &value) == (i % 2 == 0));
+  }
+}
+
+// =============================================================================================
+// TEST MULTITHREADED TREE
+// =============================================================================================
+
+const int THREADED_LIMIT = 200000;
+const int THREADED_WRITERS = 4;
+
+TEST_F(ScreeDBTest, MultithreadedPutTest) {
+  std::vector<std::thread> threads;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    threads.emplace_back([this, t] {
+      for (int i = t; i < THREADED_LIMIT; i += THREADED_WRITERS) {
+        std::string istr = std::to_string(i);
+        assert(db->Put(WriteOptions(), istr, istr).ok());
+        std::string value;
+        assert(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+      }
+    });
+  }
+  for (auto& thread : threads) thread.join();
+  for (int i = 0; i < THREADED_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    assert(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedWriteBatchTest) {
+  const int keys = 100;
+  const int rounds = 50;
+  std::atomic<bool> writing(true);
+  std::atomic<int> torn(0);
+  std::thread reader([&] {                                               // pairs are never torn
+    for (int i = 0; writing.load(); i = (i + 1) % (keys * THREADED_WRITERS)) {
+      std::string a, b;
+      if (!db->Get(ReadOptions(), "a" + std::to_string(i), &a).ok()) continue;
+      assert(db->Get(ReadOptions(), "b" + std::to_string(i), &b).ok());
+      if (std::stoi(b) < std::stoi(a)) torn++;
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t, keys, rounds] {
+      for (int round = 1; round <= rounds; round++) {
+        WriteBatch batch;
+        for (int i = t; i < keys * THREADED_WRITERS; i += THREADED_WRITERS) {
+          batch.Put("a" + std::to_string(i), std::to_string(round));
+          batch.Put("b" + std::to_string(i), std::to_string(round));
+        }
+        assert(db->Write(WriteOptions(), &batch).ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  ASSERT_TRUE(torn == 0);
+  for (int i = 0; i < keys * THREADED_WRITERS; i++) {
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), "b" + std::to_string(i), &value).ok());
+    ASSERT_TRUE(value == std::to_string(rounds));
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedColumnFamilyWriteBatchTest) {
+  const int keys = 100;
+  const int rounds = 50;
+  ColumnFamilyHandle* other;
+  ASSERT_TRUE(db->CreateColumnFamily(ColumnFamilyOptions(), "other", &other).ok());
+  std::atomic<bool> writing(true);
+  std::atomic<int> torn(0);
+  std::thread reader([&] {                                               // pairs are never torn
+    for (int i = 0; writing.load(); i = (i + 1) % (keys * THREADED_WRITERS)) {
+      std::string a, b;
+      if (!db->Get(ReadOptions(), std::to_string(i), &a).ok()) continue;
+      assert(db->Get(ReadOptions(), other, std::to_string(i), &b).ok());
+      if (std::stoi(b) < std::stoi(a)) torn++;
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t, keys, rounds, other] {
+      for (int round = 1; round <= rounds; round++) {
+        WriteBatch batch;
+        for (int i = t; i < keys * THREADED_WRITERS; i += THREADED_WRITERS) {
+          batch.Put(std::to_string(i), std::to_string(round));
+          batch.Put(other, std::to_string(i), std::to_string(round));
+        }
+        assert(db->Write(WriteOptions(), &batch).ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  ASSERT_TRUE(torn == 0);
+  for (int i = 0; i < keys * THREADED_WRITERS; i++) {
+    std::string value;
+    ASSERT_TRUE(db->Get(ReadOptions(), other, std::to_string(i), &value).ok());
+    ASSERT_TRUE(value == std::to_string(rounds));
+  }
+  delete other;
+}
+
+TEST_F(ScreeDBTest, MultithreadedSnapshotTest) {
+  const int keys = 100;
+  const int rounds = 50;
+  std::atomic<bool> writing(true);
+  std::atomic<int> torn(0);
+  std::thread reader([&] {                                               // snapshots are whole
+    while (writing.load()) {
+      ReadOptions options;
+      options.snapshot = db->GetSnapshot();
+      std::string first;
+      Iterator* it = db->NewIterator(options);
+      int count = 0;
+      for (it->SeekToFirst(); it->Valid(); it->Next(), count++) {
+        if (first.empty()) first = it->value().ToString();
+        else if (it->value() != first) torn++;
+      }
+      if (count % keys) torn++;
+      delete it;
+      std::string value;
+      for (int i = 0; i < keys && !first.empty(); i += 7) {
+        assert(db->Get(options, std::to_string(i), &value).ok());
+        if (value != first) torn++;
+        value.clear();
+      }
+      db->ReleaseSnapshot(options.snapshot);
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t, keys, rounds] {
+      for (int round = 1; round <= rounds; round++) {
+        WriteBatch batch;                                                // every key, same value
+        for (int i = 0; i < keys; i++) {
+          batch.Put(std::to_string(i), std::to_string(t * rounds + round));
+        }
+        assert(db->Write(WriteOptions(), &batch).ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  ASSERT_TRUE(torn == 0);
+  uint64_t bytes;
+  ASSERT_TRUE(db->GetIntProperty("rocksdb.screedb.snapshot-bytes", &bytes) && bytes == 0);
+}
+
+TEST_F(ScreeDBTest, MultithreadedReadersAndWritersTest) {
+  for (int i = 0; i < THREADED_LIMIT; i += 2) {
+    std::string istr = std::to_string(i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  std::atomic<bool> writing(true);
+  std::thread reader([this, &writing] {
+    while (writing) {
+      for (int i = 0; i < THREADED_LIMIT; i += 20) {
+        std::string istr = std::to_string(i);
+        std::string value;
+        assert(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+      }
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t] {
+      for (int i = 1 + 2 * t; i < THREADED_LIMIT; i += 2 * THREADED_WRITERS) {
+        std::string istr = std::to_string(i);
+        assert(db->Put(WriteOptions(), istr, istr).ok());
+        assert(db->Delete(WriteOptions(), istr).ok());
+        assert(db->Put(WriteOptions(), istr, istr + "!").ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  Reopen();
+  for (int i = 0; i < THREADED_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    assert(db->Get(ReadOptions(), istr, &value).ok() && value == (i % 2 ? istr + "!" : istr));
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedSharedReadersTest) {
+  ASSERT_TRUE(db->Put(WriteOptions(), "a", "1").ok());                   // both in one leaf
+  ASSERT_TRUE(db->Put(WriteOptions(), "b", "2").ok());
+  std::atomic<bool> holding(false);
+  std::atomic<bool> other_done(false);
+  std::atomic<bool> waited(false);
+  std::thread holder([&] {                                               // holds leaf in visitor
+    db->GetInPlace(ReadOptions(), nullptr, "a", [&](const Slice&) {
+      holding = true;
+      const auto started = std::chrono::steady_clock::now();
+      while (!other_done && std::chrono::steady_clock::now() - started < std::chrono::seconds(5)) {
+        std::this_thread::yield();
+      }
+      waited = other_done.load();
+    });
+  });
+  while (!holding) std::this_thread::yield();
+  std::string value;
+  ASSERT_TRUE(db->Get(ReadOptions(), "b", &value).ok() && value == "2");  // while "a" is held
+  other_done = true;
+  holder.join();
+  ASSERT_TRUE(waited);
+  ASSERT_TRUE(db->Put(WriteOptions(), "a", "3").ok());                   // writers still exclusive
+}
+
+TEST_F(ScreeDBTest, MultithreadedPinnedReadersAndWritersTest) {
+  const int keys = NODE_KEYS * 4;
+  for (int i = 0; i < keys; i++) {
+    assert(db->Put(WriteOptions(), std::to_string(i), std::string(100, 'a')).ok());
+  }
+  std::atomic<bool> writing(true);
+  std::thread reader([this, &writing, keys] {
+    ScreeDBPinnedValue pinned[4];                                        // held across writes
+    for (int n = 0; writing; n++) {
+      auto& value = pinned[n % 4];
+      Status s = db->GetPinned(ReadOptions(), nullptr, std::to_string(n % keys), &value);
+      if (!s.ok()) continue;
+      const Slice slice = value.value();
+      for (size_t i = 0; i < slice.size(); i++) assert(slice[i] == slice[0]);
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t, keys] {
+      for (int n = 0; n < THREADED_LIMIT / 20; n++) {
+        std::string istr = std::to_string((n * THREADED_WRITERS + t) % keys);
+        assert(db->Put(WriteOptions(), istr, std::string(100 + n % 200, 'a' + n % 26)).ok());
+        if (n % 7 == 0) assert(db->Delete(WriteOptions(), istr).ok());
+        if (n % 101 == 0) assert(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  assert(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  assert(IntProperty(db, "rocksdb.screedb.orphaned-string-bytes") == 0);
+}
+
+TEST_F(ScreeDBTest, MultithreadedCachedReadersAndWritersTest) {
+  OpenWithCache(&db, 1 << 20);
+  const int keys = NODE_KEYS * 20;
+  for (int i = 0; i < keys; i++) assert(db->Put(WriteOptions(), std::to_string(i), "0").ok());
+  std::atomic<bool> writing(true);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 2; t++) {
+    readers.emplace_back([this, &writing, keys] {
+      while (writing) {
+        for (int i = 0; i < keys; i++) {
+          std::string value;
+          assert(db->Get(ReadOptions(), std::to_string(i), &value).ok());
+        }
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t, keys] {
+      for (int round = 1; round <= 20; round++) {
+        for (int i = t; i < keys; i += THREADED_WRITERS) {
+          assert(db->Put(WriteOptions(), std::to_string(i), std::to_string(round)).ok());
+        }
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  for (auto& reader : readers) reader.join();
+  for (int i = 0; i < keys; i++) {                                       // no stale values
+    std::string value;
+    assert(db->Get(ReadOptions(), std::to_string(i), &value).ok() && value == "20");
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedHashIndexTest) {
+  OpenWithHashIndex(&db);
+  for (int i = 0; i < THREADED_LIMIT; i += 2) {
+    std::string istr = std::to_string(i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  std::atomic<bool> writing(true);
+  std::thread reader([this, &writing] {
+    while (writing) {
+      for (int i = 0; i < THREADED_LIMIT; i += 20) {
+        std::string istr = std::to_string(i);
+        std::string value;
+        assert(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+      }
+    }
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t] {
+      for (int i = 1 + 2 * t; i < THREADED_LIMIT; i += 2 * THREADED_WRITERS) {
+        std::string istr = std::to_string(i);
+        assert(db->Put(WriteOptions(), istr, istr).ok());
+        assert(db->Delete(WriteOptions(), istr).ok());
+        if (i % 3) assert(db->Put(WriteOptions(), istr, istr + "!").ok());
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  for (int i = 0; i < THREADED_LIMIT; i++) {
+    std::string istr = std::to_string(i);
+    std::string value;
+    Status s = db->Get(ReadOptions(), istr, &value);
+    assert((i % 2 == 0 || i % 3) ? s.ok() && value == (i % 2 ? istr + "!" : istr) : s.IsNotFound());
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedDeleteAndCompactTest) {
+  for (int i = 0; i < THREADED_LIMIT; i += 10) {                         // never deleted
+    std::string istr = std::to_string(i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  std::atomic<bool> writing(true);
+  std::thread reader([this, &writing] {
+    while (writing) {
+      for (int i = 0; i < THREADED_LIMIT; i += 100) {
+        std::string istr = std::to_string(i);
+        std::string value;
+        assert(db->Get(ReadOptions(), istr, &value).ok() && value == istr);
+      }
+    }
+  });
+  std::thread compactor([this, &writing] {
+    while (writing) assert(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([this, t] {
+      for (int round = 0; round < 2; round++) {
+        for (int i = t; i < THREADED_LIMIT; i += THREADED_WRITERS) {
+          if (i % 10) assert(db->Put(WriteOptions(), std::to_string(i), "!").ok());
+        }
+        for (int i = t; i < THREADED_LIMIT; i += THREADED_WRITERS) {
+          if (i % 10) assert(db->Delete(WriteOptions(), std::to_string(i)).ok());
+        }
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  compactor.join();
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < THREADED_LIMIT; i++) {
+      std::string istr = std::to_string(i);
+      std::string value;
+      Status s = db->Get(ReadOptions(), istr, &value);
+      assert(i % 10 ? s.IsNotFound() : s.ok() && value == istr);
+    }
+    Reopen();
+  }
+}
+
+TEST_F(ScreeDBTest, MultithreadedIteratorTest) {
+  for (int i = 0; i < THREADED_LIMIT; i += 2) {
+    std::string istr = std::to_string(100000 + i);
+    assert(db->Put(WriteOptions(), istr, istr).ok());
+  }
+  std::thread writer([this] {
+    for (int i = 1; i < THREADED_LIMIT; i += 2) {
+      std::string istr = std::to_string(100000 + i);
+      assert(db->Put(WriteOptions(), istr, istr).ok());
+    }
+  });
+  for (int pass = 0; pass < 4; pass++) {
+    Iterator* it = db->NewIterator(ReadOptions());
+    int count = 0;
+    std::string last;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      std::string key = it->key().ToString();
+      assert(key > last);
+      last = key;
+      count++;
+    }
+    assert(count >= THREADED_LIMIT / 2);                                 // includes all old keys
+    delete it;
+  }
+  writer.join();
+}
+
+TEST_F(ScreeDBTest, MultithreadedIteratorWritersTest) {
+  const std::string prefix(40, 'k');                                     // keys are never short
+  auto key = [&prefix](int i) { return prefix + std::to_string(100000 + i); };
+  const int keys = NODE_KEYS * 20;
+  for (int i = 0; i < keys; i += 4) {                                    // never deleted
+    assert(db->Put(WriteOptions(), key(i), std::string(100, 'a')).ok());
+  }
+  std::atomic<bool> writing(true);
+  auto check = [&](Iterator* it, std::string* last, int* stable) {
+    const std::string k = it->key().ToString();
+    const Slice value = it->value();                                     // whole, never torn
+    assert(k.compare(0, prefix.size(), prefix) == 0);
+    assert(value.size() > 0);
+    for (size_t i = 0; i < value.size(); i++) assert(value[i] == value[0]);
+    assert(last->empty() || k != *last);
+    if ((std::stoi(k.substr(prefix.size())) - 100000) % 4 == 0) (*stable)++;
+    *last = k;
+  };
+  std::thread reader([&] {
+    for (int pass = 0; writing; pass++) {
+      Iterator* it = db->NewIterator(ReadOptions());
+      std::string last;
+      int stable = 0;
+      if (pass % 2) {
+        for (it->SeekToLast(); it->Valid(); it->Prev()) {
+          assert(last.empty() || it->key().ToString() < last);
+          check(it, &last, &stable);
+        }
+      } else {
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+          assert(last.empty() || it->key().ToString() > last);
+          check(it, &last, &stable);
+        }
+      }
+      assert(stable == keys / 4);
+      delete it;
+    }
+  });
+  std::thread compactor([this, &writing] {                               // merges sparse leaves
+    while (writing) assert(db->CompactRange(CompactRangeOptions(), nullptr, nullptr).ok());
+  });
+  std::vector<std::thread> writers;
+  for (int t = 0; t < THREADED_WRITERS; t++) {
+    writers.emplace_back([&, t] {
+      for (int n = 0; n < 20; n++) {
+        for (int i = t; i < keys; i += THREADED_WRITERS) {
+          const char c = (char) ('a' + (n + i) % 26);
+          if (i % 4 == 0) {                                              // in place, else moved
+            assert(db->Put(WriteOptions(), key(i), std::string(n / 2 % 2 ? 150 : 100, c)).ok());
+          } else if (n % 2 == 0) {
+            assert(db->Put(WriteOptions(), key(i), std::string(64, c)).ok());
+          } else {
+            assert(db->Delete(WriteOptions(), key(i)).ok());             // leaves underflow
+          }
+        }
+      }
+    });
+  }
+  for (auto& writer : writers) writer.join();
+  writing = false;
+  reader.join();
+  compactor.join();
+}